@@ -0,0 +1,314 @@
+/*
+ * Scaling benchmark.
+ *
+ * Renders each of the narrator's effects on synthetic layouts of increasing
+ * size, to see where layout setup, spatial lookups, and the mixer stop
+ * scaling linearly. Effects run the same way the narrator runs them: inside
+ * an EffectMixer, under Brightness control, on a headless EffectRunner.
+ *
+ * Output is a tab-separated table on stdout. For each shape and size there's
+ * one "(layout)" row timing setLayout(), then one row per effect with its
+ * average busy time per frame. Memory is the process's resident size after
+ * the row's work, so growth between rows shows what each size costs.
+ *
+ * With -pacing, each layout also runs in real time at the configured frame
+ * rate, sending OPC over loopback to a local OPCSink. A second table shows
+ * how evenly those frames arrived. Its "gap drops" are estimated from long
+ * intervals, so they only mean lost frames if the frame rate stayed fixed.
+ *
+ * -zorder shades in Z-order, as with the runner's option of the same name,
+ * for comparing against wire order.
+ *
+ *    ei-benchmark [-config FILE] [-time SECONDS] [-shapes grid,volume,cloud]
+ *                 [-sizes 1000,3000,...] [-pacing SECONDS] [-zorder]
+ *    ei-benchmark -generate SHAPE PIXELS FILE.json
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "lib/effect_runner.h"
+#include "lib/effect_mixer.h"
+#include "lib/brightness.h"
+#include "lib/camera_flow.h"
+#include "lib/opc_sink.h"
+#include "lib/tinythread.h"
+#include "chaos_particles.h"
+#include "order_particles.h"
+#include "precursor.h"
+#include "rings.h"
+#include "partner_dance.h"
+#include "forest.h"
+#include "synthetic_layout.h"
+
+
+struct BenchmarkEffect {
+    const char *name;
+    Effect *effect;
+};
+
+struct PacingResult {
+    std::string shape;
+    unsigned pixels;
+    OPCSink::Stats stats;
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static double residentMB()
+{
+    // Linux only; elsewhere, report zero
+    unsigned long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (double) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void sinkThread(void *arg)
+{
+    ((OPCSink*) arg)->run(-1);
+}
+
+static bool measurePacing(EffectRunner &runner, float seconds, PacingResult &result)
+{
+    // Real frames, real sleeps, over loopback TCP
+
+    OPCSink sink;
+    if (!sink.listen("127.0.0.1:0")) {
+        perror("Can't listen for OPC connections");
+        return false;
+    }
+
+    char server[32];
+    snprintf(server, sizeof server, "127.0.0.1:%d", sink.getPort());
+    runner.setServer(server);
+
+    tthread::thread thread(sinkThread, &sink);
+    runner.setHeadless(false);
+
+    double start = now();
+    while (now() - start < seconds) {
+        runner.doFrame();
+    }
+
+    runner.setHeadless(true);
+    sink.stop();
+    thread.join();
+
+    result.stats = sink.getStats();
+    return true;
+}
+
+static bool parseList(const char *arg, std::vector<std::string> &list)
+{
+    list.clear();
+    std::string s = arg;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            list.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return !list.empty();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-config FILE] [-time SECONDS] [-shapes grid,volume,cloud] [-sizes N,N,...]\n"
+        "          [-pacing SECONDS] [-zorder]\n"
+        "       %s -generate SHAPE PIXELS FILE.json\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *configFile = "data/config.json";
+    const char *layoutFile = "/tmp/ei-benchmark-layout.json";
+    float secondsPerRow = 1.0;
+    float pacingSeconds = 0;
+    bool zOrder = false;
+    std::vector<PacingResult> pacing;
+    std::vector<std::string> shapes, sizes;
+    parseList("grid,volume,cloud", shapes);
+    parseList("1000,3000,10000,30000,100000", sizes);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-generate") && i + 3 < argc) {
+            SyntheticLayout::Shape shape;
+            if (!SyntheticLayout::parseShape(argv[i+1], shape)) {
+                fprintf(stderr, "Unknown layout shape \"%s\"\n", argv[i+1]);
+                return 1;
+            }
+            if (!SyntheticLayout::write(argv[i+3], shape, atoi(argv[i+2]))) {
+                perror("Can't write layout");
+                return 1;
+            }
+            return 0;
+
+        } else if (!strcmp(argv[i], "-config") && i + 1 < argc) {
+            configFile = argv[++i];
+        } else if (!strcmp(argv[i], "-time") && i + 1 < argc) {
+            secondsPerRow = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-shapes") && i + 1 < argc) {
+            parseList(argv[++i], shapes);
+        } else if (!strcmp(argv[i], "-sizes") && i + 1 < argc) {
+            parseList(argv[++i], sizes);
+        } else if (!strcmp(argv[i], "-pacing") && i + 1 < argc) {
+            pacingSeconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-zorder")) {
+            zOrder = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *f = fopen(configFile, "r");
+    if (!f) {
+        perror("Can't open config file");
+        return 1;
+    }
+    rapidjson::Document config;
+    rapidjson::FileStream istr(f);
+    config.ParseStream<0>(istr);
+    fclose(f);
+    if (config.HasParseError() || !config.IsObject()) {
+        fprintf(stderr, "Parse error in config file\n");
+        return 1;
+    }
+
+    // A camera analyzer that never sees any video, so effects have something to bind to
+    CameraFlowAnalyzer analyzer;
+    analyzer.setConfig(config["flow"]);
+    CameraFlowFusion flow(analyzer);
+
+    ChaosParticles chaos(flow, config["chaosParticles"]);
+    OrderParticles order(flow, config["orderParticles"]);
+    Precursor precursor(flow, config["precursor"]);
+    RingsEffect rings(flow, config["ringsA"]);
+    PartnerDance partnerDance(flow, config["partnerDance"]);
+    Forest forest(flow, config["forest"]);
+
+    const BenchmarkEffect effects[] = {
+        { "chaosParticles", &chaos },
+        { "orderParticles", &order },
+        { "precursor", &precursor },
+        { "rings", &rings },
+        { "partnerDance", &partnerDance },
+        { "forest", &forest },
+    };
+    const unsigned numEffects = sizeof effects / sizeof effects[0];
+
+    EffectMixer mixer;
+    mixer.setConcurrency(config["concurrency"].GetUint());
+    Brightness brightness(mixer);
+    brightness.set(0.0f, config["brightnessLimit"].GetDouble());
+
+    EffectRunner runner;
+    runner.setHeadless();
+    runner.setZOrder(zOrder);
+    runner.setEffect(&brightness);
+    runner.setMaxFrameRate(config["fps"].GetDouble());
+    const float timeDelta = 1.0 / config["fps"].GetDouble();
+
+    printf("shape\tpixels\teffect\tms/frame\tus/frame/kpixel\tframes\tresident MB\n");
+    fflush(stdout);
+
+    for (unsigned s = 0; s < shapes.size(); s++) {
+        SyntheticLayout::Shape shape;
+        if (!SyntheticLayout::parseShape(shapes[s].c_str(), shape)) {
+            fprintf(stderr, "Unknown layout shape \"%s\"\n", shapes[s].c_str());
+            return 1;
+        }
+
+        for (unsigned n = 0; n < sizes.size(); n++) {
+            if (!SyntheticLayout::write(layoutFile, shape, atoi(sizes[n].c_str()))) {
+                perror("Can't write layout");
+                return 1;
+            }
+
+            // Parsing, FrameInfo (including its K-D tree) and topology
+            double start = now();
+            if (!runner.setLayout(layoutFile)) {
+                fprintf(stderr, "Can't load generated layout\n");
+                return 1;
+            }
+            double layoutTime = now() - start;
+            unsigned pixels = runner.getPixelInfo().size();
+
+            printf("%s\t%d\t(layout)\t%.3f\t%.3f\t%d\t%.1f\n", shapes[s].c_str(), pixels,
+                1e3 * layoutTime, 1e6 * layoutTime / (pixels * 1e-3), 1, residentMB());
+            fflush(stdout);
+
+            for (unsigned e = 0; e < numEffects; e++) {
+                mixer.set(effects[e].effect);
+
+                // Warm up: effects resize their buffers for the new layout
+                for (unsigned i = 0; i < 3; i++) {
+                    runner.doFrame(timeDelta);
+                }
+
+                double busy = 0;
+                unsigned frames = 0;
+                start = now();
+                while (frames < 3 || now() - start < secondsPerRow) {
+                    busy += runner.doFrame(timeDelta).busyTime;
+                    frames++;
+                }
+
+                double perFrame = busy / frames;
+                printf("%s\t%d\t%s\t%.3f\t%.3f\t%d\t%.1f\n", shapes[s].c_str(), pixels, effects[e].name,
+                    1e3 * perFrame, 1e6 * perFrame / (pixels * 1e-3), frames, residentMB());
+                fflush(stdout);
+            }
+
+            // One OPC message holds at most 64 kB of pixels
+            if (pacingSeconds > 0 && pixels * 3 <= 0xFFFF) {
+                PacingResult result;
+                result.shape = shapes[s];
+                result.pixels = pixels;
+                mixer.set(effects[0].effect);
+                if (!measurePacing(runner, pacingSeconds, result)) {
+                    return 1;
+                }
+                pacing.push_back(result);
+            }
+        }
+    }
+
+    if (!pacing.empty()) {
+        printf("\nshape\tpixels\tfps\tinterval ms\tjitter ms\tp99 ms\tmax ms\tgap drops\tkB/s\n");
+        for (unsigned i = 0; i < pacing.size(); i++) {
+            const OPCSink::Stats &st = pacing[i].stats;
+            printf("%s\t%d\t%.2f\t%.3f\t%.3f\t%.3f\t%.3f\t%d\t%.1f\n", pacing[i].shape.c_str(),
+                pacing[i].pixels, st.frameRate, 1e3 * st.meanInterval, 1e3 * st.jitter,
+                1e3 * st.p99Interval, 1e3 * st.maxInterval, st.dropped, 1e-3 * st.bytesPerSecond);
+        }
+    }
+
+    mixer.clear();
+    unlink(layoutFile);
+    return 0;
+}
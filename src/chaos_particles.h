@@ -19,7 +19,7 @@
 class ChaosParticles : public ParticleEffect
 {
 public:
-    ChaosParticles(const CameraFlowAnalyzer &flow, const rapidjson::Value &config);
+    ChaosParticles(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(Vec2 location, unsigned seed);
 
     bool isRunning();
@@ -76,7 +76,7 @@ private:
  *                                   Implementation
  *****************************************************************************************/
 
-inline ChaosParticles::ChaosParticles(const CameraFlowAnalyzer &flow, const rapidjson::Value &config)
+inline ChaosParticles::ChaosParticles(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : numParticles(config["numParticles"].GetUint()),
       numDarkParticles(config["numDarkParticles"].GetUint()),
       maxAge(config["maxAge"].GetUint()),
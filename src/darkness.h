@@ -9,4 +9,10 @@ public:
     {
         rgb = Vec3(0,0,0);
     }
+
+    virtual bool isUniform(Vec3& rgb) const
+    {
+        rgb = Vec3(0,0,0);
+        return true;
+    }
 };
@@ -14,12 +14,13 @@
 #include "lib/camera_flow.h"
 #include "lib/rapidjson/document.h"
 #include "lib/sampler.h"
+#include "lib/config_compiler.h"
 
 
 class Forest : public ParticleEffect
 {
 public:
-    Forest(const CameraFlowAnalyzer &flow, const rapidjson::Value &config);
+    Forest(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(unsigned seed);
 
     virtual void beginFrame(const FrameInfo &f);
@@ -33,9 +34,33 @@ private:
         unsigned branchState;
     };
 
+    // Parameters compiled from JSON
+    struct Params {
+        Params(const rapidjson::Value &config);
+
+        std::string palette;
+        unsigned maxParticles;
+        Sampler::Variable outsideMargin;
+        Sampler::Variable flowScale;
+        Sampler::Variable flowFilterRate;
+        Sampler::Variable radius;
+        Sampler::Variable historyDepth;
+        Sampler::Variable newnessBias;
+        Sampler::Variable3D newDirection;
+        Sampler::Variable3D deltaDirection;
+        Sampler::Variable3D newPoint;
+        Sampler::Variable2D newTexCoord;
+        Sampler::Variable walkTexCoord;
+        Sampler::Variable deltaTexCoord;
+        Sampler::Variable maxIntensity;
+        Sampler::Variable intensityRate;
+        Sampler::Variable3D travelRate;
+        Sampler::Variable growthPointsPerSecond;
+    };
+
+    Params params;
     Sampler s;
     CameraFlowCapture flow;
-    const rapidjson::Value& config;
 
     unsigned maxParticles;
     float outsideMargin;
@@ -63,12 +88,38 @@ private:
  *****************************************************************************************/
 
 
-inline Forest::Forest(const CameraFlowAnalyzer &flow, const rapidjson::Value &config)
-    : s(42),
+inline Forest::Params::Params(const rapidjson::Value &config)
+{
+    ConfigCompiler c(config, "forest");
+
+    palette = c.string("palette");
+    maxParticles = c.uint("maxParticles");
+    outsideMargin = c.variable("outsideMargin");
+    flowScale = c.variable("flowScale");
+    flowFilterRate = c.variable("flowFilterRate");
+    radius = c.variable("radius");
+    historyDepth = c.variable("historyDepth");
+    newnessBias = c.variable("newnessBias");
+    newDirection = c.variable3D("newDirection");
+    deltaDirection = c.variable3D("deltaDirection");
+    newPoint = c.variable3D("newPoint");
+    newTexCoord = c.variable2D("newTexCoord");
+    walkTexCoord = c.variable("walkTexCoord");
+    deltaTexCoord = c.variable("deltaTexCoord");
+    maxIntensity = c.variable("maxIntensity");
+    intensityRate = c.variable("intensityRate");
+    travelRate = c.variable3D("travelRate");
+    growthPointsPerSecond = c.variable("growthPointsPerSecond");
+
+    c.finish();
+}
+
+inline Forest::Forest(const CameraFlowFusion &flow, const rapidjson::Value &config)
+    : params(config),
+      s(42),
       flow(flow),
-      config(config),
-      maxParticles(config["maxParticles"].GetUint()),
-      palette(config["palette"].GetString())
+      maxParticles(params.maxParticles),
+      palette(params.palette.c_str())
     {
  }
 
@@ -81,14 +132,14 @@ inline void Forest::reseed(unsigned seed)
     s = Sampler(seed);
     travelAmount = 0;
 
-    newTexCoord = s.value2D(config["newTexCoord"]);
-    outsideMargin = s.value(config["outsideMargin"]);
-    flowScale = s.value(config["flowScale"]);
-    flowFilterRate = s.value(config["flowFilterRate"]);
-    maxIntensity = s.value(config["maxIntensity"]);
-    intensityRate = s.value(config["intensityRate"]);
-    growthPointsPerSecond = s.value(config["growthPointsPerSecond"]);
-    travelRate = s.value3D(config["travelRate"]);
+    newTexCoord = s.value2D(params.newTexCoord);
+    outsideMargin = s.value(params.outsideMargin);
+    flowScale = s.value(params.flowScale);
+    flowFilterRate = s.value(params.flowFilterRate);
+    maxIntensity = s.value(params.maxIntensity);
+    intensityRate = s.value(params.intensityRate);
+    growthPointsPerSecond = s.value(params.growthPointsPerSecond);
+    travelRate = s.value3D(params.travelRate);
 }
 
 inline void Forest::beginFrame(const FrameInfo &f)
@@ -143,23 +194,23 @@ inline void Forest::addPoint()
     ParticleAppearance pa;
     TreeInfo ti;
 
-    pa.radius = s.value(config["radius"]);
+    pa.radius = s.value(params.radius);
     pa.intensity = 0;
 
     int root = std::max<int>(0,
-        s.uniform(appearance.size() - s.value(config["historyDepth"]),
-                  appearance.size() + s.value(config["newnessBias"])));
+        s.uniform(appearance.size() - s.value(params.historyDepth),
+                  appearance.size() + s.value(params.newnessBias)));
 
     if (root >= (int)appearance.size()) {
         // Start a new tree
-        newTexCoord += s.mRandom.circularVector() * s.value(config["walkTexCoord"]);
+        newTexCoord += s.mRandom.circularVector() * s.value(params.walkTexCoord);
         ti.texCoord = newTexCoord;
-        ti.direction = s.value3D(config["newDirection"]);
+        ti.direction = s.value3D(params.newDirection);
         ti.branchState = 0;
-        ti.point = s.value3D(config["newPoint"]) - pointOffset();
+        ti.point = s.value3D(params.newPoint) - pointOffset();
     } else {
-        ti.texCoord = tree[root].texCoord + s.mRandom.circularVector() * s.value(config["deltaTexCoord"]);
-        ti.direction = tree[root].direction + s.value3D(config["deltaDirection"]);
+        ti.texCoord = tree[root].texCoord + s.mRandom.circularVector() * s.value(params.deltaTexCoord);
+        ti.direction = tree[root].direction + s.value3D(params.deltaDirection);
         ti.branchState = tree[root].branchState + 1;
         ti.point = tree[root].point + tree[root].direction;
     }
@@ -0,0 +1,66 @@
+/*
+ * Layout compiler.
+ *
+ * Works out the topology of a JSON pixel layout ahead of time: glass blocks,
+ * the block grid, LEDs in each block, block and LED adjacency, and whether
+ * the model is 3D. The result goes in a ".topology.json" file next to the
+ * layout, where EffectRunner finds it at startup.
+ *
+ *    layout-compiler layouts/window6x12.json
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <string>
+#include "lib/layout_topology.h"
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s LAYOUT.json [OUTPUT.topology.json]\n", argv[0]);
+        return 1;
+    }
+
+    const char *layoutFile = argv[1];
+    std::string outputFile = argc == 3 ? argv[2] : LayoutTopology::filenameFor(layoutFile);
+
+    FILE *f = fopen(layoutFile, "r");
+    if (!f) {
+        perror("Can't open layout");
+        return 1;
+    }
+
+    rapidjson::Document layout;
+    rapidjson::FileStream istr(f);
+    layout.ParseStream<0>(istr);
+    fclose(f);
+
+    if (layout.HasParseError() || !layout.IsArray()) {
+        fprintf(stderr, "Can't load layout from %s\n", layoutFile);
+        return 1;
+    }
+
+    LayoutTopology topology;
+    topology.build(layout);
+
+    if (!topology.save(outputFile.c_str())) {
+        perror("Can't write topology");
+        return 1;
+    }
+
+    unsigned blocks = 0;
+    for (unsigned b = 0; b < topology.blockPixels.size(); b++) {
+        if (topology.blockPixels.count(b)) {
+            blocks++;
+        }
+    }
+
+    fprintf(stderr, "%s: %d pixels, %s, %dx%d grid with %d blocks, neighbor radius %f\n",
+        outputFile.c_str(), layout.Size(), topology.is3D ? "3D" : "2D",
+        topology.gridWidth, topology.gridHeight, blocks, topology.neighborRadius);
+
+    return 0;
+}
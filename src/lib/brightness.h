@@ -54,6 +54,7 @@ public:
     virtual void endFrame(const FrameInfo& f);
     virtual void debug(const DebugInfo& f);
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual bool isUniform(Vec3& rgb) const;
 
 private:
     Effect &next;
@@ -62,15 +63,22 @@ private:
     float latestAverage;
     float totalBrightnessDelta;
     unsigned numIters;
+    unsigned mappedPixels;
 
     std::vector<Vec3> *prevColors;
     std::vector<Vec3> *nextColors;
 
     std::vector<Vec3> colorBuffer[2];
 
+    // When the next effect is uniform, its color is kept here instead of in nextColors
+    bool prevUniform, nextUniform;
+    Vec3 prevUniformColor, nextUniformColor;
+
     static const unsigned gammaTableSize = 256;
     float gammaTable[gammaTableSize];
     float gamma;
+
+    float linearBrightness(const Vec3& rgb, float scale) const;
 };
 
 
@@ -86,7 +94,10 @@ inline Brightness::Brightness(Effect &next)
       currentScale(1),
       latestAverage(0),
       totalBrightnessDelta(0),
-      numIters(0)
+      numIters(0),
+      mappedPixels(0),
+      prevUniform(false),
+      nextUniform(false)
 {
     // Fadecandy default
     setAssumedGamma(2.5);
@@ -124,25 +135,59 @@ inline float Brightness::getTotalBrightnessDelta() const
     return totalBrightnessDelta;
 }
 
+inline float Brightness::linearBrightness(const Vec3& rgb, float scale) const
+{
+    // Simulated linear brightness of one pixel, using the given scale
+    float total = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        float c = rgb[i] * scale;
+        total += gammaTable[std::max<int>(0, std::min<int>(gammaTableSize - 1, c * float(gammaTableSize - 1)))];
+    }
+    return total;
+}
+
 inline void Brightness::beginFrame(const FrameInfo& f)
 {
     next.beginFrame(f);
     std::swap(nextColors, prevColors);
+    std::swap(nextUniform, prevUniform);
+    std::swap(nextUniformColor, prevUniformColor);
 
     if (colorBuffer[0].size() != f.pixels.size()) {
         for (unsigned i = 0; i < 2; i++) {
            colorBuffer[i].resize(f.pixels.size());
            std::fill(colorBuffer[i].begin(), colorBuffer[i].end(), Vec3(0,0,0));
         }
+        prevUniform = false;
+
+        // Count the total number of mapped pixels, ignoring any unmapped ones.
+        mappedPixels = 0;
+        for (PixelInfoIter pi = f.pixels.begin(), pe = f.pixels.end(); pi != pe; ++pi) {
+            if (pi->isMapped()) {
+                mappedPixels++;
+            }
+        }
     }
 
-    unsigned count = 0;
+    unsigned count = mappedPixels;
     float deltaAccumulator = 0;
 
-    // Calculate the next effect's pixels, storing them all. Also count the total number
-    // of mapped pixels, ignoring any unmapped ones.
+    nextUniform = next.isUniform(nextUniformColor);
+    if (nextUniform && prevUniform) {
+        // Nothing to shade or store, and every pixel changed by the same amount
+        deltaAccumulator = count * sqrlen(nextUniformColor - prevUniformColor);
+
+    } else if (nextUniform) {
+        // Compare against the last full frame, once
+        for (unsigned i = 0; i < f.pixels.size(); i++) {
+            if (f.pixels[i].isMapped()) {
+                deltaAccumulator += sqrlen(nextUniformColor - (*prevColors)[i]);
+            }
+        }
+
+    } else {
+        // Calculate the next effect's pixels, storing them all.
 
-    {
         PixelInfoIter pi = f.pixels.begin();
         PixelInfoIter pe = f.pixels.end();
         std::vector<Vec3>::iterator nci = nextColors->begin();
@@ -153,10 +198,9 @@ inline void Brightness::beginFrame(const FrameInfo& f)
                 Vec3 rgb(0, 0, 0);
                 next.shader(rgb, *pi);
                 next.postProcess(rgb, *pi);
-                count++;
 
                 *nci = rgb;
-                deltaAccumulator += sqrlen(rgb - *pci);
+                deltaAccumulator += sqrlen(rgb - (prevUniform ? prevUniformColor : *pci));
             }
         }
     }
@@ -191,24 +235,23 @@ inline void Brightness::beginFrame(const FrameInfo& f)
 
     for (; iter < maxIters; iter++) {
 
-        std::vector<Vec3>::iterator ci = nextColors->begin();
-        std::vector<Vec3>::iterator ce = nextColors->end();
-        PixelInfoIter pi = f.pixels.begin();
-        avg = 0;
-
-        for (;ci != ce; ++ci, ++pi) {
-            Vec3& rgb = *ci;
+        if (nextUniform) {
+            avg = linearBrightness(nextUniformColor, scale);
 
-            // Simulated linear brightness, using current scale
-            if (pi->isMapped()) {
-                for (unsigned i = 0; i < 3; i++) {
-                    float c = rgb[i] * scale;
-                    avg += gammaTable[std::max<int>(0, std::min<int>(gammaTableSize - 1, c * float(gammaTableSize - 1)))];
+        } else {
+            std::vector<Vec3>::iterator ci = nextColors->begin();
+            std::vector<Vec3>::iterator ce = nextColors->end();
+            PixelInfoIter pi = f.pixels.begin();
+            avg = 0;
+
+            for (;ci != ce; ++ci, ++pi) {
+                if (pi->isMapped()) {
+                    avg += linearBrightness(*ci, scale);
                 }
             }
-        }
 
-        avg /= count;
+            avg /= count;
+        }
 
         float adjustment;
         if (avg < lowerLimit) {
@@ -253,5 +296,13 @@ inline void Brightness::debug(const DebugInfo& d)
 
 inline void Brightness::shader(Vec3& rgb, const PixelInfo& p) const
 {
-    rgb = (*nextColors)[p.index] * currentScale;
+    rgb = (nextUniform ? nextUniformColor : (*nextColors)[p.index]) * currentScale;
+}
+
+inline bool Brightness::isUniform(Vec3& rgb) const
+{
+    if (nextUniform) {
+        rgb = nextUniformColor * currentScale;
+    }
+    return nextUniform;
 }
@@ -46,6 +46,39 @@ namespace Camera {
      */
     typedef void (*videoCallback_t)(const VideoChunk &video, void *context);
 
-    // Start the camera on a new thread
+    /*
+     * One source of video. Each device keeps its own driver state and runs
+     * on its own thread, so several cameras can be capturing at once.
+     */
+    class Device {
+    public:
+        virtual ~Device() {}
+
+        // Start capturing on a new thread. Returns 0 if this device was already started.
+        virtual tthread::thread* start(videoCallback_t callback, void *context = 0) = 0;
+
+        // Deliver exactly one field on the calling thread, for running on simulated
+        // time. Returns false if this device only runs in real time, or was started.
+        virtual bool step(videoCallback_t callback, void *context = 0) { return false; }
+    };
+
+    /*
+     * Create a device by name:
+     *
+     *      "usb"           First Somagic USB capture device
+     *      "usb:N"         Nth Somagic device, counting from zero in bus enumeration order
+     *      "file:PATH"     Raw UYVY frames (720x480, interlaced) read from a file, looping
+     *                      forever at the NTSC field rate. Useful for testing without hardware.
+     *      "synthetic"         Generated video with bursts of motion, no hardware or files needed.
+     *
+     * Returns 0 if the name isn't recognized.
+     */
+    Device* open(const char *name);
+
+    Device* newSomagicDevice(unsigned index = 0);
+    Device* newFileDevice(const char *filename);
+    Device* newSyntheticDevice();
+
+    // Start the first USB camera on a new thread
     tthread::thread* start(videoCallback_t callback, void *context = 0);
 };
@@ -0,0 +1,321 @@
+/*
+ * Camera field store: a shared ring of assembled video fields.
+ *
+ * Video arrives as small chunks, and several consumers want to look at
+ * whole fields: the previous value of each pixel, the most recent frame,
+ * and so on. Instead of each one keeping its own full-frame copy, the
+ * camera thread writes every chunk exactly once into this store, and
+ * consumers hold reference-counted handles to complete fields.
+ *
+ * Fields are numbered with a sequence number as they start arriving.
+ * A field slot is never reused while anyone holds a reference to it; if
+ * every slot is in use, the ring grows rather than dropping video.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include "camera.h"
+#include "tinythread.h"
+
+
+class CameraFieldStore {
+private:
+    struct Slot;
+
+public:
+    static const unsigned kBytesPerField = Camera::kBytesPerLine * Camera::kLinesPerField;
+
+    // Default ring size: two fields of each parity
+    CameraFieldStore(unsigned depth = 4);
+    ~CameraFieldStore();
+
+    // Handle to one complete field. Copying a Ref adds a reference; the field
+    // stays valid until the last Ref is destroyed or reassigned.
+    class Ref {
+    public:
+        Ref();
+        Ref(const Ref &other);
+        ~Ref();
+        Ref& operator=(const Ref &other);
+
+        // Is this a valid field, or an empty handle?
+        bool isValid() const;
+
+        // Sequence number, counting every field the store has seen
+        uint32_t sequence() const;
+
+        // Which of the two interlaced fields this is
+        unsigned field() const;
+
+        // Raw UYVY data, laid out as kLinesPerField lines of kBytesPerLine
+        const uint8_t *data() const;
+        const uint8_t *line(unsigned y) const;
+
+    private:
+        friend class CameraFieldStore;
+        Ref(const CameraFieldStore *store, Slot *slot);
+        void release();
+
+        const CameraFieldStore *store;
+        Slot *slot;
+    };
+
+    // Write another chunk of video. Call this on the camera thread,
+    // before any consumers that read the store.
+    void process(const Camera::VideoChunk &chunk);
+
+    // Most recent complete field, or an empty Ref
+    Ref latest() const;
+
+    // Most recent complete field with a particular parity, or an empty Ref
+    Ref latest(unsigned field) const;
+
+    // A particular field, if it's complete and still in the ring
+    Ref get(uint32_t sequence) const;
+
+private:
+    struct Slot {
+        uint8_t data[kBytesPerField];
+        uint32_t sequence;
+        unsigned field;
+        unsigned refs;
+        bool complete;
+    };
+
+    // Lock protects slot metadata and reference counts, not data
+    mutable tthread::mutex lock;
+    std::vector<Slot*> slots;
+
+    // Only touched on the camera thread
+    Slot *writing;
+    uint32_t nextSequence;
+
+    void beginField(unsigned field);
+    Ref acquire(Slot *slot) const;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline CameraFieldStore::CameraFieldStore(unsigned depth)
+    : writing(0), nextSequence(0)
+{
+    slots.resize(depth);
+    for (unsigned i = 0; i < slots.size(); i++) {
+        slots[i] = new Slot;
+        slots[i]->sequence = 0;
+        slots[i]->field = 0;
+        slots[i]->refs = 0;
+        slots[i]->complete = false;
+    }
+}
+
+inline CameraFieldStore::~CameraFieldStore()
+{
+    for (unsigned i = 0; i < slots.size(); i++) {
+        delete slots[i];
+    }
+}
+
+inline void CameraFieldStore::beginField(unsigned field)
+{
+    // Reuse the oldest slot that nobody is looking at
+
+    lock.lock();
+
+    Slot *best = 0;
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *s = slots[i];
+        if (s->refs == 0 && (!best || !s->complete ||
+            (best->complete && int32_t(s->sequence - best->sequence) < 0))) {
+            best = s;
+        }
+    }
+
+    if (!best) {
+        // Everything is referenced; grow the ring instead of dropping video
+        best = new Slot;
+        best->refs = 0;
+        slots.push_back(best);
+    }
+
+    best->sequence = nextSequence++;
+    best->field = field;
+    best->complete = false;
+    writing = best;
+
+    lock.unlock();
+}
+
+inline void CameraFieldStore::process(const Camera::VideoChunk &chunk)
+{
+    if (!writing || writing->field != chunk.field) {
+        beginField(chunk.field);
+    }
+
+    unsigned offset = chunk.byteOffset + chunk.line * Camera::kBytesPerLine;
+    memcpy(writing->data + offset, chunk.data, chunk.byteCount);
+
+    // End of field?
+    if (chunk.line == Camera::kLinesPerField - 1 &&
+        chunk.byteCount + chunk.byteOffset == Camera::kBytesPerLine) {
+        lock.lock();
+        writing->complete = true;
+        writing = 0;
+        lock.unlock();
+    }
+}
+
+inline CameraFieldStore::Ref CameraFieldStore::acquire(Slot *slot) const
+{
+    // Caller holds the lock
+    if (slot) {
+        slot->refs++;
+    }
+    return Ref(this, slot);
+}
+
+inline CameraFieldStore::Ref CameraFieldStore::latest() const
+{
+    lock.lock();
+    Slot *best = 0;
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *s = slots[i];
+        if (s->complete && (!best || int32_t(s->sequence - best->sequence) > 0)) {
+            best = s;
+        }
+    }
+    Ref r = acquire(best);
+    lock.unlock();
+    return r;
+}
+
+inline CameraFieldStore::Ref CameraFieldStore::latest(unsigned field) const
+{
+    lock.lock();
+    Slot *best = 0;
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *s = slots[i];
+        if (s->complete && s->field == field && (!best || int32_t(s->sequence - best->sequence) > 0)) {
+            best = s;
+        }
+    }
+    Ref r = acquire(best);
+    lock.unlock();
+    return r;
+}
+
+inline CameraFieldStore::Ref CameraFieldStore::get(uint32_t sequence) const
+{
+    lock.lock();
+    Slot *found = 0;
+    for (unsigned i = 0; i < slots.size(); i++) {
+        Slot *s = slots[i];
+        if (s->complete && s->sequence == sequence) {
+            found = s;
+            break;
+        }
+    }
+    Ref r = acquire(found);
+    lock.unlock();
+    return r;
+}
+
+inline CameraFieldStore::Ref::Ref()
+    : store(0), slot(0)
+{}
+
+inline CameraFieldStore::Ref::Ref(const CameraFieldStore *store, Slot *slot)
+    : store(store), slot(slot)
+{}
+
+inline CameraFieldStore::Ref::Ref(const Ref &other)
+    : store(other.store), slot(other.slot)
+{
+    if (slot) {
+        store->lock.lock();
+        slot->refs++;
+        store->lock.unlock();
+    }
+}
+
+inline CameraFieldStore::Ref::~Ref()
+{
+    release();
+}
+
+inline CameraFieldStore::Ref& CameraFieldStore::Ref::operator=(const Ref &other)
+{
+    if (other.slot) {
+        other.store->lock.lock();
+        other.slot->refs++;
+        other.store->lock.unlock();
+    }
+    release();
+    store = other.store;
+    slot = other.slot;
+    return *this;
+}
+
+inline void CameraFieldStore::Ref::release()
+{
+    if (slot) {
+        store->lock.lock();
+        slot->refs--;
+        store->lock.unlock();
+    }
+    slot = 0;
+}
+
+inline bool CameraFieldStore::Ref::isValid() const
+{
+    return slot != 0;
+}
+
+inline uint32_t CameraFieldStore::Ref::sequence() const
+{
+    return slot->sequence;
+}
+
+inline unsigned CameraFieldStore::Ref::field() const
+{
+    return slot->field;
+}
+
+inline const uint8_t *CameraFieldStore::Ref::data() const
+{
+    return slot->data;
+}
+
+inline const uint8_t *CameraFieldStore::Ref::line(unsigned y) const
+{
+    return slot->data + y * Camera::kBytesPerLine;
+}
@@ -0,0 +1,203 @@
+/*
+ * File-backed video source. Implements the abstract camera interface in camera.h,
+ * playing back raw UYVY video instead of talking to USB hardware.
+ *
+ * The file is a sequence of 720x480 interlaced frames, laid out the same way
+ * as a linear framebuffer (see VideoChunk::framebufferOffset). Each frame is
+ * split into two fields and sliced into chunks about the same size as the ones
+ * our USB driver produces, then delivered at the NTSC field rate, or one
+ * field per step() when running on simulated time.
+ *
+ * Raw files can be made from any video with ffmpeg:
+ *
+ *    ffmpeg -i input.mov -s 720x480 -pix_fmt uyvy422 -f rawvideo output.uyvy
+ *
+ * 2014, Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * This file is released into the public domain.
+ */
+
+#include "camera.h"
+#include "tinythread.h"
+
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+using namespace Camera;
+
+
+class FileDevice : public Device {
+public:
+    FileDevice(const char *filename);
+    virtual tthread::thread* start(videoCallback_t callback, void *context);
+    virtual bool step(videoCallback_t callback, void *context);
+
+private:
+    // Same payload size as one USB isochronous block, minus its header
+    static const unsigned kChunkSize = 0x400 - 4;
+
+    std::string filename;
+    tthread::thread *thread;
+    videoCallback_t videoCallback;
+    void *videoCallbackContext;
+    uint8_t frame[kPixels * kBytesPerPixel];
+
+    // Only used by step()
+    FILE *stepFile;
+    unsigned stepField;
+
+    static void threadFunc(void *context);
+    void threadMain();
+    bool readFrame(FILE *f);
+    void sendField(unsigned field);
+};
+
+
+FileDevice::FileDevice(const char *filename)
+    : filename(filename), thread(0), stepFile(0), stepField(0)
+{}
+
+tthread::thread* FileDevice::start(videoCallback_t callback, void *context)
+{
+    if (thread) {
+        // Already running
+        return 0;
+    }
+
+    videoCallback = callback;
+    videoCallbackContext = context;
+
+    thread = new tthread::thread(threadFunc, this);
+
+    return thread;
+}
+
+bool FileDevice::step(videoCallback_t callback, void *context)
+{
+    if (thread) {
+        // Already running on its own
+        return false;
+    }
+
+    videoCallback = callback;
+    videoCallbackContext = context;
+
+    if (!stepFile) {
+        stepFile = fopen(filename.c_str(), "rb");
+        if (!stepFile) {
+            perror("camera: Failed to open video file");
+            return false;
+        }
+        if (!readFrame(stepFile)) {
+            fprintf(stderr, "camera: No complete frames in %s\n", filename.c_str());
+            fclose(stepFile);
+            stepFile = 0;
+            return false;
+        }
+        stepField = 0;
+    }
+
+    sendField(stepField);
+
+    if (++stepField == kFields) {
+        stepField = 0;
+        if (!readFrame(stepFile)) {
+            fprintf(stderr, "camera: Error reading %s\n", filename.c_str());
+            fclose(stepFile);
+            stepFile = 0;
+        }
+    }
+    return true;
+}
+
+void FileDevice::threadFunc(void *context)
+{
+    static_cast<FileDevice*>(context)->threadMain();
+}
+
+bool FileDevice::readFrame(FILE *f)
+{
+    if (fread(frame, sizeof frame, 1, f) == 1) {
+        return true;
+    }
+
+    // Loop back to the beginning
+    rewind(f);
+    return fread(frame, sizeof frame, 1, f) == 1;
+}
+
+void FileDevice::sendField(unsigned field)
+{
+    for (unsigned line = 0; line < kLinesPerField; line++) {
+        VideoChunk chunk;
+        chunk.line = line;
+        chunk.field = field;
+        chunk.byteOffset = 0;
+
+        while (chunk.byteOffset < kBytesPerLine) {
+            chunk.byteCount = std::min(kChunkSize, kBytesPerLine - chunk.byteOffset);
+            chunk.data = frame + chunk.framebufferOffset();
+            videoCallback(chunk, videoCallbackContext);
+            chunk.byteOffset += chunk.byteCount;
+        }
+    }
+}
+
+void FileDevice::threadMain()
+{
+    const double fieldPeriod = 1.001 / 60.0;
+
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        perror("camera: Failed to open video file");
+        return;
+    }
+
+    if (!readFrame(f)) {
+        fprintf(stderr, "camera: No complete frames in %s\n", filename.c_str());
+        fclose(f);
+        return;
+    }
+
+    fprintf(stderr, "camera: Video stream started from %s\n", filename.c_str());
+
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    double deadline = tv.tv_sec + 1e-6 * tv.tv_usec;
+
+    while (true) {
+        for (unsigned field = 0; field < kFields; field++) {
+            sendField(field);
+
+            // Pace ourselves at the real field rate. If processing falls behind,
+            // skip ahead rather than trying to catch up.
+
+            deadline += fieldPeriod;
+            gettimeofday(&tv, 0);
+            double now = tv.tv_sec + 1e-6 * tv.tv_usec;
+            if (deadline > now) {
+                usleep((deadline - now) * 1e6);
+            } else {
+                deadline = now;
+            }
+        }
+
+        if (!readFrame(f)) {
+            fprintf(stderr, "camera: Error reading %s\n", filename.c_str());
+            break;
+        }
+    }
+
+    fclose(f);
+}
+
+namespace Camera {
+    Device* newFileDevice(const char *filename) {
+        return new FileDevice(filename);
+    }
+}
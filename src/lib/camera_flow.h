@@ -16,6 +16,28 @@
  * or try its best to account for the contributions of everyone
  * in a crowd.
  *
+ * As a cheaper alternative, "dense" mode skips the tracking points entirely
+ * and uses SIMD block matching to estimate a coarse grid of motion vectors,
+ * one per cell. The grid is laid out in model coordinates using the same
+ * basis as the summary motion, so effects can ask where motion is happening.
+ *
+ * The motion we see is always a little stale: a field has to finish arriving
+ * and be analyzed, then the effect has to render and the LEDs have to update.
+ * With prediction enabled, the analyzer publishes a velocity estimate along
+ * with the integrators, and CameraFlowCapture extrapolates to the time the
+ * frame it's rendering will actually be displayed. The time since the field
+ * arrived is measured, but the render and output delay after capture() isn't
+ * visible from here, so "predictionLatency" has to be calibrated per setup.
+ *
+ * Each camera gets its own CameraFlowAnalyzer, running on that camera's
+ * thread. Effects bind to a CameraFlowFusion, which is either a single
+ * analyzer or a weighted combination of several analyzers whose motion
+ * is combined in model coordinates.
+ *
+ * Optionally each of the two interlaced fields is analyzed on its own worker
+ * thread, so capture of the next field overlaps analysis of the last one.
+ * Results are still merged into the integrators in field order.
+ *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
  * Permission is hereby granted, free of charge, to any person
@@ -44,12 +66,15 @@
 
 #include <opencv2/opencv.hpp>
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 #include <string>
 #include "effect.h"
 #include "particle.h"
 #include "color.h"
 #include "camera.h"
 #include "prng.h"
+#include "tinythread.h"
 
 
 class CameraFlowCapture;
@@ -60,10 +85,17 @@ class CameraFlowCapture;
     #define USE_OPENCV_VIDEO
 #endif
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 
 class CameraFlowAnalyzer {
 public:
     CameraFlowAnalyzer();
+    ~CameraFlowAnalyzer();
 
     // Process another chunk of video
     void process(const Camera::VideoChunk &chunk);
@@ -71,12 +103,25 @@ public:
     // Change the transform we use to calculate model coordinates.
     void setTransform(Vec3 basisX, Vec3 basisY, Vec3 origin);
 
+    // Set the transform from a JSON array of 9 numbers, if present
+    void setTransform(const rapidjson::Value &transform);
+
     // Set vision parameters from JSON object
     void setConfig(const rapidjson::Value &config);
 
     // Random number generator including entropy from video data
     PRNG prng;
 
+    // Integrators and velocity, published together after each field
+    struct Snapshot {
+        uint32_t x, y, l;           // Integrators, in 16:16 fixed point
+        float vx, vy, vl;           // Velocity estimate, in pixels per second
+        double timestamp;           // Capture time of the newest field, in seconds
+    };
+
+    // Consistent copy of the latest snapshot
+    Snapshot snapshot() const;
+
 private:
     friend class CameraFlowCapture;
 
@@ -97,6 +142,15 @@ private:
     float motionFilterFast;         // First motion filter, higher frequency
     float motionFilterSlow;         // Second motion filter, low frequency
     float motionLogInterval;        // Seconds between motion integrator log records
+    bool denseMode;                 // Block-matching motion field instead of tracking points
+    unsigned denseGridWidth;        // Motion field cells, horizontally
+    unsigned denseGridHeight;       // Motion field cells, vertically
+    unsigned denseSearchRadius;     // Farthest block displacement to search, in decimated pixels
+    float denseNoiseThreshold;      // Per-pixel SAD improvement needed to believe a cell moved
+    bool parallelFields;            // Analyze each field on its own worker thread
+    bool prediction;                // Extrapolate captured motion to display time
+    float predictionLatency;        // Seconds from capture() until the frame is displayed
+    float predictionLimit;          // Never extrapolate further than this, in seconds
 
     struct PointInfo {
         PointInfo();
@@ -109,8 +163,23 @@ private:
 
     struct Field {
         cv::Mat frames[2];
+        cv::Mat capture;                // Next frame, filled in by process()
         std::vector<cv::Point2f> points;
         std::vector<PointInfo> pointInfo;
+        std::vector<Vec2> cellMotion;   // Unfiltered dense motion
+        PRNG prng;
+        PRNG capturePrng;               // Entropy from video, only touched by process()
+
+        // Motion found by calculateFlow(), not yet merged. 16:16 fixed point.
+        int32_t deltaX, deltaY, deltaL;
+        double timestamp;               // When frames[1] finished arriving
+        double captureTimestamp;        // When capture finished arriving
+
+        // Worker thread state, protected by workerLock
+        CameraFlowAnalyzer *analyzer;
+        tthread::thread *thread;
+        bool pending;
+        unsigned sequence;
     };
 
     #ifdef USE_OPENCV_VIDEO
@@ -124,6 +193,10 @@ private:
     // Total motion length integrator, in 16:16 fixed point
     uint32_t integratorL;
 
+    // Published copy of the integrators, for other threads
+    Snapshot published;
+    mutable tthread::mutex publishLock;
+
     // Length filtered at video rate
     uint32_t filterCaptureL;
     float filterSlowL;
@@ -132,22 +205,70 @@ private:
     // Current transform
     Vec3 basisX, basisY, origin;
 
+    // Dense motion field, filtered, in pixels per field. Row-major cells.
+    std::vector<Vec2> motionField;
+    unsigned denseCellWidth, denseCellHeight;
+
+    // Block size for dense matching; one SIMD register wide
+    static const unsigned kBlockWidth = 16;
+    static const unsigned kBlockHeight = 16;
+
     unsigned debugFrameCounter;
     uint32_t debugCaptureL;
 
     FILE *motionLogStream;
     double motionLogTimestamp;
 
+    // Parallel field workers. Fields are numbered as they're submitted,
+    // and merged strictly in that order.
+    tthread::mutex workerLock;
+    tthread::condition_variable workerCond;
+    unsigned submitSequence;
+    unsigned mergeSequence;
+    bool workerExit;
+
     static uint32_t stringToFourCC(const std::string &f);
     void calculateFlow(Field &f);
+    void mergeFlow(Field &f);
+    void publish(const Field &f);
+    void submitField(Field &f);
+    void fieldWorker(Field &f);
+    static void fieldThreadFunc(void *context);
+    void calculateSparseFlow(Field &f);
+    void calculateDenseFlow(Field &f);
     void clear();
     float instantaneousMotion() const;
+    Vec2 motionFieldAt(Vec3 model) const;
+
+    static double currentTime();
+    static unsigned blockSAD(const uint8_t *a, const uint8_t *b, unsigned stride, unsigned rows);
+};
+
+
+/*
+ * A set of analyzers that an effect binds to. Motion from each analyzer is
+ * transformed to model coordinates separately, then combined using per-analyzer
+ * weights. Converts implicitly from a single analyzer.
+ */
+class CameraFlowFusion {
+public:
+    CameraFlowFusion();
+    CameraFlowFusion(const CameraFlowAnalyzer &analyzer);
+
+    void add(const CameraFlowAnalyzer &analyzer, float weight = 1.0f);
+
+    struct Input {
+        const CameraFlowAnalyzer *analyzer;
+        float weight;
+    };
+
+    std::vector<Input> inputs;
 };
 
 
 class CameraFlowCapture {
 public:
-    CameraFlowCapture(const CameraFlowAnalyzer &analyzer);
+    CameraFlowCapture(const CameraFlowFusion &fusion);
 
     // Capture the current flow position, smoothly approach it
     void capture(float filterRate = 0.1f);
@@ -157,10 +278,16 @@ public:
 
     // Retrieve instantaneous, not integrated, value of the motion
     // per video field, filtered on the video thread. Not affected
-    // by capture() / origin()
+    // by capture() / origin(). With multiple analyzers, this is the
+    // strongest motion seen by any of them.
     float instantaneousMotion() const;
 
-    // Raw x/y in pixels
+    // Filtered local motion near a point in model coordinates, from the dense
+    // motion field. Analyzers in sparse mode, or that can't see this point,
+    // contribute nothing. Returns a model-space vector.
+    Vec3 motionAt(Vec3 model) const;
+
+    // Raw x/y in pixels, weighted sum over all analyzers
     Vec2 pixels;
 
     // Model coordinates (arbitrary units)
@@ -170,16 +297,22 @@ public:
     float motionLength;
 
 private:
-    const CameraFlowAnalyzer &analyzer;
-    uint32_t captureX, captureY, captureL;
-    uint32_t originX, originY, originL;
+    struct Source {
+        const CameraFlowAnalyzer *analyzer;
+        float weight;
+        uint32_t captureX, captureY, captureL;
+        uint32_t originX, originY, originL;
+        Vec2 pixels;
+    };
+
+    std::vector<Source> sources;
 };
 
 
 class CameraFlowDebugEffect : public ParticleEffect
 {
 public:
-    CameraFlowDebugEffect(CameraFlowAnalyzer& flow, const rapidjson::Value &config);
+    CameraFlowDebugEffect(const CameraFlowFusion &flow, const rapidjson::Value &config);
 
     virtual void beginFrame(const FrameInfo &f);
     virtual void debug(const DebugInfo &d);
@@ -199,14 +332,38 @@ private:
 
 
 inline CameraFlowAnalyzer::CameraFlowAnalyzer()
-    : decimate(0), motionLogStream(NULL)
+    : decimate(0), denseMode(false), parallelFields(false), motionLogStream(NULL),
+      workerExit(false)
 {
     prng.seed(29);
 
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        fields[i].prng.seed(30 + i);
+        fields[i].capturePrng.seed(40 + i);
+        fields[i].analyzer = this;
+        fields[i].thread = 0;
+    }
+
     // Default transform is identity
     setTransform( Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 0) );
 }
 
+inline CameraFlowAnalyzer::~CameraFlowAnalyzer()
+{
+    workerLock.lock();
+    workerExit = true;
+    workerCond.notify_all();
+    workerLock.unlock();
+
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        if (fields[i].thread) {
+            fields[i].thread->join();
+            delete fields[i].thread;
+            fields[i].thread = 0;
+        }
+    }
+}
+
 inline void CameraFlowAnalyzer::setTransform(Vec3 basisX, Vec3 basisY, Vec3 origin)
 {
     this->basisX = basisX;
@@ -214,6 +371,15 @@ inline void CameraFlowAnalyzer::setTransform(Vec3 basisX, Vec3 basisY, Vec3 orig
     this->origin = origin;
 }
 
+inline void CameraFlowAnalyzer::setTransform(const rapidjson::Value &t)
+{
+    if (t.IsArray() && t.Size() == 9) {
+        setTransform( Vec3( t[0u].GetDouble(), t[1].GetDouble(), t[2].GetDouble() ),
+                      Vec3( t[3 ].GetDouble(), t[4].GetDouble(), t[5].GetDouble() ),
+                      Vec3( t[6 ].GetDouble(), t[7].GetDouble(), t[8].GetDouble() ));
+    }
+}
+
 inline void CameraFlowAnalyzer::setConfig(const rapidjson::Value &config)
 {
     debug = config["debug"].GetBool();
@@ -237,13 +403,34 @@ inline void CameraFlowAnalyzer::setConfig(const rapidjson::Value &config)
     motionLogFile = config["motionLogFile"].GetString();
     motionLogInterval = config["motionLogInterval"].GetDouble();
 
-    const rapidjson::Value& t = config["transform"];
-    if (t.IsArray() && t.Size() == 9) {
-        setTransform( Vec3( t[0u].GetDouble(), t[1].GetDouble(), t[2].GetDouble() ),
-                      Vec3( t[3 ].GetDouble(), t[4].GetDouble(), t[5].GetDouble() ),
-                      Vec3( t[6 ].GetDouble(), t[7].GetDouble(), t[8].GetDouble() ));
+    const rapidjson::Value &parallel = config["parallelFields"];
+    parallelFields = parallel.IsBool() && parallel.GetBool();
+
+    const rapidjson::Value &predict = config["prediction"];
+    prediction = predict.IsBool() && predict.GetBool();
+    if (prediction) {
+        // Render and output delay can't be seen from here, so it has to be calibrated
+        const rapidjson::Value &latency = config["predictionLatency"];
+        if (latency.IsNumber()) {
+            predictionLatency = latency.GetDouble();
+            predictionLimit = config["predictionLimit"].GetDouble();
+        } else {
+            fprintf(stderr, "flow: predictionLatency must be a number of seconds, disabling prediction\n");
+            prediction = false;
+        }
     }
 
+    const rapidjson::Value &mode = config["mode"];
+    denseMode = mode.IsString() && !strcmp(mode.GetString(), "dense");
+    if (denseMode) {
+        denseGridWidth = config["denseGridWidth"].GetUint();
+        denseGridHeight = config["denseGridHeight"].GetUint();
+        denseSearchRadius = config["denseSearchRadius"].GetUint();
+        denseNoiseThreshold = config["denseNoiseThreshold"].GetDouble();
+    }
+
+    setTransform(config["transform"]);
+
     // Resize arrays
     clear();
 }
@@ -259,19 +446,51 @@ inline CameraFlowAnalyzer::PointInfo::PointInfo(unsigned maxAge)
 inline void CameraFlowAnalyzer::clear()
 {
     integratorX = integratorY = integratorL = 0;
+    memset(&published, 0, sizeof published);
     debugFrameCounter = 0;
     debugCaptureL = 0;
     filterSlowL = 1.0f;
     filterFastL = 0;
     filterCaptureL = 0; 
 
+    submitSequence = mergeSequence = 0;
+
     for (unsigned i = 0; i < Camera::kFields; i++) {
         if (decimate != 0) {
             for (unsigned j = 0; j < 2; j++) {
                 fields[i].frames[j] = cv::Mat::zeros(Camera::kLinesPerField, Camera::kPixelsPerLine / decimate, CV_8UC1);
             }
+            fields[i].capture = cv::Mat::zeros(Camera::kLinesPerField, Camera::kPixelsPerLine / decimate, CV_8UC1);
         }
         fields[i].points.clear();
+        fields[i].pointInfo.clear();
+        fields[i].pending = false;
+
+        // Workers start lazily, and keep running once started
+        if (parallelFields && !fields[i].thread) {
+            fields[i].thread = new tthread::thread(fieldThreadFunc, &fields[i]);
+        }
+    }
+
+    motionField.clear();
+    if (denseMode && decimate != 0) {
+        // Every block plus its search window has to fit inside the frame
+        unsigned width = Camera::kPixelsPerLine / decimate;
+        unsigned height = Camera::kLinesPerField;
+
+        if (denseGridWidth == 0 || denseGridHeight == 0 ||
+            width < kBlockWidth + 2 * denseSearchRadius ||
+            height < kBlockHeight + 2 * denseSearchRadius) {
+            fprintf(stderr, "flow: Dense motion field doesn't fit in a %dx%d frame, disabling\n", width, height);
+            denseMode = false;
+        } else {
+            denseCellWidth = width / denseGridWidth;
+            denseCellHeight = height / denseGridHeight;
+            motionField.resize(denseGridWidth * denseGridHeight, Vec2(0, 0));
+            for (unsigned i = 0; i < Camera::kFields; i++) {
+                fields[i].cellMotion.resize(motionField.size(), Vec2(0, 0));
+            }
+        }
     }
 
     #ifdef USE_OPENCV_VIDEO
@@ -305,8 +524,12 @@ inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
     const uint8_t *limit = iter.data + chunk.byteCount;
     const unsigned bytesPerSample = decimate * 2;
 
+    Field &f = fields[iter.field];
+    cv::Mat &image = f.capture;
+
     prng.remix(iter.byteOffset);
     prng.remix(iter.line);
+    f.capturePrng.remix(iter.byteOffset);
 
     // Align to the next stored luminance value
     while ((iter.byteOffset % bytesPerSample) != 1) {
@@ -314,8 +537,6 @@ inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
         iter.byteOffset++;
     }
 
-    Field &f = fields[iter.field];
-    cv::Mat &image = f.frames[1];
     uint8_t *dest = image.data +
         iter.line * (Camera::kPixelsPerLine / decimate)
         + iter.byteOffset / bytesPerSample;
@@ -329,22 +550,124 @@ inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
 
     if (iter.line == Camera::kLinesPerField - 1 &&
         chunk.byteCount + chunk.byteOffset == Camera::kBytesPerLine) {
-        calculateFlow(f);
 
-        // Check time elapsed for motion logging
-        if (motionLogStream) {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            double now = tv.tv_sec + tv.tv_usec * 1e-6;
-            if (now >= motionLogTimestamp + motionLogInterval) {
+        f.captureTimestamp = currentTime();
 
-                fprintf(motionLogStream, "%f 0x%x 0x%x 0x%x\n",
-                    now, integratorX, integratorY, integratorL);
-                fflush(motionLogStream);
+        if (parallelFields) {
+            submitField(f);
+        } else {
+            std::swap(f.capture, f.frames[1]);
+            f.timestamp = f.captureTimestamp;
+            f.prng.remix(f.capturePrng.uniform32());
+            calculateFlow(f);
+            mergeFlow(f);
+        }
+    }
+}
 
-                motionLogTimestamp = now;
-            }
+inline double CameraFlowAnalyzer::currentTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+inline void CameraFlowAnalyzer::publish(const Field &f)
+{
+    Snapshot s = published;
+
+    s.x = integratorX;
+    s.y = integratorY;
+    s.l = integratorL;
+
+    // Velocity from this field's motion over the time since the last one we merged.
+    // Dropped fields stretch the interval; a long gap means we have no useful history.
+
+    const float fieldPeriod = 1.001 / 60.0;
+    float dt = f.timestamp - s.timestamp;
+    if (!(dt > 0 && dt < 0.1f)) {
+        dt = fieldPeriod;
+    }
+
+    float scale = 1.0f / (dt * 0x10000);
+    s.vx += (f.deltaX * scale - s.vx) * motionFilterFast;
+    s.vy += (f.deltaY * scale - s.vy) * motionFilterFast;
+    s.vl += (f.deltaL * scale - s.vl) * motionFilterFast;
+    s.timestamp = f.timestamp;
+
+    publishLock.lock();
+    published = s;
+    publishLock.unlock();
+}
+
+inline CameraFlowAnalyzer::Snapshot CameraFlowAnalyzer::snapshot() const
+{
+    publishLock.lock();
+    Snapshot s = published;
+    publishLock.unlock();
+    return s;
+}
+
+inline void CameraFlowAnalyzer::submitField(Field &f)
+{
+    workerLock.lock();
+
+    if (f.pending) {
+        // Still busy with this field's last frame. Drop the new one rather than stall
+        // capture; the next comparison will just span a longer interval.
+        workerLock.unlock();
+        if (debug) {
+            fprintf(stderr, "flow[%d]: Worker busy, dropping field\n", (int)(&f - &fields[0]));
         }
+        return;
+    }
+
+    // The worker is idle, so it's safe to hand over the new frame and entropy
+    std::swap(f.capture, f.frames[1]);
+    f.timestamp = f.captureTimestamp;
+    f.prng.remix(f.capturePrng.uniform32());
+    f.sequence = submitSequence++;
+    f.pending = true;
+    workerCond.notify_all();
+    workerLock.unlock();
+}
+
+inline void CameraFlowAnalyzer::fieldThreadFunc(void *context)
+{
+    Field *f = static_cast<Field*>(context);
+    f->analyzer->fieldWorker(*f);
+}
+
+inline void CameraFlowAnalyzer::fieldWorker(Field &f)
+{
+    while (true) {
+        workerLock.lock();
+        while (!f.pending && !workerExit) {
+            workerCond.wait(workerLock);
+        }
+        if (workerExit) {
+            workerLock.unlock();
+            return;
+        }
+        workerLock.unlock();
+
+        // While 'pending' is set, process() only writes to f.capture and f.capturePrng
+        calculateFlow(f);
+
+        // Wait for earlier fields to merge, so the integrators see motion in capture order
+        workerLock.lock();
+        while (mergeSequence != f.sequence && !workerExit) {
+            workerCond.wait(workerLock);
+        }
+        if (workerExit) {
+            workerLock.unlock();
+            return;
+        }
+        mergeFlow(f);
+        mergeSequence++;
+        f.pending = false;
+        workerCond.notify_all();
+        workerLock.unlock();
     }
 }
 
@@ -369,22 +692,131 @@ inline float CameraFlowAnalyzer::instantaneousMotion() const
 }
 
 inline void CameraFlowAnalyzer::calculateFlow(Field &f)
-{            
+{
     /*
      * Each NTSC field has its own independent flow calculator, so that we can react to
      * each field as soon as it arrives without worrying about correlating inter-field motion.
      */
 
+    f.deltaX = f.deltaY = f.deltaL = 0;
+
+    if (denseMode) {
+        calculateDenseFlow(f);
+    } else {
+        calculateSparseFlow(f);
+    }
+}
+
+inline void CameraFlowAnalyzer::mergeFlow(Field &f)
+{
+    // Shared state is only updated here, one field at a time
+
+    integratorX += f.deltaX;
+    integratorY += f.deltaY;
+    integratorL += f.deltaL;
+
+    publish(f);
+
+    for (unsigned i = 0; i < motionField.size(); i++) {
+        motionField[i] += (f.cellMotion[i] - motionField[i]) * motionFilterFast;
+    }
+
+    // Update fixed-timestep motion filters on each field
+    uint32_t cL = integratorL;
+    float fL = int32_t(cL - filterCaptureL) * (1.0f / 0x10000);
+    filterCaptureL = cL;
+    filterSlowL += (fL - filterSlowL) * motionFilterSlow;
+    filterFastL += (fL - filterFastL) * motionFilterFast;
+
+    // Write frames to disk periodically in super-verbose debug mode
+    #ifdef USE_OPENCV_VIDEO
+        if (debug && debugFrameInterval) {
+            debugFrameCounter++;
+            if ((debugFrameCounter % debugFrameInterval) == 0 && debugVideoWriter.isOpened()) {
+
+                cv::Mat frame;
+                cv::cvtColor(f.frames[1], frame, cv::COLOR_GRAY2BGR);
+
+                // Draw circles over each point; shade = age
+                for (unsigned i = 0; i < f.points.size(); ++i) {
+                    int l = std::min<int>(255, f.pointInfo[i].age);
+                    cv::circle(frame, f.points[i], 2,
+                            f.pointInfo[i].age < pointTrialPeriod
+                                ? cv::Scalar(0, 0, 0)
+                                : cv::Scalar(l, 64 + l/2, 255 - l),
+                            1, CV_AA);
+                }
+
+                // Dense motion field, as a line from the center of each cell
+                for (unsigned i = 0; i < motionField.size(); ++i) {
+                    cv::Point2f center(
+                        (i % denseGridWidth + 0.5f) * denseCellWidth,
+                        (i / denseGridWidth + 0.5f) * denseCellHeight);
+                    cv::Point2f motion(motionField[i][0] * debugMotionZoom, motionField[i][1] * debugMotionZoom);
+                    cv::line(frame, center, center + motion, cv::Scalar(0, 255, 128), 1, CV_AA);
+                }
+
+                // Motion length since the last debug frame, scaled to units of pixels per field
+                uint32_t prevL = debugCaptureL;
+                uint32_t nextL = integratorL;
+                float zoom = debugMotionZoom;
+                debugCaptureL = nextL;
+                float debugL = int32_t(nextL - prevL) * (zoom / 0x10000 / debugFrameInterval);
+                cv::rectangle(frame,
+                    cv::Point2f(1, 1),
+                    cv::Point2f(3 + debugL, 4),
+                    cv::Scalar(250, 176, 0), -1, CV_AA);
+
+                // Filtered motion length dots
+                cv::rectangle(frame,
+                    cv::Point2f(1 + filterFastL * zoom, 6),
+                    cv::Point2f(3 + filterFastL * zoom, 8),
+                    cv::Scalar(255, 255, 190), -1, CV_AA);
+                cv::rectangle(frame,
+                    cv::Point2f(1 + filterSlowL * zoom, 10),
+                    cv::Point2f(3 + filterSlowL * zoom, 12),
+                    cv::Scalar(255, 190, 255), -1, CV_AA);
+
+                // Computed instantaneoud motion
+                float iM = instantaneousMotion();
+                cv::rectangle(frame,
+                    cv::Point2f(1, 14),
+                    cv::Point2f(3 + iM * zoom, 16),
+                    cv::Scalar(64, 64, 255), -1, CV_AA);
+
+                debugVideoWriter.write(frame);
+            }
+        }
+    #endif
+
+    // Check time elapsed for motion logging
+    if (motionLogStream) {
+        double now = currentTime();
+        if (now >= motionLogTimestamp + motionLogInterval) {
+
+            fprintf(motionLogStream, "%f 0x%x 0x%x 0x%x\n",
+                now, integratorX, integratorY, integratorL);
+            fflush(motionLogStream);
+
+            motionLogTimestamp = now;
+        }
+    }
+
+    std::swap(f.frames[0], f.frames[1]);
+}
+
+inline void CameraFlowAnalyzer::calculateSparseFlow(Field &f)
+{
     cv::TermCriteria termcrit(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.03);
     cv::Size subPixWinSize(6,6), winSize(15,15);
 
-    int pointsToDelete = (int) prng.uniform(0, 1.0f + deletePointProbability);
+    int pointsToDelete = (int) f.prng.uniform(0, 1.0f + deletePointProbability);
     while (pointsToDelete > 0 && !f.points.empty()) {
 
         // Randomly delete a tracking point, to keep them from getting stuck in unhelpful
         // places and to help ensure there's a steady flow of slots for new points to spawn into.
 
-        int i = std::min<int>(f.points.size()-1, prng.uniform(0, f.points.size()));
+        int i = std::min<int>(f.points.size()-1, f.prng.uniform(0, f.points.size()));
 
         if (debug) {
             fprintf(stderr, "flow[%d]: Random delete of point %d (age = %d, distance = %f)\n",
@@ -437,8 +869,8 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
 
                     // Random sampling bias, to avoid creating identical tracking points
                     const float s = discoveryGridSpacing * 0.4;
-                    int pixX = x * discoveryGridSpacing + prng.uniform(-s, s);
-                    int pixY = y * discoveryGridSpacing + prng.uniform(-s, s);
+                    int pixX = x * discoveryGridSpacing + f.prng.uniform(-s, s);
+                    int pixY = y * discoveryGridSpacing + f.prng.uniform(-s, s);
 
                     int diff = (int)f.frames[1].at<uint8_t>(pixY, pixX) - (int)f.frames[0].at<uint8_t>(pixY, pixX);
                     int diff2 = diff * diff;
@@ -458,7 +890,7 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
             cv::cornerSubPix(f.frames[0], newPoint, subPixWinSize, cv::Size(-1,-1), termcrit);
 
             // New point
-            unsigned maxAge = prng.uniform(0, maxPointAge);
+            unsigned maxAge = f.prng.uniform(0, maxPointAge);
             f.points.push_back(newPoint[0]);
             f.pointInfo.push_back(PointInfo(maxAge));
 
@@ -540,128 +972,282 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
         f.points.resize(j);
         f.pointInfo.resize(j);
 
-        // Update integrator using this field's data
+        // Motion from this field's data, merged into the integrators later
         if (denominator) {
-            integratorX += int32_t(numerator.x * 0x10000 / denominator);
-            integratorY += int32_t(numerator.y * 0x10000 / denominator);
+            f.deltaX = int32_t(numerator.x * 0x10000 / denominator);
+            f.deltaY = int32_t(numerator.y * 0x10000 / denominator);
         }
         if (denominatorL) {
-            integratorL += int32_t(numeratorL * 0x10000 / denominatorL);
+            f.deltaL = int32_t(numeratorL * 0x10000 / denominatorL);
         }
 
         if (debug) {
-            fprintf(stderr, "flow[%d]: Tracking %d points, integrator (%08x, %08x) L=%08x denominator=%f\n",
+            fprintf(stderr, "flow[%d]: Tracking %d points, delta (%08x, %08x) L=%08x denominator=%f\n",
                 (int)(&f - &fields[0]),
                 (int)f.points.size(),
-                integratorX, integratorY, integratorL,
+                f.deltaX, f.deltaY, f.deltaL,
                 denominator);
         }
     }
+}
 
-    // Update fixed-timestep motion filters on each field
-    uint32_t cL = integratorL;
-    float fL = int32_t(cL - filterCaptureL) * (1.0f / 0x10000);
-    filterCaptureL = cL;
-    filterSlowL += (fL - filterSlowL) * motionFilterSlow;
-    filterFastL += (fL - filterFastL) * motionFilterFast;
-
-    // Write frames to disk periodically in super-verbose debug mode
-    #ifdef USE_OPENCV_VIDEO
-        if (debug && debugFrameInterval) {
-            debugFrameCounter++;
-            if ((debugFrameCounter % debugFrameInterval) == 0 && debugVideoWriter.isOpened()) {
+inline unsigned CameraFlowAnalyzer::blockSAD(const uint8_t *a, const uint8_t *b, unsigned stride, unsigned rows)
+{
+    // Sum of absolute differences over a kBlockWidth-pixel-wide block
+
+#if defined(__SSE2__)
+    __m128i sum = _mm_setzero_si128();
+    for (unsigned y = 0; y < rows; y++, a += stride, b += stride) {
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(
+            _mm_loadu_si128((const __m128i*) a),
+            _mm_loadu_si128((const __m128i*) b)));
+    }
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    // 16-bit lanes can't overflow: at most 2 * 255 per row, kBlockHeight rows
+    uint16x8_t sum = vdupq_n_u16(0);
+    for (unsigned y = 0; y < rows; y++, a += stride, b += stride) {
+        uint8x16_t va = vld1q_u8(a);
+        uint8x16_t vb = vld1q_u8(b);
+        sum = vabal_u8(sum, vget_low_u8(va), vget_low_u8(vb));
+        sum = vabal_u8(sum, vget_high_u8(va), vget_high_u8(vb));
+    }
+    uint64x2_t wide = vpaddlq_u32(vpaddlq_u16(sum));
+    return vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+
+#else
+    unsigned sum = 0;
+    for (unsigned y = 0; y < rows; y++, a += stride, b += stride) {
+        for (unsigned x = 0; x < kBlockWidth; x++) {
+            sum += std::abs(int(a[x]) - int(b[x]));
+        }
+    }
+    return sum;
+#endif
+}
 
-                cv::Mat frame;
-                cv::cvtColor(f.frames[1], frame, cv::COLOR_GRAY2BGR);
+inline void CameraFlowAnalyzer::calculateDenseFlow(Field &f)
+{
+    /*
+     * Exhaustive block matching on a coarse grid. One block per cell, centered in the cell,
+     * is taken from the previous field and compared against every displacement within the
+     * search radius in the current field. A displacement only wins if it beats "no motion"
+     * by the noise threshold, so static scenes and sensor noise read as zero.
+     */
 
-                // Draw circles over each point; shade = age
-                for (unsigned i = 0; i < f.points.size(); ++i) {
-                    int l = std::min<int>(255, f.pointInfo[i].age);
-                    cv::circle(frame, f.points[i], 2,
-                            f.pointInfo[i].age < pointTrialPeriod
-                                ? cv::Scalar(0, 0, 0)
-                                : cv::Scalar(l, 64 + l/2, 255 - l),
-                            1, CV_AA);
+    const unsigned stride = f.frames[0].cols;
+    const int radius = denseSearchRadius;
+    const int maxX = stride - kBlockWidth - radius;
+    const int maxY = Camera::kLinesPerField - kBlockHeight - radius;
+    const unsigned rows = denseCellHeight < kBlockHeight ? denseCellHeight : kBlockHeight;
+    const unsigned threshold = denseNoiseThreshold * kBlockWidth * rows;
+
+    cv::Point2f numerator = cv::Point2f(0, 0);
+    float numeratorL = 0;
+    unsigned denominator = 0;
+
+    for (unsigned cy = 0; cy < denseGridHeight; cy++) {
+        for (unsigned cx = 0; cx < denseGridWidth; cx++) {
+
+            int x = (cx * denseCellWidth) + (int(denseCellWidth) - int(kBlockWidth)) / 2;
+            int y = (cy * denseCellHeight) + (int(denseCellHeight) - int(rows)) / 2;
+            x = std::max(radius, std::min(maxX, x));
+            y = std::max(radius, std::min(maxY, y));
+
+            const uint8_t *prev = f.frames[0].data + x + y * stride;
+            const uint8_t *next = f.frames[1].data + x + y * stride;
+
+            unsigned stillSAD = blockSAD(prev, next, stride, rows);
+            unsigned bestSAD = stillSAD;
+            int bestX = 0, bestY = 0;
+
+            for (int dy = -radius; dy <= radius; dy++) {
+                for (int dx = -radius; dx <= radius; dx++) {
+                    unsigned sad = blockSAD(prev, next + dx + dy * (int)stride, stride, rows);
+                    if (sad < bestSAD && sad + threshold < stillSAD) {
+                        bestSAD = sad;
+                        bestX = dx;
+                        bestY = dy;
+                    }
                 }
+            }
 
-                // Motion length since the last debug frame, scaled to units of pixels per field
-                uint32_t prevL = debugCaptureL;
-                uint32_t nextL = integratorL;
-                float zoom = debugMotionZoom;
-                debugCaptureL = nextL;
-                float debugL = int32_t(nextL - prevL) * (zoom / 0x10000 / debugFrameInterval);
-                cv::rectangle(frame,
-                    cv::Point2f(1, 1),
-                    cv::Point2f(3 + debugL, 4),
-                    cv::Scalar(250, 176, 0), -1, CV_AA);
-
-                // Filtered motion length dots
-                cv::rectangle(frame,
-                    cv::Point2f(1 + filterFastL * zoom, 6),
-                    cv::Point2f(3 + filterFastL * zoom, 8),
-                    cv::Scalar(255, 255, 190), -1, CV_AA);
-                cv::rectangle(frame,
-                    cv::Point2f(1 + filterSlowL * zoom, 10),
-                    cv::Point2f(3 + filterSlowL * zoom, 12),
-                    cv::Scalar(255, 190, 255), -1, CV_AA);
-
-                // Computed instantaneoud motion
-                float iM = instantaneousMotion();
-                cv::rectangle(frame,
-                    cv::Point2f(1, 14),
-                    cv::Point2f(3 + iM * zoom, 16),
-                    cv::Scalar(64, 64, 255), -1, CV_AA);
+            f.cellMotion[cx + cy * denseGridWidth] = Vec2(bestX, bestY);
 
-                debugVideoWriter.write(frame);
+            if (bestX || bestY) {
+                numerator.x += bestX;
+                numerator.y += bestY;
+                numeratorL += sqrtf(bestX * bestX + bestY * bestY);
+                denominator++;
             }
         }
-    #endif
+    }
 
-    std::swap(f.frames[0], f.frames[1]);
+    // Summary motion is the average over cells that moved, like the average over tracked points
+    if (denominator) {
+        f.deltaX = int32_t(numerator.x * 0x10000 / denominator);
+        f.deltaY = int32_t(numerator.y * 0x10000 / denominator);
+        f.deltaL = int32_t(numeratorL * 0x10000 / denominator);
+    }
+
+    if (debug) {
+        fprintf(stderr, "flow[%d]: Dense motion in %d cells, delta (%08x, %08x) L=%08x\n",
+            (int)(&f - &fields[0]), denominator,
+            f.deltaX, f.deltaY, f.deltaL);
+    }
 }
 
-inline CameraFlowCapture::CameraFlowCapture(const CameraFlowAnalyzer &analyzer)
-    : analyzer(analyzer)
+inline Vec2 CameraFlowAnalyzer::motionFieldAt(Vec3 model) const
 {
-    originX = analyzer.integratorX;
-    originY = analyzer.integratorY;
-    originL = analyzer.integratorL;
+    if (motionField.empty()) {
+        return Vec2(0, 0);
+    }
+
+    /*
+     * Invert the transform. Image positions, measured in decimated pixels from the center
+     * of the frame, map to model coordinates using the same basis as motion does. The basis
+     * may not span the model point, so find the nearest image position by least squares.
+     */
+
+    Vec3 d = model - origin;
+    float xx = dot(basisX, basisX);
+    float xy = dot(basisX, basisY);
+    float yy = dot(basisY, basisY);
+    float det = xx * yy - xy * xy;
+    if (!det) {
+        return Vec2(0, 0);
+    }
+
+    float dx = dot(d, basisX);
+    float dy = dot(d, basisY);
+    float u = (dx * yy - dy * xy) / det + 0.5f * denseCellWidth * denseGridWidth;
+    float v = (dy * xx - dx * xy) / det + 0.5f * denseCellHeight * denseGridHeight;
+
+    int cx = floorf(u / denseCellWidth);
+    int cy = floorf(v / denseCellHeight);
+    if (cx < 0 || cy < 0 || cx >= (int)denseGridWidth || cy >= (int)denseGridHeight) {
+        return Vec2(0, 0);
+    }
+
+    return motionField[cx + cy * denseGridWidth];
+}
+
+inline CameraFlowFusion::CameraFlowFusion()
+{}
+
+inline CameraFlowFusion::CameraFlowFusion(const CameraFlowAnalyzer &analyzer)
+{
+    add(analyzer);
+}
+
+inline void CameraFlowFusion::add(const CameraFlowAnalyzer &analyzer, float weight)
+{
+    Input i;
+    i.analyzer = &analyzer;
+    i.weight = weight;
+    inputs.push_back(i);
+}
+
+inline CameraFlowCapture::CameraFlowCapture(const CameraFlowFusion &fusion)
+    : pixels(0, 0), model(0, 0, 0), motionLength(0)
+{
+    sources.resize(fusion.inputs.size());
+
+    for (unsigned i = 0; i < sources.size(); i++) {
+        Source &s = sources[i];
+        s.analyzer = fusion.inputs[i].analyzer;
+        s.weight = fusion.inputs[i].weight;
+
+        CameraFlowAnalyzer::Snapshot snap = s.analyzer->snapshot();
+        s.originX = snap.x;
+        s.originY = snap.y;
+        s.originL = snap.l;
+        s.pixels = Vec2(0, 0);
+    }
+
     capture();
 }       
 
 inline void CameraFlowCapture::origin()
 {
-    originX = captureX;
-    originY = captureY;
-    originL = captureL;
+    for (unsigned i = 0; i < sources.size(); i++) {
+        Source &s = sources[i];
+        s.originX = s.captureX;
+        s.originY = s.captureY;
+        s.originL = s.captureL;
+    }
 }
 
 inline float CameraFlowCapture::instantaneousMotion() const
 {
-    return analyzer.instantaneousMotion();
+    float m = 0;
+    for (unsigned i = 0; i < sources.size(); i++) {
+        m = std::max(m, sources[i].analyzer->instantaneousMotion());
+    }
+    return m;
+}
+
+inline Vec3 CameraFlowCapture::motionAt(Vec3 model) const
+{
+    Vec3 total(0, 0, 0);
+    for (unsigned i = 0; i < sources.size(); i++) {
+        const CameraFlowAnalyzer &analyzer = *sources[i].analyzer;
+        Vec2 m = analyzer.motionFieldAt(model);
+        total += sources[i].weight * (analyzer.basisX * m[0] + analyzer.basisY * m[1]);
+    }
+    return total;
 }
 
 inline void CameraFlowCapture::capture(float filterRate)
 {
-    captureX = analyzer.integratorX;
-    captureY = analyzer.integratorY;
-    captureL = analyzer.integratorL;
-
-    // Fixed point to floating point
-    float targetX = (int32_t)(captureX - originX) / float(0x10000);
-    float targetY = (int32_t)(captureY - originY) / float(0x10000);
-    float targetMotionLength = (int32_t)(captureL - originL) / float(0x10000);
-
-    // Smoothing filter
-    pixels[0] += (targetX - pixels[0]) * filterRate;
-    pixels[1] += (targetY - pixels[1]) * filterRate;
-    motionLength += (targetMotionLength - motionLength) * filterRate;
+    Vec2 totalPixels(0, 0);
+    Vec3 totalModel(0, 0, 0);
+    float targetMotionLength = 0;
+
+    double now = CameraFlowAnalyzer::currentTime();
+
+    for (unsigned i = 0; i < sources.size(); i++) {
+        Source &s = sources[i];
+        const CameraFlowAnalyzer &analyzer = *s.analyzer;
+        CameraFlowAnalyzer::Snapshot snap = analyzer.snapshot();
+
+        s.captureX = snap.x;
+        s.captureY = snap.y;
+        s.captureL = snap.l;
+
+        // Fixed point to floating point
+        float targetX = (int32_t)(s.captureX - s.originX) / float(0x10000);
+        float targetY = (int32_t)(s.captureY - s.originY) / float(0x10000);
+        float targetL = (int32_t)(s.captureL - s.originL) / float(0x10000);
+
+        if (analyzer.prediction) {
+            // Extrapolate from the field's capture time to the expected display time. The
+            // first part of that is measured; the rest is the configured output latency.
+            float dt = std::max(0.0f, std::min(analyzer.predictionLimit,
+                float(now - snap.timestamp) + analyzer.predictionLatency));
+            targetX += snap.vx * dt;
+            targetY += snap.vy * dt;
+            targetL += std::max(0.0f, snap.vl) * dt;
+        }
+
+        targetMotionLength += s.weight * targetL;
 
-    // Transform to model coordinates
-    model = analyzer.origin + analyzer.basisX * pixels[0] + analyzer.basisY * pixels[1];
+        // Smoothing filter
+        s.pixels[0] += (targetX - s.pixels[0]) * filterRate;
+        s.pixels[1] += (targetY - s.pixels[1]) * filterRate;
+
+        // Transform to model coordinates
+        totalPixels += s.weight * s.pixels;
+        totalModel += s.weight * (analyzer.origin + analyzer.basisX * s.pixels[0] + analyzer.basisY * s.pixels[1]);
+    }
+
+    pixels = totalPixels;
+    model = totalModel;
+    motionLength += (targetMotionLength - motionLength) * filterRate;
 }
 
-inline CameraFlowDebugEffect::CameraFlowDebugEffect(CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+inline CameraFlowDebugEffect::CameraFlowDebugEffect(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : scale(config["scale"].GetDouble()),
       radius(config["radius"].GetDouble()),
       motionLengthScale(config["motionLengthScale"].GetDouble()),
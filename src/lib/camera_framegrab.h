@@ -4,8 +4,8 @@
  * The "Camera" interface represents a low-level analog video
  * capture hook. That level is where we build our interactivity
  * algorithms, to get the lowest latency. But we still want to
- * see the camera's stream sometimes! This class assembles single
- * frames of video, saving them as JPEG files.
+ * see the camera's stream sometimes! This class waits for a complete
+ * frame to arrive in a CameraFieldStore, saving it as a JPEG file.
  *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
@@ -37,11 +37,12 @@
 #include <string>
 #include "jpge.h"
 #include "camera.h"
+#include "camera_field_store.h"
 
 
 class CameraFramegrab {
 public:
-    CameraFramegrab();
+    CameraFramegrab(const CameraFieldStore &store);
 
     // Start saving the next complete frame to the indicated file, as a JPEG
     void begin(const char *filename);
@@ -52,15 +53,12 @@ public:
     // Is a framegrab in progress? A framegrab must see an entire frame of video go by.
     bool isGrabbing();
 
-    // Process another chunk of video data. Returns 'true' as long as a
+    // Watch another chunk of video go by. Returns 'true' as long as a
     // framegrab is in progress (it wants more data).
     bool process(const Camera::VideoChunk &chunk);
 
-    // Returns raw capture-buffer in UYVY format.
-    const uint8_t *getUYVY() const;
-
 private:
-    uint8_t frame[Camera::kPixels * 2];
+    const CameraFieldStore &store;
     uint8_t rgb[Camera::kPixels * 3];
 
     std::string grabFile;
@@ -73,7 +71,8 @@ private:
 
 class CameraPeriodicFramegrab {
 public:
-    CameraPeriodicFramegrab(const char *name = "frame", float interval = 1.0f, int firstIndex = 1);
+    CameraPeriodicFramegrab(const CameraFieldStore &store, const char *name = "frame",
+        float interval = 1.0f, int firstIndex = 1);
 
     CameraFramegrab grab;
 
@@ -92,8 +91,8 @@ private:
  *****************************************************************************************/
 
 
-inline CameraFramegrab::CameraFramegrab()
-    : grabLine(0), grabVBL(0)
+inline CameraFramegrab::CameraFramegrab(const CameraFieldStore &store)
+    : store(store), grabLine(0), grabVBL(0)
 {}
 
 inline void CameraFramegrab::begin(const char *filename)
@@ -123,21 +122,10 @@ inline bool CameraFramegrab::isGrabbing()
     return !grabFile.empty();
 }
 
-inline const uint8_t *CameraFramegrab::getUYVY() const
-{
-    return frame;
-}
-
 inline bool CameraFramegrab::process(const Camera::VideoChunk &chunk)
 {
-    // Store data in capture buffer. Always do this when process()
-    // is called, to keep the getUYVY() results fresh. If the caller
-    // wants to avoid this overhead when not grabbing, use an
-    // isGrabbing() test first.
-    //
-    // Note that this will run on the camera thread!
-
-    memcpy(frame + chunk.framebufferOffset(), chunk.data, chunk.byteCount);
+    // The video data itself lives in the field store; we only need
+    // to count fields. Note that this will run on the camera thread!
 
     if (!isGrabbing()) {
         return false;
@@ -164,29 +152,42 @@ inline bool CameraFramegrab::process(const Camera::VideoChunk &chunk)
 
 inline void CameraFramegrab::finishGrab()
 {
+    // The most recent pair of fields, interlaced back together
+    CameraFieldStore::Ref fields[Camera::kFields];
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        fields[i] = store.latest(i);
+        if (!fields[i].isValid()) {
+            fprintf(stderr, "camera: No video available for %s\n", grabFile.c_str());
+            cancel();
+            return;
+        }
+    }
+
     // Convert UYVY to RGB
 
-    const uint8_t *src = frame;
     uint8_t *dest = rgb;
 
-    for (unsigned i = Camera::kPixels / 2; i; --i) {
+    for (unsigned y = 0; y < Camera::kLinesPerFrame; y++) {
+        const uint8_t *src = fields[y % Camera::kFields].line(y / Camera::kFields);
+        for (unsigned i = Camera::kPixelsPerLine / 2; i; --i) {
 
-        int u  = *(src++) - 128;
-        int y1 = *(src++) - 16;
-        int v  = *(src++) - 128;
-        int y2 = *(src++) - 16;
+            int u  = *(src++) - 128;
+            int y1 = *(src++) - 16;
+            int v  = *(src++) - 128;
+            int y2 = *(src++) - 16;
 
-        int r = (v * 91947) >> 16;
-        int g = (u * -22544 + v * -46793) >> 16;
-        int b = (u * 115999) >> 16;
+            int r = (v * 91947) >> 16;
+            int g = (u * -22544 + v * -46793) >> 16;
+            int b = (u * 115999) >> 16;
 
-        *(dest++) = std::max(0, std::min(255, r + y1));
-        *(dest++) = std::max(0, std::min(255, g + y1));
-        *(dest++) = std::max(0, std::min(255, b + y1));
+            *(dest++) = std::max(0, std::min(255, r + y1));
+            *(dest++) = std::max(0, std::min(255, g + y1));
+            *(dest++) = std::max(0, std::min(255, b + y1));
 
-        *(dest++) = std::max(0, std::min(255, r + y2));
-        *(dest++) = std::max(0, std::min(255, g + y2));
-        *(dest++) = std::max(0, std::min(255, b + y2));
+            *(dest++) = std::max(0, std::min(255, r + y2));
+            *(dest++) = std::max(0, std::min(255, g + y2));
+            *(dest++) = std::max(0, std::min(255, b + y2));
+        }
     }
 
     // Compress the JPEG
@@ -202,8 +203,9 @@ inline void CameraFramegrab::finishGrab()
     cancel();
 }
 
-inline CameraPeriodicFramegrab::CameraPeriodicFramegrab(const char *name, float interval, int firstIndex)
-    : timer(interval), interval(interval), index(firstIndex), name(name)
+inline CameraPeriodicFramegrab::CameraPeriodicFramegrab(const CameraFieldStore &store,
+    const char *name, float interval, int firstIndex)
+    : grab(store), timer(interval), interval(interval), index(firstIndex), name(name)
 {}
 
 void CameraPeriodicFramegrab::timeStep(float ts)
@@ -29,6 +29,7 @@
 #pragma once
 
 #include "camera.h"
+#include "camera_field_store.h"
 
 
 /*
@@ -79,14 +80,19 @@ private:
 
 
 /*
- * Buffer every sampled luminance value, using the 8Q grid
+ * Read sampled luminance values on the 8Q grid, directly out of the field store.
+ * capture() holds on to the most recent field of each parity until the next capture().
  */
 class CameraLuminanceBuffer
 {
 public:
-    CameraLuminanceBuffer();
-    void process(const Camera::VideoChunk &chunk);
-    uint8_t buffer[CameraSampler8Q::kSamples];
+    CameraLuminanceBuffer(const CameraFieldStore &store);
+    void capture();
+    uint8_t sample(unsigned index) const;
+
+private:
+    const CameraFieldStore &store;
+    CameraFieldStore::Ref fields[Camera::kFields];
 };
 
 
@@ -98,12 +104,9 @@ public:
 class CameraSamplerSobel
 {
 public:
-    CameraSamplerSobel();
+    CameraSamplerSobel(const CameraFieldStore &store);
     void process(const Camera::VideoChunk &chunk);
 
-    // Diff buffer for raw video
-    uint8_t luminance[Camera::kPixels];
-
     // Diff buffer for sobel magnitude (XY)
     float sobelXY[CameraSampler8Q::kSamples];
 
@@ -113,6 +116,11 @@ public:
 private:
     static const float kMotionFilterGain = 1e-2;
 
+    // Previous field with the same parity, for finding deltas
+    const CameraFieldStore &store;
+    CameraFieldStore::Ref previous;
+    unsigned previousField;
+
     struct {
         // Layout of buffers such that we don't need to bounds-check while updating sobel filter
         int padding1[Camera::kPixelsPerLine * 2];
@@ -195,11 +203,11 @@ inline bool CameraSampler8Q::next(unsigned &index, uint8_t &luminance)
 }
 
 
-inline CameraSamplerSobel::CameraSamplerSobel()
+inline CameraSamplerSobel::CameraSamplerSobel(const CameraFieldStore &store)
+    : store(store), previousField(-1)
 {
     memset(sobelX, 0, sizeof sobelX);
     memset(sobelY, 0, sizeof sobelY);
-    memset(luminance, 0, sizeof luminance);
     memset(sobelXY, 0, sizeof sobelXY);
     memset(motion, 0, sizeof motion);
 }
@@ -212,15 +220,21 @@ inline void CameraSamplerSobel::process(const Camera::VideoChunk &chunk)
     int yIndex8q = y * CameraSampler8Q::kBlocksWide;
     unsigned mask = CameraSampler8Q::x8q(y) * 2 + 1;
 
+    // The store already has this chunk; compare against the last field with this parity
+    if (chunk.field != previousField) {
+        previous = store.latest(chunk.field);
+        previousField = chunk.field;
+    }
+    const uint8_t *prevData = previous.isValid() ? previous.line(iter.line) : 0;
+
     while (iter.byteCount) {
         if (iter.byteOffset & 1) {
             // Luminance
 
             // Delta detect
             int index = yIndex + (iter.byteOffset >> 1);
-            int prevL = luminance[index];
+            int prevL = prevData ? prevData[iter.byteOffset] : 0;
             int nextL = *iter.data;
-            luminance[index] = nextL;
             int delta = nextL - prevL;
             int delta2 = delta * 2;
 
@@ -268,19 +282,27 @@ inline void CameraSamplerSobel::process(const Camera::VideoChunk &chunk)
 }
 
 
-inline CameraLuminanceBuffer::CameraLuminanceBuffer()
+inline CameraLuminanceBuffer::CameraLuminanceBuffer(const CameraFieldStore &store)
+    : store(store)
+{}
+
+inline void CameraLuminanceBuffer::capture()
 {
-    memset(buffer, 0, sizeof buffer);
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        fields[i] = store.latest(i);
+    }
 }
 
-inline void CameraLuminanceBuffer::process(const Camera::VideoChunk &chunk)
+inline uint8_t CameraLuminanceBuffer::sample(unsigned index) const
 {
-    unsigned sampleIndex;
-    uint8_t luminance;
- 
-    CameraSampler8Q s8q(chunk);
- 
-    while (s8q.next(sampleIndex, luminance)) {
-        buffer[sampleIndex] = luminance;
+    // Inverse of CameraSampler8Q: frame row, then the luminance byte in that row's block
+
+    unsigned y = CameraSampler8Q::sampleY(index);
+    const CameraFieldStore::Ref &f = fields[y % Camera::kFields];
+    if (!f.isValid()) {
+        return 0;
     }
+
+    unsigned byteOffset = (CameraSampler8Q::blockX(index) << 4) + CameraSampler8Q::x8q(y) * 2 + 1;
+    return f.line(y / Camera::kFields)[byteOffset];
 }
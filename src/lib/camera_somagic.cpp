@@ -3,7 +3,8 @@
  * USB ID 1c88:0007
  *
  * Implements the abstract camera interface in camera.h.
- * This runs on a separate thread, and handles USB hotplug.
+ * Each device runs on a separate thread with its own libusb context,
+ * and handles USB hotplug independently.
  *
  * Modifications by Micah Elizabeth Scott, 2014.
  *
@@ -48,7 +49,8 @@ using namespace Camera;
 
 #define SOMAGIC_FIRMWARE_PATH       "data/somagic_firmware.bin"
 #define VENDOR                      0x1c88
-#define PRODUCT_WITHOUT_FIRMWARE    0x0007
+
+static const int PRODUCT_WITHOUT_FIRMWARE = 0x0007;
 
 // Different firmware versions yield different vendor IDs
 #define PRODUCT_COUNT 4
@@ -136,27 +138,74 @@ struct alg1_video_state_t {
     enum sync_state state;
 };
 
-static struct alg1_video_state_t alg1_vs;
+class SomagicDevice : public Device {
+public:
+    SomagicDevice(unsigned index);
+    virtual tthread::thread* start(videoCallback_t callback, void *context);
+
+    struct libusb_device_handle *devh;
+
+private:
+    // Userdata for each isochronous transfer
+    struct TransferInfo {
+        SomagicDevice *device;
+        unsigned index;
+    };
+
+    unsigned index;
+    struct libusb_context *usb;
+    struct alg1_video_state_t alg1_vs;
+
+    tthread::thread *cameraThread;
+    videoCallback_t videoCallback;
+    void *videoCallbackContext;
+
+    int pending_requests;
+    unsigned resubmit_bitmask;
+    int lines_per_field;
+
+    // Buffers and transfer pointers for isochronous data.
+    // Allocated on first use and never freed, so we don't have to worry about
+    // use-after-free during shutdown.
+    struct libusb_transfer* tfr[num_iso_transfers];
+    TransferInfo tfrInfo[num_iso_transfers];
+    unsigned char (*isobuf)[64 * 3072];
+
+    struct libusb_device *find_device(int vendor, const int *products, int productCount, unsigned index);
+    void install_firmware(struct libusb_device *dev);
+    void alg1_process(struct alg1_video_state_t *vs, unsigned char *buffer, int length);
+    static void camera_usb_callback(struct libusb_transfer *tfr);
+    void usb_callback(struct libusb_transfer *tfr, unsigned tfrIndex);
+    int somagic_write_reg(uint16_t reg, uint8_t val);
+    int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val);
+    int somagic_capture();
+    int somagic_init();
+    static void cameraThreadFunc(void *context);
+    void cameraThreadMain();
+};
 
-static tthread::thread *cameraThread = 0;
-static videoCallback_t videoCallback;
-static void *videoCallbackContext;
+// Every device we've created, so the signal handler can release them all
+static const unsigned kMaxDevices = 16;
+static SomagicDevice *allDevices[kMaxDevices];
+static unsigned numDevices = 0;
 
-static struct libusb_device_handle *devh;
-static int pending_requests;
-static unsigned resubmit_bitmask;
-static int lines_per_field;
+// Only one thread at a time may be loading firmware
+static tthread::mutex firmwareLock;
 
 
 static void release_usb_device(int ret)
 {
     fprintf(stderr, "Emergency exit\n");
-    ret = libusb_release_interface(devh, 0);
-    if (!ret) {
-        perror("Failed to release interface");
+    for (unsigned i = 0; i < numDevices; i++) {
+        struct libusb_device_handle *devh = allDevices[i]->devh;
+        if (devh) {
+            ret = libusb_release_interface(devh, 0);
+            if (!ret) {
+                perror("Failed to release interface");
+            }
+            libusb_close(devh);
+        }
     }
-    libusb_close(devh);
-    libusb_exit(NULL);
     exit(1);
 }
 
@@ -175,19 +224,40 @@ static void print_bytes(unsigned char *bytes, int len)
     }
 }
 
-static struct libusb_device *find_device(int vendor, int product)
+SomagicDevice::SomagicDevice(unsigned index)
+    : devh(0), index(index), usb(0), cameraThread(0), isobuf(0)
 {
+    memset(tfr, 0, sizeof tfr);
+    memset(&alg1_vs, 0, sizeof alg1_vs);
+
+    if (numDevices < kMaxDevices) {
+        allDevices[numDevices++] = this;
+    }
+}
+
+struct libusb_device *SomagicDevice::find_device(int vendor, const int *products, int productCount, unsigned index)
+{
+    // Find the Nth device matching any of the product IDs, in enumeration order.
+
     struct libusb_device **list;
     struct libusb_device *dev = NULL;
     struct libusb_device_descriptor descriptor;
     struct libusb_device *item;
-    int i;
+    int i, p;
     ssize_t count;
-    count = libusb_get_device_list(NULL, &list);
+    count = libusb_get_device_list(usb, &list);
     for (i = 0; i < count; i++) {
         item = list[i];
         libusb_get_device_descriptor(item, &descriptor);
-        if (descriptor.idVendor == vendor && descriptor.idProduct == product) {
+        bool match = false;
+        if (descriptor.idVendor == vendor) {
+            for (p = 0; p < productCount; p++) {
+                if (descriptor.idProduct == products[p]) {
+                    match = true;
+                }
+            }
+        }
+        if (match && !dev && index-- == 0) {
             dev = item;
         } else {
             libusb_unref_device(item);
@@ -197,7 +267,7 @@ static struct libusb_device *find_device(int vendor, int product)
     return dev;
 }
 
-static void install_firmware(struct libusb_device *dev)
+void SomagicDevice::install_firmware(struct libusb_device *dev)
 {
     int ret;
     unsigned char buf[65535];
@@ -308,7 +378,7 @@ done:
     }
 }
 
-static void alg1_process(struct alg1_video_state_t *vs, unsigned char *buffer, int length)
+void SomagicDevice::alg1_process(struct alg1_video_state_t *vs, unsigned char *buffer, int length)
 {
     unsigned char *next = buffer;
     unsigned char *end = buffer + length;
@@ -461,9 +531,14 @@ static void alg1_process(struct alg1_video_state_t *vs, unsigned char *buffer, i
     } while (next < end);
 }
 
-static void camera_usb_callback(struct libusb_transfer *tfr)
+void SomagicDevice::camera_usb_callback(struct libusb_transfer *tfr)
+{
+    TransferInfo *info = (TransferInfo*) tfr->user_data;
+    info->device->usb_callback(tfr, info->index);
+}
+
+void SomagicDevice::usb_callback(struct libusb_transfer *tfr, unsigned tfrIndex)
 {
-    unsigned tfrIndex = (uintptr_t) tfr->user_data;
     int num = tfr->num_iso_packets;
     int i;
     unsigned char *data;
@@ -500,7 +575,7 @@ static void camera_usb_callback(struct libusb_transfer *tfr)
     resubmit_bitmask |= 1 << tfrIndex;
 }
 
-static int somagic_write_reg(uint16_t reg, uint8_t val)
+int SomagicDevice::somagic_write_reg(uint16_t reg, uint8_t val)
 {
     int ret;
     uint8_t buf[8];
@@ -520,7 +595,7 @@ static int somagic_write_reg(uint16_t reg, uint8_t val)
     return ret;
 }
 
-static int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
+int SomagicDevice::somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
 {
     int ret;
     uint8_t buf[8];
@@ -541,15 +616,14 @@ static int somagic_write_i2c(uint8_t dev_addr, uint8_t reg, uint8_t val)
     return ret;
 }
 
-static int somagic_capture()
+int SomagicDevice::somagic_capture()
 {
     int ret;
     int i = 0;
 
-    // Buffers and transfer pointers for isochronous data.
-    // Static so we don't have to worry about use-after-free during shutdown.
-    static struct libusb_transfer* tfr[num_iso_transfers];
-    static unsigned char isobuf[num_iso_transfers][64 * 3072];
+    if (isobuf == NULL) {
+        isobuf = new unsigned char[num_iso_transfers][64 * 3072];
+    }
 
     for (i = 0; i < num_iso_transfers; i++) {
         // Allocate only on first use; keep them around across hotplug events
@@ -561,11 +635,13 @@ static int somagic_capture()
             }
         }
 
-        // Reinitialize transfer struct. Note that userdata is the transfer index.
+        // Reinitialize transfer struct. Note that userdata identifies the device and transfer index.
+        tfrInfo[i].device = this;
+        tfrInfo[i].index = i;
         libusb_fill_iso_transfer(tfr[i], devh, 0x00000082,
             isobuf[i], 64 * 3072, 64,
             camera_usb_callback,
-            (void*)(uintptr_t)i, 2000);
+            &tfrInfo[i], 2000);
 
         libusb_set_iso_packet_lengths(tfr[i], 3072);
     }
@@ -602,13 +678,13 @@ static int somagic_capture()
             pending_requests++;
         }
 
-        libusb_handle_events(NULL);
+        libusb_handle_events(usb);
     }
 
     return 0;
 }
 
-static int somagic_init()
+int SomagicDevice::somagic_init()
 {
     int ret;
     uint8_t work;
@@ -977,30 +1053,34 @@ static int somagic_init()
     return 0;
 }
 
-static void cameraThreadFunc(void *)
+void SomagicDevice::cameraThreadFunc(void *context)
+{
+    static_cast<SomagicDevice*>(context)->cameraThreadMain();
+}
+
+void SomagicDevice::cameraThreadMain()
 {
     /*
      * Thread runs forever, looking for devices
      */
 
-    libusb_init(NULL);
+    libusb_init(&usb);
 
     while (true) {
         libusb_device *dev;
 
-        dev = find_device(VENDOR, PRODUCT_WITHOUT_FIRMWARE);
+        firmwareLock.lock();
+        dev = find_device(VENDOR, &PRODUCT_WITHOUT_FIRMWARE, 1, 0);
         if (dev) {
             install_firmware(dev);
             libusb_unref_device(dev);
+        }
+        firmwareLock.unlock();
+        if (dev) {
             continue;
         }
 
-        for (unsigned p = 0; p < PRODUCT_COUNT; p++) {
-            dev = find_device(VENDOR, PRODUCT[p]);
-            if (dev) {
-                break;
-            }
-        }
+        dev = find_device(VENDOR, PRODUCT, PRODUCT_COUNT, index);
 
         if (dev) {
             libusb_open(dev, &devh);
@@ -1010,6 +1090,7 @@ static void cameraThreadFunc(void *)
                 }
                 libusb_release_interface(devh, 0);
                 libusb_close(devh);
+                devh = 0;
             } else {
                 perror("Failed to open USB device");
             }
@@ -1022,18 +1103,50 @@ static void cameraThreadFunc(void *)
     }
 }
 
+tthread::thread* SomagicDevice::start(videoCallback_t callback, void *context)
+{
+    if (cameraThread) {
+        // Already running
+        return 0;
+    }
+
+    videoCallback = callback;
+    videoCallbackContext = context;
+
+    cameraThread = new tthread::thread(cameraThreadFunc, this);
+
+    return cameraThread;
+}
+
 namespace Camera {
+    Device* newSomagicDevice(unsigned index) {
+        return new SomagicDevice(index);
+    }
+
+    Device* open(const char *name) {
+        if (!strcmp(name, "usb")) {
+            return newSomagicDevice(0);
+        }
+        if (!strncmp(name, "usb:", 4)) {
+            return newSomagicDevice(atoi(name + 4));
+        }
+        if (!strncmp(name, "file:", 5)) {
+            return newFileDevice(name + 5);
+        }
+        if (!strcmp(name, "synthetic")) {
+            return newSyntheticDevice();
+        }
+        return 0;
+    }
+
     tthread::thread* start(videoCallback_t callback, void *context) {
-        if (cameraThread) {
-            // Only one instance supported
+        static Device *firstDevice = 0;
+        if (firstDevice) {
+            // Only one instance supported by this interface
             return 0;
         }
 
-        videoCallback = callback;
-        videoCallbackContext = context;
-
-        cameraThread = new tthread::thread(cameraThreadFunc, 0);
-
-        return cameraThread;
+        firstDevice = newSomagicDevice(0);
+        return firstDevice->start(callback, context);
     }
 }
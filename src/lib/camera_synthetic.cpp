@@ -0,0 +1,244 @@
+/*
+ * Synthetic video source. Implements the abstract camera interface in camera.h
+ * with generated video, for running the art without any camera or recording.
+ *
+ * The picture is a fixed random texture seen through a window that drifts
+ * around. Like a room with people in it, there are stretches of stillness
+ * broken up by bursts of motion, so the flow analyzer and everything
+ * downstream of it see something plausible.
+ *
+ * Fields are either delivered on a thread at the NTSC field rate, or one at a
+ * time with step() when the caller is running on simulated time.
+ *
+ * 2014, Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * This file is released into the public domain.
+ */
+
+#include "camera.h"
+#include "prng.h"
+#include "tinythread.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <unistd.h>
+#include <sys/time.h>
+
+using namespace Camera;
+
+
+class SyntheticDevice : public Device {
+public:
+    SyntheticDevice();
+    virtual tthread::thread* start(videoCallback_t callback, void *context);
+    virtual bool step(videoCallback_t callback, void *context);
+
+private:
+    // Texture is square, and a power of two so we can wrap with a mask
+    static const unsigned kTextureSize = 1024;
+
+    // Same payload size as one USB isochronous block, minus its header
+    static const unsigned kChunkSize = 0x400 - 4;
+
+    tthread::thread *thread;
+    videoCallback_t videoCallback;
+    void *videoCallbackContext;
+
+    PRNG prng;
+    std::vector<uint8_t> texture;
+    uint8_t line[kBytesPerLine];
+    unsigned nextField;
+
+    // Motion state, in pixels and pixels per field
+    double x, y, vx, vy;
+    double targetVX, targetVY;
+    double phaseFields;     // Fields left in the current still or active phase
+    bool active;
+
+    static void threadFunc(void *context);
+    void threadMain();
+    void generateTexture();
+    void updateMotion();
+    void sendField(unsigned field);
+};
+
+
+SyntheticDevice::SyntheticDevice()
+    : thread(0), nextField(0),
+      x(0), y(0), vx(0), vy(0), targetVX(0), targetVY(0),
+      phaseFields(0), active(false)
+{
+    prng.seed(42);
+    generateTexture();
+}
+
+void SyntheticDevice::generateTexture()
+{
+    // Sum of a few octaves of smoothed noise, so there are features
+    // at several scales for block matching and feature tracking to find.
+
+    std::vector<float> sum(kTextureSize * kTextureSize, 0.0f);
+    std::vector<float> octave(kTextureSize * kTextureSize);
+    const unsigned mask = kTextureSize - 1;
+
+    for (unsigned cell = 4; cell <= 64; cell *= 2) {
+        for (unsigned i = 0; i < octave.size(); i++) {
+            octave[i] = prng.uniform(-1, 1);
+        }
+
+        // Box blur across the cell size, horizontally then vertically
+        std::vector<float> blurred(octave.size());
+        for (unsigned pass = 0; pass < 2; pass++) {
+            for (unsigned y = 0; y < kTextureSize; y++) {
+                for (unsigned x = 0; x < kTextureSize; x++) {
+                    float total = 0;
+                    for (unsigned k = 0; k < cell; k++) {
+                        total += pass ? octave[((y + k) & mask) * kTextureSize + x]
+                                      : octave[y * kTextureSize + ((x + k) & mask)];
+                    }
+                    blurred[y * kTextureSize + x] = total / cell;
+                }
+            }
+            octave.swap(blurred);
+        }
+
+        for (unsigned i = 0; i < sum.size(); i++) {
+            sum[i] += octave[i] * sqrtf(cell);
+        }
+    }
+
+    texture.resize(sum.size());
+    for (unsigned i = 0; i < sum.size(); i++) {
+        texture[i] = std::min(235.0f, std::max(16.0f, 128.0f + sum[i] * 20.0f));
+    }
+}
+
+void SyntheticDevice::updateMotion()
+{
+    // Alternate between still and active phases, each lasting a random
+    // number of seconds. While active, velocity wanders between random targets.
+
+    if (--phaseFields <= 0) {
+        active = !active;
+        phaseFields = 60 * (active ? prng.uniform(5, 30) : prng.uniform(5, 40));
+    }
+
+    if (active) {
+        if (prng.uniform() < 0.02) {
+            targetVX = prng.uniform(-6, 6);
+            targetVY = prng.uniform(-3, 3);
+        }
+    } else {
+        targetVX = targetVY = 0;
+    }
+
+    const double rate = 0.05;
+    vx += (targetVX - vx) * rate;
+    vy += (targetVY - vy) * rate;
+    x += vx;
+    y += vy;
+}
+
+void SyntheticDevice::sendField(unsigned field)
+{
+    const unsigned mask = kTextureSize - 1;
+    int ox = floor(x);
+    int oy = floor(y);
+
+    for (unsigned l = 0; l < kLinesPerField; l++) {
+        // Interlaced: each field covers every other line of the frame
+        const uint8_t *row = &texture[((oy + l * kFields + field) & mask) * kTextureSize];
+
+        for (unsigned p = 0; p < kPixelsPerLine; p += 2) {
+            uint8_t *dest = line + p * kBytesPerPixel;
+            dest[0] = 128;
+            dest[1] = row[(ox + p) & mask];
+            dest[2] = 128;
+            dest[3] = row[(ox + p + 1) & mask];
+        }
+
+        VideoChunk chunk;
+        chunk.line = l;
+        chunk.field = field;
+        chunk.byteOffset = 0;
+
+        while (chunk.byteOffset < kBytesPerLine) {
+            chunk.byteCount = std::min(kChunkSize, kBytesPerLine - chunk.byteOffset);
+            chunk.data = line + chunk.byteOffset;
+            videoCallback(chunk, videoCallbackContext);
+            chunk.byteOffset += chunk.byteCount;
+        }
+    }
+}
+
+bool SyntheticDevice::step(videoCallback_t callback, void *context)
+{
+    if (thread) {
+        // Already running on its own
+        return false;
+    }
+
+    videoCallback = callback;
+    videoCallbackContext = context;
+
+    updateMotion();
+    sendField(nextField);
+    nextField = (nextField + 1) % kFields;
+    return true;
+}
+
+tthread::thread* SyntheticDevice::start(videoCallback_t callback, void *context)
+{
+    if (thread) {
+        // Already running
+        return 0;
+    }
+
+    videoCallback = callback;
+    videoCallbackContext = context;
+
+    thread = new tthread::thread(threadFunc, this);
+
+    return thread;
+}
+
+void SyntheticDevice::threadFunc(void *context)
+{
+    static_cast<SyntheticDevice*>(context)->threadMain();
+}
+
+void SyntheticDevice::threadMain()
+{
+    const double fieldPeriod = 1.001 / 60.0;
+
+    fprintf(stderr, "camera: Synthetic video stream started\n");
+
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    double deadline = tv.tv_sec + 1e-6 * tv.tv_usec;
+
+    while (true) {
+        updateMotion();
+        sendField(nextField);
+        nextField = (nextField + 1) % kFields;
+
+        // Real-time pacing, same as the file device
+        deadline += fieldPeriod;
+        gettimeofday(&tv, 0);
+        double now = tv.tv_sec + 1e-6 * tv.tv_usec;
+        if (deadline > now) {
+            usleep((deadline - now) * 1e6);
+        } else {
+            deadline = now;
+        }
+    }
+}
+
+namespace Camera {
+    Device* newSyntheticDevice() {
+        return new SyntheticDevice();
+    }
+}
@@ -0,0 +1,296 @@
+/*
+ * Compiles JSON configuration into typed parameter blocks.
+ *
+ * Instead of looking up "config[...]" by name while running, an effect can
+ * resolve all of its parameters once, at load time, into a plain struct.
+ * Random variables become Sampler::Variable values, which sample without
+ * touching any JSON.
+ *
+ * While compiling, missing keys and values of the wrong type are reported as
+ * errors, and keys that were never looked up (usually misspellings) are reported
+ * as warnings. Everything goes to stderr with the full path of the key, so
+ * problems show up at startup instead of quietly reading as zero.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <set>
+#include <string>
+#include "rapidjson/document.h"
+#include "sampler.h"
+
+
+class ConfigCompiler {
+public:
+    typedef rapidjson::Value Value;
+
+    // Compile members of the JSON object 'object', named 'path' in messages
+    ConfigCompiler(const Value &object, const std::string &path);
+
+    // Required values
+    double number(const char *key);
+    unsigned uint(const char *key);
+    int integer(const char *key);
+    bool boolean(const char *key);
+    std::string string(const char *key);
+    Sampler::Variable variable(const char *key);
+    Sampler::Variable2D variable2D(const char *key);
+    Sampler::Variable3D variable3D(const char *key);
+
+    // Optional values, with a default
+    double number(const char *key, double defaultValue);
+    unsigned uint(const char *key, unsigned defaultValue);
+    bool boolean(const char *key, bool defaultValue);
+
+    // Nested object. Its keys are tracked separately; call finish() on it too.
+    ConfigCompiler object(const char *key);
+
+    // Any value at all, for keys that are handled some other way
+    const Value& value(const char *key);
+
+    // Warn about keys that were never looked up. Returns true if no errors were found.
+    bool finish();
+
+    // Total errors reported by all compilers so far
+    static unsigned &totalErrors();
+
+private:
+    const Value &root;
+    std::string path;
+    std::set<std::string> used;
+    unsigned errors;
+
+    const Value* find(const char *key, bool required);
+    void error(const char *key, const char *message);
+    bool compileVariable(const Value &v, Sampler::Variable &result);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline ConfigCompiler::ConfigCompiler(const Value &object, const std::string &path)
+    : root(object), path(path), errors(0)
+{
+    if (!root.IsObject()) {
+        fprintf(stderr, "config: %s is missing, or not an object\n", path.c_str());
+        errors++;
+        totalErrors()++;
+    }
+}
+
+inline unsigned &ConfigCompiler::totalErrors()
+{
+    static unsigned count = 0;
+    return count;
+}
+
+inline void ConfigCompiler::error(const char *key, const char *message)
+{
+    fprintf(stderr, "config: %s.%s %s\n", path.c_str(), key, message);
+    errors++;
+    totalErrors()++;
+}
+
+inline const ConfigCompiler::Value* ConfigCompiler::find(const char *key, bool required)
+{
+    used.insert(key);
+
+    if (root.IsObject() && root.HasMember(key)) {
+        return &root[key];
+    }
+
+    if (required && root.IsObject()) {
+        error(key, "is missing");
+    }
+    return 0;
+}
+
+inline double ConfigCompiler::number(const char *key)
+{
+    const Value *v = find(key, true);
+    if (v && !v->IsNumber()) {
+        error(key, "is not a number");
+        return 0;
+    }
+    return v ? v->GetDouble() : 0;
+}
+
+inline double ConfigCompiler::number(const char *key, double defaultValue)
+{
+    const Value *v = find(key, false);
+    if (v && !v->IsNumber()) {
+        error(key, "is not a number");
+        return defaultValue;
+    }
+    return v ? v->GetDouble() : defaultValue;
+}
+
+inline unsigned ConfigCompiler::uint(const char *key)
+{
+    const Value *v = find(key, true);
+    if (v && !v->IsUint()) {
+        error(key, "is not an unsigned integer");
+        return 0;
+    }
+    return v ? v->GetUint() : 0;
+}
+
+inline unsigned ConfigCompiler::uint(const char *key, unsigned defaultValue)
+{
+    const Value *v = find(key, false);
+    if (v && !v->IsUint()) {
+        error(key, "is not an unsigned integer");
+        return defaultValue;
+    }
+    return v ? v->GetUint() : defaultValue;
+}
+
+inline int ConfigCompiler::integer(const char *key)
+{
+    const Value *v = find(key, true);
+    if (v && !v->IsInt()) {
+        error(key, "is not an integer");
+        return 0;
+    }
+    return v ? v->GetInt() : 0;
+}
+
+inline bool ConfigCompiler::boolean(const char *key)
+{
+    const Value *v = find(key, true);
+    if (v && !v->IsBool()) {
+        error(key, "is not true or false");
+        return false;
+    }
+    return v ? v->GetBool() : false;
+}
+
+inline bool ConfigCompiler::boolean(const char *key, bool defaultValue)
+{
+    const Value *v = find(key, false);
+    if (v && !v->IsBool()) {
+        error(key, "is not true or false");
+        return defaultValue;
+    }
+    return v ? v->GetBool() : defaultValue;
+}
+
+inline std::string ConfigCompiler::string(const char *key)
+{
+    const Value *v = find(key, true);
+    if (v && !v->IsString()) {
+        error(key, "is not a string");
+        return "";
+    }
+    return v ? v->GetString() : "";
+}
+
+inline bool ConfigCompiler::compileVariable(const Value &v, Sampler::Variable &result)
+{
+    // Same rules as Sampler::value(), minus the silent zero for anything unknown
+
+    if (v.IsNumber()) {
+        result = Sampler::Variable::constant(v.GetDouble());
+        return true;
+    }
+
+    if (v.IsArray() && v.Size() == 2 && v[0u].IsNumber() && v[1].IsNumber()) {
+        result = Sampler::Variable::uniform(v[0u].GetDouble(), v[1].GetDouble());
+        return true;
+    }
+
+    result = Sampler::Variable::constant(0);
+    return false;
+}
+
+inline Sampler::Variable ConfigCompiler::variable(const char *key)
+{
+    Sampler::Variable result = Sampler::Variable::constant(0);
+    const Value *v = find(key, true);
+    if (v && !compileVariable(*v, result)) {
+        error(key, "is not a number or [min, max] range");
+    }
+    return result;
+}
+
+inline Sampler::Variable2D ConfigCompiler::variable2D(const char *key)
+{
+    Sampler::Variable2D result;
+    result.x = result.y = Sampler::Variable::constant(0);
+
+    const Value *v = find(key, true);
+    if (v && !(v->IsArray() && v->Size() == 2 &&
+        compileVariable((*v)[0u], result.x) &&
+        compileVariable((*v)[1], result.y))) {
+        error(key, "is not a 2-vector of numbers or ranges");
+    }
+    return result;
+}
+
+inline Sampler::Variable3D ConfigCompiler::variable3D(const char *key)
+{
+    Sampler::Variable3D result;
+    result.x = result.y = result.z = Sampler::Variable::constant(0);
+
+    const Value *v = find(key, true);
+    if (v && !(v->IsArray() && v->Size() == 3 &&
+        compileVariable((*v)[0u], result.x) &&
+        compileVariable((*v)[1], result.y) &&
+        compileVariable((*v)[2], result.z))) {
+        error(key, "is not a 3-vector of numbers or ranges");
+    }
+    return result;
+}
+
+inline ConfigCompiler ConfigCompiler::object(const char *key)
+{
+    static const Value null;
+    const Value *v = find(key, true);
+    return ConfigCompiler(v ? *v : null, path + "." + key);
+}
+
+inline const ConfigCompiler::Value& ConfigCompiler::value(const char *key)
+{
+    static const Value null;
+    const Value *v = find(key, false);
+    return v ? *v : null;
+}
+
+inline bool ConfigCompiler::finish()
+{
+    if (root.IsObject()) {
+        for (Value::ConstMemberIterator i = root.MemberBegin(), e = root.MemberEnd(); i != e; ++i) {
+            if (!used.count(i->name.GetString())) {
+                fprintf(stderr, "config: warning, %s.%s is not used\n", path.c_str(), i->name.GetString());
+            }
+        }
+    }
+    return errors == 0;
+}
@@ -28,12 +28,15 @@
 #pragma once
 
 #include <math.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <algorithm>
 #include <vector>
 #include <string.h>
 #include <stdlib.h>
 
 #include "nanoflann.h"  // Tiny KD-tree library
+#include "layout_topology.h"
 #include "svl/SVL.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
@@ -73,6 +76,13 @@ public:
     virtual void beginFrame(const FrameInfo& f);
     virtual void endFrame(const FrameInfo& f);
 
+    /*
+     * Optional hint, checked after beginFrame(). If every pixel will be the same
+     * color this frame, set 'rgb' to that color and return true. Callers may then
+     * skip shader() and postProcess() entirely for this frame.
+     */
+    virtual bool isUniform(Vec3& rgb) const;
+
     // Optional callback, invoked once per second when verbose mode is enabled.
     // This can print parameters out to the console.
     virtual void debug(const DebugInfo& d);
@@ -81,14 +91,18 @@ public:
     // Information about one LED pixel
     class PixelInfo {
     public:
-        PixelInfo(unsigned index, const rapidjson::Value* layout);
+        PixelInfo(unsigned index, unsigned wireIndex, const rapidjson::Value* layout);
 
         // Point coordinates
         Vec3 point;
 
-        // Index in the framebuffer
+        // Index in per-pixel buffers, in shading order. Same as position in FrameInfo::pixels.
+        // That's wire order, unless FrameInfo was set up with Z-order shading.
         unsigned index;
 
+        // Index in the layout file and on the wire, for the OPC framebuffer
+        unsigned wireIndex;
+
         // Parsed JSON for this pixel's layout
         const rapidjson::Value* layout;
 
@@ -110,12 +124,13 @@ public:
     class FrameInfo {
     public:
         FrameInfo();
-        void init(const rapidjson::Value &layout);
+        void init(const rapidjson::Value &layout, bool zOrder = false);
+        void init(const rapidjson::Value &layout, const LayoutTopology &topology, bool zOrder = false);
 
         // Seconds passed since the last frame
         float timeDelta;
 
-        // Info for every pixel
+        // Info for every pixel, in shading order
         PixelInfoVec pixels;
 
         // Model axis-aligned bounding box
@@ -129,6 +144,10 @@ public:
         Vec3 modelSize() const;
         Real distanceOutsideBoundingBox(Vec3 p) const;
 
+        // Blocks, grid, adjacency, and dimensionality, derived once from the layout.
+        // Renumbered so its pixel indices match PixelInfo::index.
+        LayoutTopology topology;
+
         // K-D Tree, for fast spatial lookups
 
         typedef nanoflann::KDTreeSingleIndexAdaptor<
@@ -143,6 +162,10 @@ public:
 
         // Adapter functions for the K-D tree implementation
 
+    private:
+        static uint32_t mortonCode(Vec3 unit);
+
+    public:
         inline size_t kdtree_get_point_count() const {
             return pixels.size();
         }
@@ -184,8 +207,8 @@ public:
  *****************************************************************************************/
 
 
-inline Effect::PixelInfo::PixelInfo(unsigned index, const rapidjson::Value* layout)
-    : index(index), layout(layout)
+inline Effect::PixelInfo::PixelInfo(unsigned index, unsigned wireIndex, const rapidjson::Value* layout)
+    : index(index), wireIndex(wireIndex), layout(layout)
 {
     point = isMapped() ? getVec3("point") : Vec3(0, 0, 0);
 }
@@ -235,28 +258,65 @@ inline Effect::FrameInfo::FrameInfo()
     : timeDelta(0), tree(3, *this)
 {}
 
-inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
+inline void Effect::FrameInfo::init(const rapidjson::Value &layout, bool zOrder)
+{
+    LayoutTopology t;
+    t.build(layout);
+    init(layout, t, zOrder);
+}
+
+inline void Effect::FrameInfo::init(const rapidjson::Value &layout, const LayoutTopology &topology, bool zOrder)
 {
     timeDelta = 0;
     pixels.clear();
 
-    // Create PixelInfo instances
+    // Calculate min/max, in wire order
 
+    std::vector<PixelInfo> wire;
     for (unsigned i = 0; i < layout.Size(); i++) {
-        PixelInfo p(i, &layout[i]);
-        pixels.push_back(p);
+        wire.push_back(PixelInfo(i, i, &layout[i]));
     }
 
-    // Calculate min/max
-
-    modelMin = modelMax = pixels[0].point;
-    for (unsigned i = 1; i < pixels.size(); i++) {
+    modelMin = modelMax = wire[0].point;
+    for (unsigned i = 1; i < wire.size(); i++) {
         for (unsigned j = 0; j < 3; j++) {
-            modelMin[j] = std::min(modelMin[j], pixels[i].point[j]);
-            modelMax[j] = std::max(modelMax[j], pixels[i].point[j]);
+            modelMin[j] = std::min(modelMin[j], wire[i].point[j]);
+            modelMax[j] = std::max(modelMax[j], wire[i].point[j]);
         }
     }
 
+    // The wire order follows LED strings, which can wander all over the model.
+    // Optionally shade along a Z-order curve instead, so consecutive pixels (and
+    // each mixer task's batch of them) share K-D tree leaves and effect state.
+    // Unmapped pixels go last. The runner puts pixels back in wire order
+    // as it writes the framebuffer.
+
+    std::vector<std::pair<uint64_t, unsigned> > order;
+    for (unsigned i = 0; i < wire.size(); i++) {
+        order.push_back(std::make_pair(uint64_t(i), i));
+    }
+
+    if (zOrder) {
+        Real extent = std::max(modelSize()[0], std::max(modelSize()[1], modelSize()[2]));
+        Real scale = extent > 0 ? 1.0 / extent : 0.0;
+
+        for (unsigned i = 0; i < wire.size(); i++) {
+            order[i].first = wire[i].isMapped() ? mortonCode((wire[i].point - modelMin) * scale) : ~uint64_t(0);
+        }
+        std::sort(order.begin(), order.end());
+    }
+
+    std::vector<unsigned> shadingIndex(wire.size());
+    for (unsigned i = 0; i < order.size(); i++) {
+        PixelInfo p = wire[order[i].second];
+        p.index = i;
+        pixels.push_back(p);
+        shadingIndex[p.wireIndex] = i;
+    }
+
+    this->topology = topology;
+    this->topology.renumber(shadingIndex);
+
     // Calculate radius
 
     modelRadius = 0;
@@ -269,6 +329,25 @@ inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
     tree.buildIndex();
 }
 
+inline uint32_t Effect::FrameInfo::mortonCode(Vec3 unit)
+{
+    // Interleave 10 bits per axis, from coordinates in [0, 1]
+
+    uint32_t code = 0;
+    for (unsigned j = 0; j < 3; j++) {
+        uint32_t v = std::min(1023, std::max(0, int(unit[j] * 1023.0f + 0.5f)));
+
+        // Spread bits out to every third position
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+
+        code |= v << j;
+    }
+    return code;
+}
+
 inline Vec3 Effect::FrameInfo::modelCenter() const
 {
     return (modelMin + modelMax) * 0.5;
@@ -306,6 +385,7 @@ inline void Effect::beginFrame(const FrameInfo &f) {}
 inline void Effect::endFrame(const FrameInfo &f) {}
 inline void Effect::debug(const DebugInfo &f) {}
 inline void Effect::postProcess(const Vec3& rgb, const PixelInfo& p) {}
+inline bool Effect::isUniform(Vec3& rgb) const { return false; }
 
 
 static inline float sq(float a)
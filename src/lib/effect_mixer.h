@@ -8,6 +8,10 @@
  * we keep a separate RGB buffer for each effect. This allows single
  * effects or multiple effects to be sliced over multiple CPU cores.
  *
+ * Channels on their way out can optionally be degraded to save time
+ * during long crossfades: as a channel's fader drops, it's first rendered
+ * at a lower frame rate and held in between, then frozen entirely.
+ *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
  * Permission is hereby granted, free of charge, to any person
@@ -60,17 +64,36 @@ public:
     // Set number of threads. By default, we auto-detect
     void setConcurrency(unsigned numThreads);
 
+    // Cheaper rendering for channels whose fader is decreasing. Below 'holdFader'
+    // they render at only 'holdRate' frames per second, holding the last frame in
+    // between. Below 'freezeFader' the effect stops running, and its last frame
+    // is shown until it's removed. Both thresholds default to zero (disabled).
+    void setDegrade(float holdFader, float holdRate, float freezeFader);
+
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
     virtual void postProcess(const Vec3& rgb, const PixelInfo& p);
     virtual void beginFrame(const FrameInfo& f);
     virtual void endFrame(const FrameInfo& f);
     virtual void debug(const DebugInfo& d);
+    virtual bool isUniform(Vec3& rgb) const;
 
 private:
     struct Channel {
         Effect *effect;
         float fader;
         std::vector<Vec3> colors;
+
+        // Degraded rendering state
+        float lastFader;
+        float holdTimer;
+        bool fading;        // Fader is on its way down
+        bool hasFrame;      // 'colors' holds a complete frame
+        bool running;       // Effect is being run this frame
+        bool rendering;     // Pixels are being shaded this frame
+
+        // Effect's output is one color this frame, already filled into 'colors'
+        bool uniform;
+        Vec3 uniformColor;
     };
 
     struct Task {
@@ -89,6 +112,10 @@ private:
     // Channels only to be modified when threads are idle
     std::vector<Channel> channels;
 
+    float holdFader;
+    float holdRate;
+    float freezeFader;
+
     // Running threads
     std::vector<ThreadContext*> threads;
     unsigned numThreadsConfigured;
@@ -106,6 +133,7 @@ private:
     unsigned pendingTasks;
 
     void changeNumberOfThreads(unsigned count);
+    void updateDegrade(Channel &c, const FrameInfo& f);
     static void threadFunc(void *context);
     void worker(ThreadContext &context);
 };
@@ -117,7 +145,8 @@ private:
 
 
 inline EffectMixer::EffectMixer()
-    : numThreadsConfigured(0)   // Auto-detect
+    : holdFader(0), holdRate(0), freezeFader(0),
+      numThreadsConfigured(0)   // Auto-detect
 {}
 
 inline EffectMixer::~EffectMixer()
@@ -131,6 +160,13 @@ inline void EffectMixer::setConcurrency(unsigned numThreads)
     numThreadsConfigured = numThreads;
 }
 
+inline void EffectMixer::setDegrade(float holdFader, float holdRate, float freezeFader)
+{
+    this->holdFader = holdFader;
+    this->holdRate = holdRate;
+    this->freezeFader = freezeFader;
+}
+
 inline int EffectMixer::numChannels()
 {
     return channels.size();
@@ -142,6 +178,13 @@ inline int EffectMixer::add(Effect *effect, float fader)
 
     c.effect = effect;
     c.fader = fader;
+    c.lastFader = fader;
+    c.holdTimer = 0;
+    c.fading = false;
+    c.hasFrame = false;
+    c.running = true;
+    c.rendering = true;
+    c.uniform = false;
 
     int index = channels.size();
     channels.push_back(c);
@@ -217,7 +260,7 @@ inline void EffectMixer::postProcess(const Vec3& rgb, const PixelInfo& p)
     for (std::vector<Channel>::iterator i = channels.begin(), e = channels.end(); i != e; ++i) {
         Channel &c = *i;
         float f = c.fader;
-        if (f) {
+        if (f && c.running && !c.uniform) {
             c.effect->postProcess(c.colors[p.index], p);
         }
     }
@@ -226,7 +269,9 @@ inline void EffectMixer::postProcess(const Vec3& rgb, const PixelInfo& p)
 inline void EffectMixer::endFrame(const FrameInfo& f)
 {
     for (unsigned i = 0; i < channels.size(); ++i) {
-        channels[i].effect->endFrame(f);
+        if (channels[i].running) {
+            channels[i].effect->endFrame(f);
+        }
     }
 }
 
@@ -237,9 +282,27 @@ inline void EffectMixer::debug(const DebugInfo& d)
     }
 }
 
+inline bool EffectMixer::isUniform(Vec3& rgb) const
+{
+    // Uniform if every audible channel is
+    Vec3 total(0,0,0);
+
+    for (std::vector<Channel>::const_iterator i = channels.begin(), e = channels.end(); i != e; ++i) {
+        if (i->fader) {
+            if (!i->uniform) {
+                return false;
+            }
+            total += i->uniformColor * i->fader;
+        }
+    }
+
+    rgb = total;
+    return true;
+}
+
 inline void EffectMixer::changeNumberOfThreads(unsigned count)
 {
-    while (threads.size() < numThreadsConfigured) {
+    while (threads.size() < count) {
         // Create thread
         ThreadContext *tc = new ThreadContext;
         tc->mixer = this;
@@ -248,13 +311,15 @@ inline void EffectMixer::changeNumberOfThreads(unsigned count)
         threads.push_back(tc);
     }
 
-    while (threads.size() > numThreadsConfigured) {
+    while (threads.size() > count) {
         // Signal a thread to stop
         ThreadContext *tc = threads.back();
         threads.pop_back();
 
+        taskLock.lock();
         tc->runFlag = false;
         taskCond.notify_all();
+        taskLock.unlock();
 
         tc->thread->join();
         delete tc->thread;
@@ -274,6 +339,7 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
 
     /*
      * Setup for each effect:
+     *   - Decide whether it runs and renders at all this frame
      *   - Send a beginFrame() message
      *   - Keep track of the total pixel count, for sizing our batches
      *   - Size our channel's color buffer
@@ -285,9 +351,29 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
     for (unsigned i = 0; i < channels.size(); ++i) {
         Channel &c = channels[i];
 
-        c.effect->beginFrame(f);
+        updateDegrade(c, f);
+        if (c.running) {
+            c.effect->beginFrame(f);
+        }
+
+        // Uniform output skips the thread pool. Only refill our buffer if the color
+        // changes. A frozen channel stays uniform if its last frame was.
+        if (c.running) {
+            Vec3 color;
+            bool wasUniform = c.uniform && c.colors.size() == modelPixels;
+            c.uniform = c.effect->isUniform(color);
+            if (c.uniform && !(wasUniform && color == c.uniformColor)) {
+                c.colors.assign(modelPixels, color);
+            }
+            if (c.uniform) {
+                c.uniformColor = color;
+                c.rendering = false;
+                c.hasFrame = true;
+            }
+        }
+
         c.colors.resize(modelPixels);
-        if (c.fader) {
+        if (c.fader && c.rendering) {
             totalPixels += modelPixels;
         }
     }
@@ -305,7 +391,8 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
 
     for (unsigned i = 0; i < channels.size(); ++i) {
         Channel &c = channels[i];
-        if (c.fader) {
+        if (c.fader && c.rendering) {
+            c.hasFrame = true;
             Task t;
             t.channel = &c;
             t.pixelInfo = &f.pixels[0];
@@ -332,6 +419,37 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
     completeLock.unlock();
 }
 
+inline void EffectMixer::updateDegrade(Channel &c, const FrameInfo& f)
+{
+    // A channel is outgoing once its fader starts dropping, and stays that way
+    // until the fader rises again. Until then, run it normally.
+
+    c.fading = c.fader < c.lastFader || (c.fading && c.fader == c.lastFader);
+    c.lastFader = c.fader;
+    c.running = true;
+    c.rendering = true;
+
+    if (!c.fading || !c.hasFrame || c.colors.size() != f.pixels.size()) {
+        c.holdTimer = 0;
+        return;
+    }
+
+    if (c.fader < freezeFader) {
+        // Frozen on its last frame
+        c.running = false;
+        c.rendering = false;
+
+    } else if (c.fader < holdFader && holdRate > 0) {
+        // Keep the effect's simulation running, but only shade occasionally
+        c.holdTimer += f.timeDelta;
+        if (c.holdTimer < 1.0f / holdRate) {
+            c.rendering = false;
+        } else {
+            c.holdTimer = 0;
+        }
+    }
+}
+
 inline void EffectMixer::threadFunc(void *context)
 {
     ThreadContext* c = (ThreadContext*) context;
@@ -348,6 +466,7 @@ inline void EffectMixer::worker(ThreadContext &context)
         while (tasks.empty()) {
             if (!context.runFlag) {
                 // Thread exiting
+                taskLock.unlock();
                 return;
             }
             taskCond.wait(taskLock);
@@ -39,6 +39,7 @@
 
 #include "effect.h"
 #include "opc_client.h"
+#include "output_quantizer.h"
 #include "svl/SVL.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/filestream.h"
@@ -55,13 +56,41 @@ public:
     void setMaxFrameRate(float fps);
     void setVerbose(bool verbose = true);
 
+    // While the effect's output is uniform and unchanging, run at this lower
+    // frame rate instead. Zero disables idling.
+    void setIdleFrameRate(float fps);
+
+    // Change the frame rate we aim for while running, up to the max frame rate.
+    // The change shows up on the very next frame, instead of waiting for the
+    // delay feedback loop to settle.
+    void setTargetFrameRate(float fps);
+
+    // Headless mode renders every frame without an OPC connection, and never
+    // sleeps to limit the frame rate. For running on simulated time.
+    void setHeadless(bool headless = true);
+
+    // Shade pixels in Z-order rather than wire order. Only worth it for large
+    // layouts, or clouds whose wire order isn't spatial. Off by default.
+    void setZOrder(bool enable = true);
+    bool getZOrder() const;
+
+    // Host-side output correction, for LED servers that don't do their own.
+    // Off by default: linear output, rounded to nearest.
+    void setOutputGamma(float gamma);
+    void setOutputDither(bool enable = true);
+
     bool hasLayout() const;
     const rapidjson::Document& getLayout() const;
+
+    // Topology numbered by wire index, as compiled.
+    // For a matching FrameInfo, use init(getLayout(), getTopology(), getZOrder()).
+    const LayoutTopology& getTopology() const;
     Effect* getEffect() const;
     bool isVerbose() const;
     OPCClient& getClient();
 
-    // Access to most recent framebuffer information
+    // Access to most recent framebuffer information. Pixels are in shading
+    // order; getPixel() and getPixelColor() take a wire index.
     const Effect::PixelInfoVec& getPixelInfo() const;
     const uint8_t* getPixel(unsigned index) const;
     void getPixelColor(unsigned index, Vec3 &rgb) const;
@@ -76,6 +105,12 @@ public:
     struct FrameStatus {
         float timeDelta;
         bool debugOutput;
+
+        // Wall-clock seconds spent rendering this frame, not counting sleep
+        float busyTime;
+
+        // Output was uniform and unchanged since the last frame
+        bool idle;
     };
 
     // Main loop body
@@ -98,22 +133,38 @@ protected:
 private:
     OPCClient opc;
     rapidjson::Document layout;
+    LayoutTopology topology;
     Effect *effect;
     std::vector<uint8_t> frameBuffer;
     Effect::FrameInfo frameInfo;
 
     float minTimeDelta;
+    float targetTimeDelta;
+    float idleTimeDelta;
     float currentDelay;
+    float filteredSleep;
     float filteredTimeDelta;
     float debugTimer;
     float speed;
     bool verbose;
+    bool headless;
+    bool zOrder;
     struct timeval lastTime;
     float jitterStatsMin;
     float jitterStatsMax;
 
+    // Color of the whole framebuffer, if it was last filled with a uniform color
+    bool framebufferUniform;
+    uint8_t framebufferColor[3];
+
+    // Shaded colors in shading order, and their bytes before going back to wire order
+    std::vector<float> shadedColors;
+    std::vector<uint8_t> quantizedColors;
+    OutputQuantizer quantizer;
+
     void usage(const char *name);
     void debug();
+    bool fillUniform(const Vec3& rgb);
 };
 
 
@@ -125,25 +176,47 @@ private:
 inline EffectRunner::EffectRunner()
     : effect(0),
       minTimeDelta(0),
+      targetTimeDelta(0),
+      idleTimeDelta(0),
       currentDelay(0),
+      filteredSleep(0),
       filteredTimeDelta(0),
       debugTimer(0),
       speed(1.0),
       verbose(false),
+      headless(false),
+      zOrder(false),
       jitterStatsMin(1),
-      jitterStatsMax(0)
+      jitterStatsMax(0),
+      framebufferUniform(false)
 {
     lastTime.tv_sec = 0;
     lastTime.tv_usec = 0;
 
     // Defaults
     setMaxFrameRate(300);
+    setIdleFrameRate(10);
     setServer("localhost");
 }
 
 inline void EffectRunner::setMaxFrameRate(float fps)
 {
-    minTimeDelta = 1.0 / fps;
+    minTimeDelta = targetTimeDelta = 1.0 / fps;
+}
+
+inline void EffectRunner::setTargetFrameRate(float fps)
+{
+    float delta = std::max(minTimeDelta, 1.0f / fps);
+
+    // Shift the delay by the same amount, since our busy time hasn't changed.
+    // A negative delay only means we were already running flat out.
+    currentDelay = std::max(0.0f, currentDelay) + delta - targetTimeDelta;
+    targetTimeDelta = delta;
+}
+
+inline void EffectRunner::setIdleFrameRate(float fps)
+{
+    idleTimeDelta = fps > 0 ? 1.0 / fps : 0;
 }
 
 inline void EffectRunner::setVerbose(bool verbose)
@@ -151,6 +224,36 @@ inline void EffectRunner::setVerbose(bool verbose)
     this->verbose = verbose;
 }
 
+inline void EffectRunner::setHeadless(bool headless)
+{
+    this->headless = headless;
+}
+
+inline void EffectRunner::setZOrder(bool enable)
+{
+    zOrder = enable;
+    if (hasLayout()) {
+        frameInfo.init(layout, topology, zOrder);
+    }
+}
+
+inline bool EffectRunner::getZOrder() const
+{
+    return zOrder;
+}
+
+inline void EffectRunner::setOutputGamma(float gamma)
+{
+    quantizer.setGamma(gamma);
+    framebufferUniform = false;
+}
+
+inline void EffectRunner::setOutputDither(bool enable)
+{
+    quantizer.setDither(enable);
+    framebufferUniform = false;
+}
+
 inline bool EffectRunner::setServer(const char *hostport)
 {
     return opc.resolve(hostport);
@@ -178,9 +281,15 @@ inline bool EffectRunner::setLayout(const char *filename)
     int frameBytes = layout.Size() * 3;
     frameBuffer.resize(sizeof(OPCClient::Header) + frameBytes);
     OPCClient::Header::view(frameBuffer).init(0, opc.SET_PIXEL_COLORS, frameBytes);
+    framebufferUniform = false;
+    shadedColors.resize(frameBytes);
+    quantizedColors.resize(frameBytes);
 
-    // Init pixel info
-    frameInfo.init(layout);
+    // Init pixel info, using precompiled topology if we have it
+    if (!topology.load(LayoutTopology::filenameFor(filename).c_str(), layout)) {
+        topology.build(layout);
+    }
+    frameInfo.init(layout, topology, zOrder);
 
     return true;
 }
@@ -190,6 +299,11 @@ inline const rapidjson::Document& EffectRunner::getLayout() const
     return layout;
 }
 
+inline const LayoutTopology& EffectRunner::getTopology() const
+{
+    return topology;
+}
+
 inline bool EffectRunner::hasLayout() const
 {
     return layout.IsArray();
@@ -227,7 +341,7 @@ inline float EffectRunner::getBusyTimePerFrame() const
 
 inline float EffectRunner::getIdleTimePerFrame() const
 {
-    return std::max(0.0f, currentDelay);
+    return filteredSleep;
 }
 
 inline float EffectRunner::getPercentBusy() const
@@ -264,9 +378,13 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
 {
     FrameStatus frameStatus;
 
+    struct timeval busyStart, busyEnd;
+    gettimeofday(&busyStart, 0);
+
     // Effects may get a modified view of time
     frameStatus.timeDelta = frameInfo.timeDelta = timeDelta * speed;
     frameStatus.debugOutput = false;
+    frameStatus.idle = false;
 
     jitterStatsMin = std::min(jitterStatsMin, frameStatus.timeDelta);
     jitterStatsMax = std::max(jitterStatsMax, frameStatus.timeDelta);
@@ -275,30 +393,60 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
         effect->beginFrame(frameInfo);
 
         // Only calculate the effect if we have a connection
-        if (opc.tryConnect()) {
+        if (headless || opc.tryConnect()) {
+
+            uint8_t *frame = OPCClient::Header::view(frameBuffer).data();
+            Vec3 uniform;
+
+            if (effect->isUniform(uniform)) {
+                // No shading needed; and if nothing changed, we can take it easy.
+                frameStatus.idle = fillUniform(uniform) && idleTimeDelta > 0;
 
-            uint8_t *dest = OPCClient::Header::view(frameBuffer).data();
+            } else {
+                framebufferUniform = false;
 
-            for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
-                Vec3 rgb(0, 0, 0);
-                const Effect::PixelInfo &p = *i;
+                // Shade everything first, then quantize in one pass
+                float *shaded = &shadedColors[0];
+                for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
+                    Vec3 rgb(0, 0, 0);
+                    const Effect::PixelInfo &p = *i;
 
-                if (p.isMapped()) {
-                    effect->shader(rgb, p);
-                    effect->postProcess(rgb, p);
+                    if (p.isMapped()) {
+                        effect->shader(rgb, p);
+                        effect->postProcess(rgb, p);
+                    }
+
+                    for (unsigned i = 0; i < 3; i++) {
+                        *(shaded++) = rgb[i];
+                    }
                 }
 
-                for (unsigned i = 0; i < 3; i++) {
-                    *(dest++) = std::min<int>(255, std::max<int>(0, rgb[i] * 255 + 0.5));
+                quantizer.nextFrame();
+                quantizer.quantize(&shadedColors[0], &quantizedColors[0], quantizedColors.size());
+
+                // Back to wire order
+                const uint8_t *src = &quantizedColors[0];
+                for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
+                    uint8_t *dest = frame + i->wireIndex * 3;
+                    dest[0] = src[0];
+                    dest[1] = src[1];
+                    dest[2] = src[2];
+                    src += 3;
                 }
             }
 
-            opc.write(frameBuffer);
+            if (!headless) {
+                opc.write(frameBuffer);
+            }
         }
 
         effect->endFrame(frameInfo);
     }
 
+    gettimeofday(&busyEnd, 0);
+    frameStatus.busyTime = (busyEnd.tv_sec - busyStart.tv_sec)
+        + 1e-6 * (busyEnd.tv_usec - busyStart.tv_usec);
+
     // Low-pass filter for timeDelta, to estimate our frame rate
     const float filterGain = 0.05;
     filteredTimeDelta += (timeDelta - filteredTimeDelta) * filterGain;
@@ -307,10 +455,26 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
     // This lets us hit the target rate smoothly, without a lot of jitter between frames.
     // If we calculated a new delay value on each frame, we'd easily end up alternating
     // between too-long and too-short frame delays.
-    currentDelay += (minTimeDelta - timeDelta) * filterGain;
+    //
+    // Idle frames are deliberately slow, so they don't count. The delay is left where
+    // it was, ready for when the output starts changing again.
+    if (!frameStatus.idle) {
+        currentDelay += (targetTimeDelta - timeDelta) * filterGain;
+    }
 
-    // Make sure filteredTimeDelta >= currentDelay. (The "busy time" estimate will be >= 0)
-    filteredTimeDelta = std::max(filteredTimeDelta, currentDelay);
+    // How long we'll actually sleep after this frame
+    float sleep = 0;
+    if (headless) {
+        // Never sleep
+    } else if (frameStatus.idle) {
+        sleep = std::max(0.0f, idleTimeDelta - frameStatus.busyTime);
+    } else {
+        sleep = std::max(0.0f, currentDelay);
+    }
+    filteredSleep += (sleep - filteredSleep) * filterGain;
+
+    // Make sure filteredTimeDelta >= filteredSleep. (The "busy time" estimate will be >= 0)
+    filteredTimeDelta = std::max(filteredTimeDelta, filteredSleep);
 
     // Periodically output debug info, if we're in verbose mode
     if (verbose) {
@@ -323,13 +487,38 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
     }
 
     // Add the extra delay, if we have one. This is how we throttle down the frame rate.
-    if (currentDelay > 0) {
-        usleep(currentDelay * 1e6);
+    if (sleep > 0) {
+        usleep(sleep * 1e6);
     }
 
     return frameStatus;
 }
 
+inline bool EffectRunner::fillUniform(const Vec3& rgb)
+{
+    // Fill every mapped pixel with one color. Returns true if the
+    // framebuffer already held exactly this, and nothing was written.
+
+    uint8_t color[3];
+    for (unsigned i = 0; i < 3; i++) {
+        color[i] = quantizer.quantizeUniform(rgb[i]);
+    }
+
+    if (framebufferUniform && !memcmp(color, framebufferColor, sizeof color)) {
+        return true;
+    }
+
+    static const uint8_t black[3] = { 0, 0, 0 };
+    uint8_t *frame = OPCClient::Header::view(frameBuffer).data();
+    for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
+        memcpy(frame + i->wireIndex * 3, i->isMapped() ? color : black, 3);
+    }
+
+    memcpy(framebufferColor, color, sizeof color);
+    framebufferUniform = true;
+    return false;
+}
+
 inline OPCClient& EffectRunner::getClient()
 {
     return opc;
@@ -422,6 +611,26 @@ inline bool EffectRunner::parseArgument(int &i, int &argc, char **argv)
         return true;
     }
 
+    if (!strcmp(argv[i], "-gamma") && (i+1 < argc)) {
+        float gamma = atof(argv[++i]);
+        if (gamma <= 0) {
+            fprintf(stderr, "Invalid gamma\n");
+            return false;
+        }
+        setOutputGamma(gamma);
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-dither")) {
+        setOutputDither();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-zorder")) {
+        setZOrder();
+        return true;
+    }
+
     if (!strcmp(argv[i], "-speed") && (i+1 < argc)) {
         speed = atof(argv[++i]);
         if (speed <= 0) {
@@ -462,5 +671,6 @@ inline bool EffectRunner::validateArguments()
 
 inline void EffectRunner::argumentUsage()
 {
-    fprintf(stderr, "[-v] [-fps LIMIT] [-speed MULTIPLIER] [-layout FILE.json] [-server HOST[:port]]");
+    fprintf(stderr, "[-v] [-fps LIMIT] [-speed MULTIPLIER] [-gamma GAMMA] [-dither] [-zorder] [-layout FILE.json] "
+        "[-server HOST[:port] | udp:HOST[:port] | shm:PATH]");
 }
@@ -1,6 +1,10 @@
 /*
  * LED Effect delay-line unit. Allows you to sample from the recent past.
  *
+ * History is stored compactly, as half-float or 8-bit RGB, in one contiguous
+ * ring. Each frame records the cumulative time it began, so looking up a frame
+ * by age is a binary search.
+ *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
  * Permission is hereby granted, free of charge, to any person
@@ -27,31 +31,59 @@
 
 #pragma once
 
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include <vector>
 #include "effect.h"
 
+#if defined(__F16C__)
+    #include <immintrin.h>
+#endif
+
 
 class EffectTap : public Effect {
 public:
     EffectTap();
     void setEffect(Effect *next);
 
-    struct Frame {
+    // Storage for each color channel in the history
+    enum Format {
+        kHalf,      // 16-bit float, keeps values above 1.0
+        kRGB8,      // 8-bit, clamped to [0, 1]
+    };
+
+    class Frame {
+    public:
         // Beginning of last frame -> beginning of this frame.
-        // If zero, this slot is ununitialized.
         float timeDelta;
 
-        std::vector<Vec3> colors;
+        // Cumulative time this frame began, in seconds
+        double time;
 
+        Vec3 color(unsigned pixel) const;
         Vec3 averageColor(const PixelInfoVec& pixels) const;
+
+    private:
+        friend class EffectTap;
+        const EffectTap *tap;
+        unsigned slot;
     };
 
-    void resizeBuffer(unsigned numFrames);
+    void resizeBuffer(unsigned numFrames, Format format = kHalf);
 
     // Look up the frame that was happening 'age' seconds in the past.
     // If that's beyond the end of our buffer, returns NULL.
     const Frame* get(float age) const;
 
+    // Most recent frame that has been completely rendered, or NULL
+    const Frame* latest() const;
+
+    // Color of one pixel 'age' seconds in the past, interpolated between frames.
+    // Beyond the end of our buffer, returns black.
+    Vec3 sample(float age, unsigned pixel) const;
+
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
     virtual void postProcess(const Vec3& rgb, const PixelInfo& p);
     virtual void beginFrame(const FrameInfo& f);
@@ -60,9 +92,22 @@ public:
 
 private:
     Effect *next;
+    Format format;
     std::vector<Frame> fifo;
+    std::vector<uint8_t> history;   // Pixel data for every slot in 'fifo'
+    unsigned numPixels;
     unsigned fifoCurrent;   // Index of the slot we're currently filling
     unsigned fifoValid;     // Number of slots in 'fifo' that have valid data
+    unsigned fifoComplete;  // Index of the newest slot that has been fully rendered
+
+    unsigned bytesPerChannel() const;
+    unsigned slotAge(unsigned age) const;
+    int find(double time) const;
+    void store(unsigned slot, unsigned pixel, const Vec3& rgb);
+    Vec3 load(unsigned slot, unsigned pixel) const;
+
+    static uint16_t floatToHalf(float f);
+    static float halfToFloat(uint16_t h);
 };
 
 
@@ -72,7 +117,7 @@ private:
 
 
 inline EffectTap::EffectTap()
-    : next (0)
+    : next (0), numPixels(0)
 {
     // Default buffer size, quite large.
     resizeBuffer(512);
@@ -83,11 +128,124 @@ inline void EffectTap::setEffect(Effect *next)
     this->next = next;
 }
 
-inline void EffectTap::resizeBuffer(unsigned numFrames)
+inline void EffectTap::resizeBuffer(unsigned numFrames, Format format)
 {
+    this->format = format;
     fifo.resize(numFrames);
+    for (unsigned i = 0; i < fifo.size(); i++) {
+        fifo[i].tap = this;
+        fifo[i].slot = i;
+        fifo[i].timeDelta = 0;
+        fifo[i].time = 0;
+    }
+
+    history.resize(size_t(numFrames) * numPixels * 3 * bytesPerChannel());
     fifoCurrent = 0;
     fifoValid = 0;
+    fifoComplete = 0;
+}
+
+inline unsigned EffectTap::bytesPerChannel() const
+{
+    return format == kHalf ? 2 : 1;
+}
+
+inline void EffectTap::store(unsigned slot, unsigned pixel, const Vec3& rgb)
+{
+    size_t offset = (size_t(slot) * numPixels + pixel) * 3;
+
+    if (format == kHalf) {
+        uint16_t *p = reinterpret_cast<uint16_t*>(&history[0]) + offset;
+        p[0] = floatToHalf(rgb[0]);
+        p[1] = floatToHalf(rgb[1]);
+        p[2] = floatToHalf(rgb[2]);
+    } else {
+        uint8_t *p = &history[offset];
+        p[0] = std::min(255.0f, std::max(0.0f, rgb[0] * 255.0f + 0.5f));
+        p[1] = std::min(255.0f, std::max(0.0f, rgb[1] * 255.0f + 0.5f));
+        p[2] = std::min(255.0f, std::max(0.0f, rgb[2] * 255.0f + 0.5f));
+    }
+}
+
+inline Vec3 EffectTap::load(unsigned slot, unsigned pixel) const
+{
+    size_t offset = (size_t(slot) * numPixels + pixel) * 3;
+
+    if (format == kHalf) {
+        const uint16_t *p = reinterpret_cast<const uint16_t*>(&history[0]) + offset;
+        return Vec3(halfToFloat(p[0]), halfToFloat(p[1]), halfToFloat(p[2]));
+    } else {
+        const uint8_t *p = &history[offset];
+        const float s = 1.0f / 255.0f;
+        return Vec3(p[0] * s, p[1] * s, p[2] * s);
+    }
+}
+
+inline uint16_t EffectTap::floatToHalf(float f)
+{
+#if defined(__F16C__)
+    return _cvtss_sh(f, 0);
+#else
+    uint32_t x;
+    memcpy(&x, &f, sizeof x);
+
+    uint16_t sign = (x >> 16) & 0x8000;
+    int exponent = int((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = x & 0x7FFFFF;
+
+    if ((x & 0x7FFFFFFF) >= 0x47800000) {
+        // Too large, infinity, or NaN
+        bool nan = (x & 0x7FFFFFFF) > 0x7F800000;
+        return sign | 0x7C00 | (nan ? 0x200 : 0);
+    }
+
+    if (exponent <= 0) {
+        // Denormal, or too small
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        unsigned shift = 14 - exponent;
+        uint16_t h = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1) {
+            h++;
+        }
+        return sign | h;
+    }
+
+    // Rounding may carry into the exponent, which is still correct
+    uint16_t h = (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) {
+        h++;
+    }
+    return sign | h;
+#endif
+}
+
+inline float EffectTap::halfToFloat(uint16_t h)
+{
+#if defined(__F16C__)
+    return _cvtsh_ss(h);
+#else
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t x;
+
+    if (exponent == 0) {
+        // Zero or denormal
+        float f = ldexpf(mantissa, -24);
+        return sign ? -f : f;
+    } else if (exponent == 0x1F) {
+        x = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof f);
+    return f;
+#endif
 }
 
 inline void EffectTap::shader(Vec3& rgb, const PixelInfo& p) const
@@ -98,14 +256,22 @@ inline void EffectTap::shader(Vec3& rgb, const PixelInfo& p) const
 inline void EffectTap::postProcess(const Vec3& rgb, const PixelInfo& p)
 {
     next->postProcess(rgb, p);
-    fifo[fifoCurrent].colors[p.index] = rgb;
+    store(fifoCurrent, p.index, rgb);
 }
 
 inline void EffectTap::beginFrame(const FrameInfo& f)
 {
+    if (f.pixels.size() != numPixels) {
+        // Layout changed; history is meaningless now
+        numPixels = f.pixels.size();
+        resizeBuffer(fifo.size(), format);
+    }
+
+    double previousTime = fifoValid ? fifo[fifoCurrent].time : 0;
+
     unsigned c = (fifoCurrent + 1) % fifo.size();
-    fifo[c].colors.resize(f.pixels.size());
     fifo[c].timeDelta = f.timeDelta;
+    fifo[c].time = previousTime + f.timeDelta;
     fifoCurrent = c;
 
     next->beginFrame(f);
@@ -115,8 +281,9 @@ inline void EffectTap::endFrame(const FrameInfo& f)
 {
     next->endFrame(f);
 
-    // Keep track of the furthest into the FIFO that we've populated
-    fifoValid = std::max(fifoValid, fifoCurrent + 1);
+    // Keep track of how much of the FIFO we've populated
+    fifoValid = std::min<unsigned>(fifo.size(), fifoValid + 1);
+    fifoComplete = fifoCurrent;
 }
 
 inline void EffectTap::debug(const DebugInfo& d)
@@ -124,30 +291,82 @@ inline void EffectTap::debug(const DebugInfo& d)
     next->debug(d);
 }
 
+inline unsigned EffectTap::slotAge(unsigned age) const
+{
+    // Slot holding the frame 'age' frames older than the current one
+    return (fifoCurrent + fifo.size() - age) % fifo.size();
+}
+
+inline int EffectTap::find(double time) const
+{
+    // Binary search for the newest frame that began at or before 'time'.
+    // Returns its age in frames, or -1 if every frame we have is newer.
+
+    if (!fifoValid || fifo[slotAge(fifoValid - 1)].time > time) {
+        return -1;
+    }
+
+    unsigned newest = 0;                // Could be the answer
+    unsigned oldest = fifoValid - 1;    // Known to begin at or before 'time'
+
+    while (newest < oldest) {
+        unsigned mid = (newest + oldest) / 2;
+        if (fifo[slotAge(mid)].time <= time) {
+            oldest = mid;
+        } else {
+            newest = mid + 1;
+        }
+    }
+    return oldest;
+}
+
 inline const EffectTap::Frame* EffectTap::get(float age) const
 {
     // Assume that the current time is exactly the moment when the
     // current frame began. An age of exactly zero would refer
-    // to the current frame. The current frame's own timeDelta is
-    // how long it was between the beginning of the last frame and
-    // the beginning of the current frame. So if 'age' is less than
-    // the current frame's time delta it refers to the previous frame.
+    // to the current frame. Anything older refers to the newest
+    // frame that had already begun at that time.
 
-    unsigned firstIndex = fifoCurrent;
-    unsigned index = firstIndex;
+    if (!fifoValid) {
+        return NULL;
+    }
 
-    do {
+    int frameAge = find(fifo[fifoCurrent].time - std::max(0.0f, age));
+    return frameAge < 0 ? NULL : &fifo[slotAge(frameAge)];
+}
 
-        if (age <= 0) {
-            // Success
-            return &fifo[index];
-        }
+inline const EffectTap::Frame* EffectTap::latest() const
+{
+    return fifoValid ? &fifo[fifoComplete] : NULL;
+}
+
+inline Vec3 EffectTap::sample(float age, unsigned pixel) const
+{
+    // Linear interpolation between the frames on either side of 'age'
 
-        age -= fifo[index].timeDelta;
-        index = (index ? index : fifo.size()) - 1;
+    if (!fifoValid || pixel >= numPixels) {
+        return Vec3(0, 0, 0);
+    }
+
+    double time = fifo[fifoCurrent].time - std::max(0.0f, age);
+    int frameAge = find(time);
+    if (frameAge < 0) {
+        return Vec3(0, 0, 0);
+    }
+
+    const Frame &a = fifo[slotAge(frameAge)];
+    if (frameAge == 0) {
+        return load(a.slot, pixel);
+    }
+
+    const Frame &b = fifo[slotAge(frameAge - 1)];
+    float t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0f;
+    return load(a.slot, pixel) * (1.0f - t) + load(b.slot, pixel) * t;
+}
 
-    } while (index < fifoValid && index != firstIndex && fifo[index].timeDelta != 0.0f);
-    return NULL;
+inline Vec3 EffectTap::Frame::color(unsigned pixel) const
+{
+    return pixel < tap->numPixels ? tap->load(slot, pixel) : Vec3(0, 0, 0);
 }
 
 inline Vec3 EffectTap::Frame::averageColor(const PixelInfoVec& pixels) const
@@ -156,9 +375,9 @@ inline Vec3 EffectTap::Frame::averageColor(const PixelInfoVec& pixels) const
     unsigned total = 0;
 
     for (unsigned i = 0; i < pixels.size(); i++) {
-        if (pixels[i].isMapped() && i < colors.size()) {
+        if (pixels[i].isMapped() && i < tap->numPixels) {
             total++;
-            accumulator += colors[i];
+            accumulator += color(i);
         }
     }
 
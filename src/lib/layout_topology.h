@@ -0,0 +1,557 @@
+/*
+ * Layout topology: structure derived from a pixel layout.
+ *
+ * Effects keep wanting the same facts about the layout: which glass block
+ * each LED belongs to, how big the block grid is, the LEDs in each block,
+ * which blocks and LEDs are next to each other, and whether the model is flat.
+ * Rather than each effect rescanning every pixel's JSON, these are worked out
+ * once and shared through Effect::FrameInfo.
+ *
+ * Building this at startup is fine for small layouts. Large ones can be
+ * compiled ahead of time with the "layout-compiler" tool, which writes a
+ * ".topology.json" file next to the layout. EffectRunner uses that file if
+ * it's present and still matches the layout.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "nanoflann.h"
+#include "svl/SVL.h"
+#include "rapidjson/document.h"
+#include "rapidjson/filestream.h"
+
+
+class LayoutTopology {
+public:
+    static const unsigned kNone = (unsigned)-1;
+
+    // Variable-length lists in compressed sparse row form. List 'i' is
+    // indices[offsets[i]] up to but not including indices[offsets[i+1]].
+    struct Lists {
+        std::vector<unsigned> offsets;
+        std::vector<unsigned> indices;
+
+        unsigned size() const;
+        unsigned count(unsigned i) const;
+        const unsigned* begin(unsigned i) const;
+        const unsigned* end(unsigned i) const;
+    };
+
+    LayoutTopology();
+
+    // Derive everything from a JSON layout
+    void build(const rapidjson::Value &layout);
+
+    // Load precompiled topology. Fails if it was compiled from a different layout.
+    bool load(const rapidjson::Value &topology, const rapidjson::Value &layout);
+    bool load(const char *filename, const rapidjson::Value &layout);
+
+    // Write as JSON, for load()
+    bool save(const char *filename) const;
+
+    // Conventional name for the precompiled topology of a layout file
+    static std::string filenameFor(const char *layoutFilename);
+
+    // Give pixel 'i' the new index 'pixelMap[i]'. Blocks keep their numbers,
+    // and lists keep their order. A renumbered topology no longer matches the
+    // layout file, so it shouldn't be saved.
+    void renumber(const std::vector<unsigned> &pixelMap);
+
+    // Points use the Y (depth) axis. Otherwise the model is flat, in the XZ plane.
+    bool is3D;
+
+    // Size of the glass block grid, from "gridXY". Zero if there's no grid.
+    unsigned gridWidth, gridHeight;
+
+    // Block index (x + y * gridWidth) for each pixel, or kNone
+    std::vector<unsigned> pixelBlock;
+
+    // Pixels in each block, in "blockAngle" order so rings read around the block
+    Lists blockPixels;
+
+    // Blocks directly above, below, left and right of each block, if they exist
+    Lists blockNeighbors;
+
+    // Mapped pixels near each mapped pixel, within 'neighborRadius'
+    Lists pixelNeighbors;
+    float neighborRadius;
+
+    // Block at a grid location, or kNone if it's out of range
+    unsigned blockAt(int x, int y) const;
+
+    // Checksum of the layout inputs we depend on
+    uint32_t checksum;
+    static uint32_t layoutChecksum(const rapidjson::Value &layout);
+
+private:
+    struct Cloud {
+        std::vector<Vec3> points;
+
+        inline size_t kdtree_get_point_count() const {
+            return points.size();
+        }
+
+        inline Real kdtree_distance(const Real *p1, const size_t idx_p2, size_t size) const {
+            return sqrlen(Vec3(p1[0], p1[1], p1[2]) - points[idx_p2]);
+        }
+
+        Real kdtree_get_pt(const size_t idx, int dim) const {
+            return points[idx][dim];
+        }
+
+        template <class BBOX> bool kdtree_get_bbox(BBOX &bb) const {
+            return false;
+        }
+    };
+
+    struct AngleOrder {
+        const std::vector<float> &angles;
+        AngleOrder(const std::vector<float> &angles) : angles(angles) {}
+        bool operator() (unsigned a, unsigned b) const {
+            return angles[a] < angles[b] || (angles[a] == angles[b] && a < b);
+        }
+    };
+
+    static bool isMapped(const rapidjson::Value &pixel);
+    static double arrayNumber(const rapidjson::Value &pixel, const char *attribute, int index);
+
+    void buildGrid(const rapidjson::Value &layout);
+    void buildNeighbors(const rapidjson::Value &layout);
+
+    static bool loadLists(const rapidjson::Value &v, Lists &lists);
+    static void saveLists(FILE *f, const char *name, const Lists &lists);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline unsigned LayoutTopology::Lists::size() const
+{
+    return offsets.empty() ? 0 : offsets.size() - 1;
+}
+
+inline unsigned LayoutTopology::Lists::count(unsigned i) const
+{
+    return offsets[i+1] - offsets[i];
+}
+
+inline const unsigned* LayoutTopology::Lists::begin(unsigned i) const
+{
+    return indices.data() + offsets[i];
+}
+
+inline const unsigned* LayoutTopology::Lists::end(unsigned i) const
+{
+    return indices.data() + offsets[i+1];
+}
+
+inline LayoutTopology::LayoutTopology()
+    : is3D(false), gridWidth(0), gridHeight(0), neighborRadius(0), checksum(0)
+{}
+
+inline bool LayoutTopology::isMapped(const rapidjson::Value &pixel)
+{
+    // Same rule as Effect::PixelInfo
+    return pixel.IsObject();
+}
+
+inline double LayoutTopology::arrayNumber(const rapidjson::Value &pixel, const char *attribute, int index)
+{
+    const rapidjson::Value& a = pixel[attribute];
+    if (a.IsArray() && a[index].IsNumber()) {
+        return a[index].GetDouble();
+    }
+    return 0.0;
+}
+
+inline unsigned LayoutTopology::blockAt(int x, int y) const
+{
+    if (x < 0 || x >= int(gridWidth) || y < 0 || y >= int(gridHeight)) {
+        return kNone;
+    }
+    return x + y * gridWidth;
+}
+
+inline uint32_t LayoutTopology::layoutChecksum(const rapidjson::Value &layout)
+{
+    // FNV-1a over every input that build() looks at
+
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < layout.Size(); i++) {
+        const rapidjson::Value &p = layout[i];
+        float values[7] = { 0 };
+
+        if (isMapped(p)) {
+            values[0] = 1;
+            for (unsigned j = 0; j < 3; j++) {
+                values[1 + j] = arrayNumber(p, "point", j);
+            }
+            values[4] = arrayNumber(p, "gridXY", 0);
+            values[5] = arrayNumber(p, "gridXY", 1);
+            values[6] = p["blockAngle"].IsNumber() ? p["blockAngle"].GetDouble() : 0.0;
+        }
+
+        const uint8_t *bytes = (const uint8_t*) values;
+        for (unsigned j = 0; j < sizeof values; j++) {
+            hash = (hash ^ bytes[j]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+inline void LayoutTopology::build(const rapidjson::Value &layout)
+{
+    checksum = layoutChecksum(layout);
+
+    is3D = false;
+    for (unsigned i = 0; i < layout.Size(); i++) {
+        if (isMapped(layout[i]) && arrayNumber(layout[i], "point", 1) != 0.0) {
+            is3D = true;
+        }
+    }
+
+    buildGrid(layout);
+    buildNeighbors(layout);
+}
+
+inline void LayoutTopology::buildGrid(const rapidjson::Value &layout)
+{
+    unsigned numPixels = layout.Size();
+    gridWidth = gridHeight = 0;
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        const rapidjson::Value &p = layout[i];
+        if (isMapped(p) && p["gridXY"].IsArray()) {
+            gridWidth = std::max<int>(gridWidth, arrayNumber(p, "gridXY", 0) + 1);
+            gridHeight = std::max<int>(gridHeight, arrayNumber(p, "gridXY", 1) + 1);
+        }
+    }
+
+    // Block membership, and a count of pixels in each block
+
+    unsigned numBlocks = gridWidth * gridHeight;
+    std::vector<float> angles(numPixels, 0.0f);
+    pixelBlock.assign(numPixels, unsigned(kNone));
+    blockPixels.offsets.assign(numBlocks + 1, 0);
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        const rapidjson::Value &p = layout[i];
+        if (isMapped(p) && p["gridXY"].IsArray()) {
+            unsigned block = blockAt(arrayNumber(p, "gridXY", 0), arrayNumber(p, "gridXY", 1));
+            if (block != kNone) {
+                pixelBlock[i] = block;
+                blockPixels.offsets[block + 1]++;
+                angles[i] = p["blockAngle"].IsNumber() ? p["blockAngle"].GetDouble() : 0.0;
+            }
+        }
+    }
+
+    // Counts to offsets, then fill each block in pixel order and sort by angle
+
+    for (unsigned b = 0; b < numBlocks; b++) {
+        blockPixels.offsets[b + 1] += blockPixels.offsets[b];
+    }
+
+    std::vector<unsigned> cursor(blockPixels.offsets.begin(), blockPixels.offsets.end() - 1);
+    blockPixels.indices.resize(blockPixels.offsets[numBlocks]);
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        if (pixelBlock[i] != kNone) {
+            blockPixels.indices[cursor[pixelBlock[i]]++] = i;
+        }
+    }
+
+    for (unsigned b = 0; b < numBlocks; b++) {
+        std::sort(blockPixels.indices.begin() + blockPixels.offsets[b],
+            blockPixels.indices.begin() + blockPixels.offsets[b + 1], AngleOrder(angles));
+    }
+
+    // Block adjacency, for blocks that have any pixels
+
+    blockNeighbors.offsets.assign(1, 0);
+    blockNeighbors.indices.clear();
+
+    for (unsigned y = 0; y < gridHeight; y++) {
+        for (unsigned x = 0; x < gridWidth; x++) {
+            static const int dx[] = { 0, -1, 1, 0 };
+            static const int dy[] = { -1, 0, 0, 1 };
+
+            for (unsigned d = 0; d < 4; d++) {
+                unsigned n = blockAt(int(x) + dx[d], int(y) + dy[d]);
+                if (n != kNone && blockPixels.count(n)) {
+                    blockNeighbors.indices.push_back(n);
+                }
+            }
+            blockNeighbors.offsets.push_back(blockNeighbors.indices.size());
+        }
+    }
+}
+
+inline void LayoutTopology::buildNeighbors(const rapidjson::Value &layout)
+{
+    // Neighbors are everything within 1.5x the typical (median) distance
+    // from a pixel to its nearest neighbor. This adapts to the LED spacing
+    // without needing to know anything about the model's units.
+
+    typedef nanoflann::KDTreeSingleIndexAdaptor<
+        nanoflann::L2_Simple_Adaptor< Real, Cloud >, Cloud, 3> Tree;
+
+    unsigned numPixels = layout.Size();
+    Cloud cloud;
+    std::vector<unsigned> cloudToPixel;
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        if (isMapped(layout[i])) {
+            cloud.points.push_back(Vec3(arrayNumber(layout[i], "point", 0),
+                arrayNumber(layout[i], "point", 1), arrayNumber(layout[i], "point", 2)));
+            cloudToPixel.push_back(i);
+        }
+    }
+
+    pixelNeighbors.offsets.assign(1, 0);
+    pixelNeighbors.indices.clear();
+    neighborRadius = 0;
+
+    Tree tree(3, cloud);
+    if (cloud.points.size() >= 2) {
+        tree.buildIndex();
+
+        std::vector<Real> nearest(cloud.points.size());
+        for (unsigned i = 0; i < cloud.points.size(); i++) {
+            size_t hits[2];
+            Real dist2[2];
+            tree.knnSearch(&cloud.points[i][0], 2, hits, dist2);
+            nearest[i] = dist2[1];
+        }
+        std::nth_element(nearest.begin(), nearest.begin() + nearest.size() / 2, nearest.end());
+        neighborRadius = 1.5f * sqrtf(nearest[nearest.size() / 2]);
+    }
+
+    std::vector<std::pair<size_t, Real> > hits;
+    nanoflann::SearchParams params;
+    params.sorted = true;
+    unsigned c = 0;
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        if (neighborRadius > 0 && c < cloudToPixel.size() && cloudToPixel[c] == i) {
+            tree.radiusSearch(&cloud.points[c][0], neighborRadius * neighborRadius, hits, params);
+            for (unsigned h = 0; h < hits.size(); h++) {
+                if (hits[h].first != c) {
+                    pixelNeighbors.indices.push_back(cloudToPixel[hits[h].first]);
+                }
+            }
+            c++;
+        }
+        pixelNeighbors.offsets.push_back(pixelNeighbors.indices.size());
+    }
+}
+
+inline void LayoutTopology::renumber(const std::vector<unsigned> &pixelMap)
+{
+    std::vector<unsigned> oldBlock = pixelBlock;
+    for (unsigned i = 0; i < oldBlock.size(); i++) {
+        pixelBlock[pixelMap[i]] = oldBlock[i];
+    }
+
+    for (unsigned i = 0; i < blockPixels.indices.size(); i++) {
+        blockPixels.indices[i] = pixelMap[blockPixels.indices[i]];
+    }
+
+    // Neighbor lists move to their pixel's new position
+
+    Lists old = pixelNeighbors;
+    unsigned numPixels = old.size();
+    std::vector<unsigned> pixelUnmap(numPixels);
+    for (unsigned i = 0; i < numPixels; i++) {
+        pixelUnmap[pixelMap[i]] = i;
+    }
+
+    pixelNeighbors.offsets.assign(1, 0);
+    pixelNeighbors.indices.clear();
+    for (unsigned i = 0; i < numPixels; i++) {
+        for (const unsigned *n = old.begin(pixelUnmap[i]), *e = old.end(pixelUnmap[i]); n != e; ++n) {
+            pixelNeighbors.indices.push_back(pixelMap[*n]);
+        }
+        pixelNeighbors.offsets.push_back(pixelNeighbors.indices.size());
+    }
+}
+
+inline std::string LayoutTopology::filenameFor(const char *layoutFilename)
+{
+    std::string name = layoutFilename;
+    const std::string suffix = ".json";
+
+    if (name.size() >= suffix.size() && !name.compare(name.size() - suffix.size(), suffix.size(), suffix)) {
+        name.erase(name.size() - suffix.size());
+    }
+    return name + ".topology.json";
+}
+
+inline bool LayoutTopology::loadLists(const rapidjson::Value &v, Lists &lists)
+{
+    const rapidjson::Value &offsets = v["offsets"];
+    const rapidjson::Value &indices = v["indices"];
+    if (!offsets.IsArray() || !indices.IsArray() || offsets.Size() < 1) {
+        return false;
+    }
+
+    lists.offsets.resize(offsets.Size());
+    for (unsigned i = 0; i < offsets.Size(); i++) {
+        if (!offsets[i].IsUint()) {
+            return false;
+        }
+        lists.offsets[i] = offsets[i].GetUint();
+    }
+
+    lists.indices.resize(indices.Size());
+    for (unsigned i = 0; i < indices.Size(); i++) {
+        if (!indices[i].IsUint()) {
+            return false;
+        }
+        lists.indices[i] = indices[i].GetUint();
+    }
+
+    return lists.offsets[0] == 0 && lists.offsets.back() == lists.indices.size();
+}
+
+inline bool LayoutTopology::load(const rapidjson::Value &topology, const rapidjson::Value &layout)
+{
+    if (!topology.IsObject() || !layout.IsArray()) {
+        return false;
+    }
+
+    const rapidjson::Value &sum = topology["checksum"];
+    if (!sum.IsUint() || sum.GetUint() != layoutChecksum(layout)) {
+        // Stale, compiled from some other layout
+        return false;
+    }
+    checksum = sum.GetUint();
+
+    const rapidjson::Value &flat = topology["is3D"];
+    const rapidjson::Value &width = topology["gridWidth"];
+    const rapidjson::Value &height = topology["gridHeight"];
+    const rapidjson::Value &radius = topology["neighborRadius"];
+    const rapidjson::Value &blocks = topology["pixelBlock"];
+
+    if (!flat.IsBool() || !width.IsUint() || !height.IsUint() || !radius.IsNumber() ||
+        !blocks.IsArray() || blocks.Size() != layout.Size()) {
+        return false;
+    }
+
+    is3D = flat.GetBool();
+    gridWidth = width.GetUint();
+    gridHeight = height.GetUint();
+    neighborRadius = radius.GetDouble();
+
+    pixelBlock.resize(blocks.Size());
+    for (unsigned i = 0; i < blocks.Size(); i++) {
+        pixelBlock[i] = blocks[i].IsUint() ? blocks[i].GetUint() : kNone;
+    }
+
+    return loadLists(topology["blockPixels"], blockPixels) &&
+           blockPixels.size() == gridWidth * gridHeight &&
+           loadLists(topology["blockNeighbors"], blockNeighbors) &&
+           blockNeighbors.size() == gridWidth * gridHeight &&
+           loadLists(topology["pixelNeighbors"], pixelNeighbors) &&
+           pixelNeighbors.size() == layout.Size();
+}
+
+inline bool LayoutTopology::load(const char *filename, const rapidjson::Value &layout)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return false;
+    }
+
+    rapidjson::Document doc;
+    rapidjson::FileStream istr(f);
+    doc.ParseStream<0>(istr);
+    fclose(f);
+
+    if (doc.HasParseError()) {
+        fprintf(stderr, "Can't parse layout topology %s\n", filename);
+        return false;
+    }
+    if (!load(doc, layout)) {
+        fprintf(stderr, "Layout topology %s doesn't match its layout, ignoring it\n", filename);
+        return false;
+    }
+    return true;
+}
+
+inline void LayoutTopology::saveLists(FILE *f, const char *name, const Lists &lists)
+{
+    fprintf(f, ",\n\"%s\":{\"offsets\":[", name);
+    for (unsigned i = 0; i < lists.offsets.size(); i++) {
+        fprintf(f, i ? ",%u" : "%u", lists.offsets[i]);
+    }
+    fprintf(f, "],\n\"indices\":[");
+    for (unsigned i = 0; i < lists.indices.size(); i++) {
+        fprintf(f, i ? ",%u" : "%u", lists.indices[i]);
+    }
+    fprintf(f, "]}");
+}
+
+inline bool LayoutTopology::save(const char *filename) const
+{
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "{\"checksum\":%u,\"is3D\":%s,\"gridWidth\":%u,\"gridHeight\":%u,\"neighborRadius\":%.9g",
+        checksum, is3D ? "true" : "false", gridWidth, gridHeight, neighborRadius);
+
+    // Pixels outside any block are null
+    fprintf(f, ",\n\"pixelBlock\":[");
+    for (unsigned i = 0; i < pixelBlock.size(); i++) {
+        if (i) {
+            fputc(',', f);
+        }
+        if (pixelBlock[i] == kNone) {
+            fprintf(f, "null");
+        } else {
+            fprintf(f, "%u", pixelBlock[i]);
+        }
+    }
+    fprintf(f, "]");
+
+    saveLists(f, "blockPixels", blockPixels);
+    saveLists(f, "blockNeighbors", blockNeighbors);
+    saveLists(f, "pixelNeighbors", pixelNeighbors);
+    fprintf(f, "}\n");
+
+    return fclose(f) == 0;
+}
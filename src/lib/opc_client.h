@@ -1,6 +1,16 @@
 /*
  * Tiny and fast C++ client for Open Pixel Control
  *
+ * Normally speaks OPC over TCP. A server address of "shm:PATH" instead hands
+ * frames to a co-located process through shared memory (see opc_shared_ring.h),
+ * connecting over the Unix domain socket at PATH. The "opc-bridge" tool is
+ * the other end, and forwards frames to an ordinary OPC server.
+ *
+ * A server address of "udp:HOST[:PORT]" sends each frame as sequenced
+ * datagrams (see opc_datagram.h), so a lossy link drops a frame rather than
+ * stalling the show. The receiver can be "opc-bridge -listen udp:..." on the
+ * LED server's host, or "opc-sink -listen udp:..." for testing.
+ *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
  * Permission is hereby granted, free of charge, to any person
@@ -38,6 +48,11 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <string>
+#include "opc_shared_ring.h"
+#include "opc_datagram.h"
 
 
 class OPCClient {
@@ -88,6 +103,17 @@ private:
     struct sockaddr_in address;
     bool connectSocket();
     void closeSocket();
+
+    // Datagram transport, for "udp:" addresses
+    bool datagram;
+    OPCDatagram::Sender sender;
+
+    // Shared memory transport, if 'ringPath' is set
+    std::string ringPath;
+    OPCSharedRing ring;
+    unsigned ringFrames;
+    bool connectRing();
+    bool isRingAlive();
 };
 
 
@@ -99,6 +125,8 @@ private:
 inline OPCClient::OPCClient()
 {
     fd = -1;
+    datagram = false;
+    ringFrames = 0;
     memset(&address, 0, sizeof address);
 }
 
@@ -113,11 +141,24 @@ inline void OPCClient::closeSocket()
         close(fd);
         fd = -1;
     }
+    ring.close();
 }
 
 inline bool OPCClient::resolve(const char *hostport, int defaultPort)
 {
-    fd = -1;
+    closeSocket();
+    ringPath.clear();
+    datagram = false;
+
+    if (!strncmp(hostport, "shm:", 4)) {
+        ringPath = hostport + 4;
+        return !ringPath.empty() && ringPath.size() < sizeof(((struct sockaddr_un*)0)->sun_path);
+    }
+
+    if (!strncmp(hostport, "udp:", 4)) {
+        datagram = true;
+        hostport += 4;
+    }
 
     char *host = strdup(hostport);
     char *colon = strchr(host, ':');
@@ -164,6 +205,19 @@ inline bool OPCClient::write(const uint8_t *data, ssize_t length)
         return false;
     }
 
+    if (!ringPath.empty()) {
+        if (!isRingAlive() || !ring.write(data, length)) {
+            closeSocket();
+            return false;
+        }
+        return true;
+    }
+
+    if (datagram) {
+        // Nothing to reconnect; a failed send only loses this frame
+        return sender.send(fd, data, length);
+    }
+
     while (length > 0) {
         int result = send(fd, data, length, 0);
         if (result <= 0) {
@@ -184,6 +238,20 @@ inline bool OPCClient::write(const std::vector<uint8_t> &data)
 
 inline bool OPCClient::connectSocket()
 {
+    if (!ringPath.empty()) {
+        return connectRing();
+    }
+
+    if (datagram) {
+        // Connected, so send() knows the destination. No handshake happens.
+        fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (connect(fd, (struct sockaddr*) &address, sizeof address) < 0) {
+            closeSocket();
+            return false;
+        }
+        return true;
+    }
+
     fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     if (connect(fd, (struct sockaddr*) &address, sizeof address) < 0) {
@@ -203,3 +271,34 @@ inline bool OPCClient::connectSocket()
 
     return true;
 }
+
+inline bool OPCClient::connectRing()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ringPath.c_str(), sizeof addr.sun_path - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof addr) < 0 ||
+        !ring.create() || !ring.sendDescriptors(fd)) {
+        closeSocket();
+        return false;
+    }
+
+    ringFrames = 0;
+    return true;
+}
+
+inline bool OPCClient::isRingAlive()
+{
+    // Nothing ever comes back over the socket, so a readable socket means
+    // the reader hung up. Checking costs a syscall, so only do it now and then.
+
+    if (ringFrames++ % 64) {
+        return true;
+    }
+
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
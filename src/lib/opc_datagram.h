@@ -0,0 +1,281 @@
+/*
+ * Open Pixel Control over UDP, with frame sequencing
+ *
+ * Over TCP, one lost packet holds up everything behind it until it's
+ * retransmitted, and OPCClient::write() blocks the render loop meanwhile.
+ * For LEDs a late frame is worthless anyway, so this sends each frame as
+ * datagrams instead. A lost datagram costs one frame, and the next frame
+ * goes out on time.
+ *
+ * Every datagram starts with a small header: a frame sequence number, plus
+ * which part of the frame this is. Datagrams are sized to fit one Ethernet
+ * packet, since a fragmented datagram is lost whenever any fragment is, so
+ * frames are split into parts at arbitrary byte offsets, even in the middle
+ * of an OPC message. The receiver only delivers a frame once all its parts
+ * are in, and discards anything older than the last frame it delivered.
+ *
+ * The header also carries a session number, picked at random by each
+ * sender. When the renderer restarts, its sequence numbers start over; the
+ * new session tells the receiver to start over too, instead of treating
+ * the new frames as stale.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+
+class OPCDatagram {
+public:
+    // Largest UDP payload over IPv4, for receive buffers
+    static const unsigned kMaxDatagram = 65507;
+
+    // Largest datagram we send: a 1500-byte Ethernet MTU less IPv4 and UDP headers
+    static const unsigned kPartDatagram = 1472;
+
+    // Up to 255 parts per frame
+    static const unsigned kMaxParts = 255;
+
+    struct Header {
+        uint8_t magic[2];       // "OP"
+        uint8_t part;           // Which datagram of this frame, from zero
+        uint8_t parts;          // Datagrams in this frame
+        uint8_t session[4];     // Random per sender, big-endian
+        uint8_t sequence[4];    // Frame number, big-endian
+
+        void init(uint32_t session, uint32_t sequence, uint8_t part, uint8_t parts);
+        bool isValid() const;
+        uint32_t getSession() const;
+        uint32_t getSequence() const;
+    };
+
+    // Sending side. Returns false if the frame is too large, or a datagram wasn't sent.
+    class Sender {
+    public:
+        Sender();
+        bool send(int fd, const uint8_t *data, unsigned length);
+
+    private:
+        uint32_t session;
+        uint32_t sequence;
+        bool reportedTooLarge;
+        std::vector<uint8_t> datagram;
+    };
+
+    // Receiving side. Feed it datagrams; it returns true when 'frame' holds
+    // a newly completed frame.
+    class Receiver {
+    public:
+        Receiver();
+        bool receive(const uint8_t *data, unsigned length, std::vector<uint8_t> &frame);
+
+        unsigned frames;        // Frames delivered
+        unsigned lost;          // Frames that never arrived, or arrived incomplete
+        unsigned stale;         // Datagrams discarded for being older than a delivered frame
+
+        void resetCounters();
+
+    private:
+        bool started;
+        uint32_t session;
+        uint32_t lastDelivered;
+        uint32_t assembling;
+        std::vector<bool> partsSeen;
+        std::vector<std::vector<uint8_t> > partData;
+    };
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline void OPCDatagram::Header::init(uint32_t session, uint32_t sequence, uint8_t part, uint8_t parts)
+{
+    magic[0] = 'O';
+    magic[1] = 'P';
+    this->part = part;
+    this->parts = parts;
+    this->session[0] = session >> 24;
+    this->session[1] = session >> 16;
+    this->session[2] = session >> 8;
+    this->session[3] = session;
+    this->sequence[0] = sequence >> 24;
+    this->sequence[1] = sequence >> 16;
+    this->sequence[2] = sequence >> 8;
+    this->sequence[3] = sequence;
+}
+
+inline bool OPCDatagram::Header::isValid() const
+{
+    return magic[0] == 'O' && magic[1] == 'P' && parts > 0 && part < parts;
+}
+
+inline uint32_t OPCDatagram::Header::getSession() const
+{
+    return (uint32_t(session[0]) << 24) | (uint32_t(session[1]) << 16) |
+           (uint32_t(session[2]) << 8) | session[3];
+}
+
+inline uint32_t OPCDatagram::Header::getSequence() const
+{
+    return (uint32_t(sequence[0]) << 24) | (uint32_t(sequence[1]) << 16) |
+           (uint32_t(sequence[2]) << 8) | sequence[3];
+}
+
+inline OPCDatagram::Sender::Sender()
+    : sequence(0), reportedTooLarge(false)
+{
+    // Only needs to differ from the last run's, so the clock and pid will do
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    session = (uint32_t(tv.tv_sec) * 2654435761u) ^ (uint32_t(tv.tv_usec) << 12) ^ uint32_t(getpid());
+}
+
+inline bool OPCDatagram::Sender::send(int fd, const uint8_t *data, unsigned length)
+{
+    const unsigned capacity = kPartDatagram - sizeof(Header);
+    unsigned parts = std::max(1u, (length + capacity - 1) / capacity);
+
+    if (parts > kMaxParts) {
+        if (!reportedTooLarge) {
+            fprintf(stderr, "opc: %u byte frame is too large for UDP, limit is %u bytes\n",
+                length, kMaxParts * capacity);
+            reportedTooLarge = true;
+        }
+        return false;
+    }
+
+    uint32_t seq = sequence++;
+    bool success = true;
+
+    for (unsigned p = 0; p < parts; p++) {
+        unsigned offset = p * capacity;
+        unsigned partLength = std::min(capacity, length - offset);
+        datagram.resize(sizeof(Header) + partLength);
+        ((Header*) &datagram[0])->init(session, seq, p, parts);
+        memcpy(&datagram[sizeof(Header)], data + offset, partLength);
+
+        if (::send(fd, &datagram[0], datagram.size(), 0) != ssize_t(datagram.size())) {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+inline OPCDatagram::Receiver::Receiver()
+    : started(false), session(0), lastDelivered(0), assembling(0)
+{
+    resetCounters();
+}
+
+inline void OPCDatagram::Receiver::resetCounters()
+{
+    frames = lost = stale = 0;
+}
+
+inline bool OPCDatagram::Receiver::receive(const uint8_t *data, unsigned length, std::vector<uint8_t> &frame)
+{
+    if (length < sizeof(Header)) {
+        return false;
+    }
+    const Header &h = *(const Header*) data;
+    if (!h.isValid()) {
+        return false;
+    }
+
+    // A new session means a new sender; its sequence numbers have nothing to do
+    // with the old ones. Nothing in between is counted as lost or stale.
+
+    if (h.getSession() != session) {
+        session = h.getSession();
+        started = false;
+        partsSeen.clear();
+    }
+
+    // Sequence numbers wrap, so compare by signed difference
+
+    uint32_t seq = h.getSequence();
+    if (started && int32_t(seq - lastDelivered) <= 0) {
+        stale++;
+        return false;
+    }
+
+    if (partsSeen.empty() || seq != assembling) {
+        if (!partsSeen.empty()) {
+            if (int32_t(seq - assembling) < 0) {
+                // Older than the frame we're already assembling
+                stale++;
+                return false;
+            }
+            // Newer frame; give up on the incomplete one. It's counted as
+            // lost along with any other gap once a frame is delivered.
+        }
+        assembling = seq;
+        partsSeen.assign(h.parts, false);
+        partData.resize(h.parts);
+    }
+
+    if (h.part >= partsSeen.size()) {
+        return false;
+    }
+    partsSeen[h.part] = true;
+    partData[h.part].assign(data + sizeof(Header), data + length);
+
+    for (unsigned p = 0; p < partsSeen.size(); p++) {
+        if (!partsSeen[p]) {
+            return false;
+        }
+    }
+
+    // Complete. Anything between this and the last frame is gone for good.
+
+    frame.clear();
+    for (unsigned p = 0; p < partsSeen.size(); p++) {
+        frame.insert(frame.end(), partData[p].begin(), partData[p].end());
+    }
+
+    if (started) {
+        uint32_t gap = seq - lastDelivered - 1;
+        lost += gap;
+    }
+
+    started = true;
+    lastDelivered = seq;
+    partsSeen.clear();
+    frames++;
+    return true;
+}
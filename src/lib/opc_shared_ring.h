@@ -0,0 +1,361 @@
+/*
+ * Shared memory frame ring, for handing OPC messages to a server on the same host
+ *
+ * Going through TCP loopback costs a send() per frame, a copy into the kernel,
+ * and a trip through the TCP stack on both ends. Instead, the client writes
+ * each OPC message into a small ring of slots in shared memory, then rings a
+ * doorbell (an eventfd) so the reader wakes up. The reader always takes the
+ * newest complete frame; if it falls behind, older frames are skipped rather
+ * than queued, the same as an LED server would want.
+ *
+ * The memory is an anonymous memfd, so nothing is left behind in the
+ * filesystem. Both file descriptors are passed to the reader over a Unix
+ * domain socket, which also tells each side when the other has gone away.
+ *
+ * Each slot is a seqlock: its sequence number is odd while the writer is
+ * busy with it, and readers re-check the number after copying. So there's
+ * no locking, and a slow reader can never hold up the renderer.
+ *
+ * Linux only. Elsewhere, create() and attach() fail.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+
+class OPCSharedRing {
+public:
+    // Each slot holds any single OPC message, padded to keep slots aligned
+    static const unsigned kSlots = 4;
+    static const unsigned kSlotSize = 0x10004;
+
+    OPCSharedRing();
+    ~OPCSharedRing();
+
+    // Writer side: make a new ring
+    bool create();
+
+    // Reader side: map a ring from descriptors we received. Takes ownership of them.
+    bool attach(int memFd, int eventFd);
+
+    void close();
+    bool isOpen() const;
+
+    // Writer: copy one OPC message into the next slot and ring the doorbell
+    bool write(const uint8_t *data, unsigned length);
+
+    // Reader: descriptor that becomes readable when the doorbell rings
+    int getEventFd() const;
+
+    // Reader: copy out the newest frame, if there's one we haven't seen.
+    // Clears the doorbell. 'skipped' counts frames we never saw.
+    bool readLatest(std::vector<uint8_t> &frame);
+    unsigned skipped;
+
+    // Pass the ring's descriptors over a connected Unix domain socket
+    bool sendDescriptors(int socket) const;
+    static bool receiveDescriptors(int socket, int &memFd, int &eventFd);
+
+private:
+    static const uint32_t kMagic = 0x5243504f;     // "OPCR"
+
+    struct Header {
+        uint32_t magic;
+        uint32_t slots;
+        uint32_t slotSize;
+        uint32_t writeCount;    // Frames written so far
+    };
+
+    struct Slot {
+        uint32_t sequence;      // 2n+1 while frame n is being written, 2n+2 once it's done
+        uint32_t length;
+    };
+
+    int memFd;
+    int eventFd;
+    uint8_t *memory;
+    uint32_t writeCount;
+    uint32_t readCount;
+
+    static size_t mappingSize();
+    Header &header();
+    Slot &slot(unsigned index);
+    bool map();
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline OPCSharedRing::OPCSharedRing()
+    : skipped(0), memFd(-1), eventFd(-1), memory(0), writeCount(0), readCount(0)
+{}
+
+inline OPCSharedRing::~OPCSharedRing()
+{
+    close();
+}
+
+inline size_t OPCSharedRing::mappingSize()
+{
+    return sizeof(Header) + kSlots * (sizeof(Slot) + kSlotSize);
+}
+
+inline OPCSharedRing::Header& OPCSharedRing::header()
+{
+    return *(Header*) memory;
+}
+
+inline OPCSharedRing::Slot& OPCSharedRing::slot(unsigned index)
+{
+    return *(Slot*) (memory + sizeof(Header) + (index % kSlots) * (sizeof(Slot) + kSlotSize));
+}
+
+inline bool OPCSharedRing::isOpen() const
+{
+    return memory != 0;
+}
+
+inline int OPCSharedRing::getEventFd() const
+{
+    return eventFd;
+}
+
+inline void OPCSharedRing::close()
+{
+    #ifdef __linux__
+        if (memory) {
+            munmap(memory, mappingSize());
+        }
+    #endif
+
+    if (memFd >= 0) {
+        ::close(memFd);
+    }
+    if (eventFd >= 0) {
+        ::close(eventFd);
+    }
+
+    memory = 0;
+    memFd = eventFd = -1;
+    writeCount = readCount = 0;
+}
+
+inline bool OPCSharedRing::map()
+{
+    #ifdef __linux__
+        void *m = mmap(0, mappingSize(), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+        if (m != MAP_FAILED) {
+            memory = (uint8_t*) m;
+            return true;
+        }
+    #endif
+    return false;
+}
+
+inline bool OPCSharedRing::create()
+{
+    close();
+
+    #ifdef __linux__
+        #ifdef SYS_memfd_create
+            memFd = syscall(SYS_memfd_create, "opc-ring", 0);
+        #else
+            // Older headers: an unlinked file in shared memory is just as private
+            char name[] = "/dev/shm/opc-ring-XXXXXX";
+            memFd = mkstemp(name);
+            if (memFd >= 0) {
+                unlink(name);
+            }
+        #endif
+
+        eventFd = eventfd(0, EFD_NONBLOCK);
+
+        if (memFd < 0 || eventFd < 0 || ftruncate(memFd, mappingSize()) < 0 || !map()) {
+            close();
+            return false;
+        }
+
+        Header &h = header();
+        h.magic = kMagic;
+        h.slots = kSlots;
+        h.slotSize = kSlotSize;
+        h.writeCount = 0;
+        return true;
+    #else
+        return false;
+    #endif
+}
+
+inline bool OPCSharedRing::attach(int memFd, int eventFd)
+{
+    close();
+    this->memFd = memFd;
+    this->eventFd = eventFd;
+
+    if (!map()) {
+        close();
+        return false;
+    }
+
+    Header &h = header();
+    if (h.magic != kMagic || h.slots != kSlots || h.slotSize != kSlotSize) {
+        close();
+        return false;
+    }
+
+    readCount = __atomic_load_n(&h.writeCount, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+inline bool OPCSharedRing::write(const uint8_t *data, unsigned length)
+{
+    if (!memory || length > kSlotSize) {
+        return false;
+    }
+
+    uint32_t n = writeCount++;
+    Slot &s = slot(n);
+
+    __atomic_store_n(&s.sequence, 2*n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s.length = length;
+    memcpy(&s + 1, data, length);
+    __atomic_store_n(&s.sequence, 2*n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header().writeCount, n + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    return ::write(eventFd, &one, sizeof one) == sizeof one;
+}
+
+inline bool OPCSharedRing::readLatest(std::vector<uint8_t> &frame)
+{
+    if (!memory) {
+        return false;
+    }
+
+    uint64_t doorbell;
+    while (::read(eventFd, &doorbell, sizeof doorbell) == sizeof doorbell);
+
+    while (true) {
+        uint32_t count = __atomic_load_n(&header().writeCount, __ATOMIC_ACQUIRE);
+        if (count == readCount) {
+            return false;
+        }
+
+        uint32_t n = count - 1;
+        Slot &s = slot(n);
+        uint32_t sequence = __atomic_load_n(&s.sequence, __ATOMIC_ACQUIRE);
+        if (sequence != 2*n + 2) {
+            // Already being overwritten; look again
+            continue;
+        }
+
+        unsigned length = std::min<unsigned>(s.length, kSlotSize);
+        frame.resize(length);
+        memcpy(&frame[0], &s + 1, length);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s.sequence, __ATOMIC_RELAXED) != sequence) {
+            continue;
+        }
+
+        skipped += count - readCount - 1;
+        readCount = count;
+        return true;
+    }
+}
+
+inline bool OPCSharedRing::sendDescriptors(int socket) const
+{
+    int fds[2] = { memFd, eventFd };
+    char tag = 'R';
+    struct iovec iov = { &tag, 1 };
+
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+    return sendmsg(socket, &msg, 0) == 1;
+}
+
+inline bool OPCSharedRing::receiveDescriptors(int socket, int &memFd, int &eventFd)
+{
+    int fds[2];
+    char tag;
+    struct iovec iov = { &tag, 1 };
+
+    char control[CMSG_SPACE(sizeof fds)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    if (recvmsg(socket, &msg, 0) != 1 || tag != 'R') {
+        return false;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof fds)) {
+        return false;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+    memFd = fds[0];
+    eventFd = fds[1];
+    return true;
+}
@@ -0,0 +1,442 @@
+/*
+ * Minimal Open Pixel Control receiver, for measuring output pacing
+ *
+ * Accepts the same TCP stream OPCClient sends to fcserver, one client at a
+ * time, and records when each message finishes arriving, along with its size
+ * and a checksum of its payload. From that we can report frame rate,
+ * inter-frame jitter, throughput, repeated frames, and a rough count of
+ * dropped frames: gaps long enough that whole frames must be missing.
+ *
+ * That gap estimate assumes the sender runs at a fixed frame rate. When the
+ * renderer slows down on purpose, for the idle bypass or the motion-adaptive
+ * frame rate, each longer interval is counted as dropped frames too.
+ *
+ * It can also listen for OPCClient's datagram transport, with a "udp:" prefix
+ * on the address. Those frames carry sequence numbers, so the dropped count
+ * is exact, and frames that arrive out of order are counted as stale.
+ *
+ * No LEDs involved, so it's a stand-in for fcserver during development, and
+ * the benchmark uses it to measure end-to-end output timing.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "opc_client.h"
+#include "opc_datagram.h"
+
+
+class OPCSink {
+public:
+    OPCSink();
+    ~OPCSink();
+
+    // Start listening on "[udp:]HOST[:PORT]". Port zero picks any free port; see getPort().
+    bool listen(const char *hostport, int defaultPort = 7890);
+    int getPort() const;
+
+    // Receive messages until 'seconds' pass, or until stop() is called from
+    // another thread. Negative time runs until stop(). Returns false on error.
+    // Once stopped, the sink stays stopped; run() returns right away.
+    bool run(float seconds);
+    void stop();
+
+    struct Message {
+        double time;            // Seconds since the sink started, at the recv() with its last byte
+        uint8_t channel;
+        uint8_t command;
+        unsigned length;        // Payload bytes
+        uint32_t checksum;      // FNV-1a of the payload
+    };
+
+    struct Stats {
+        unsigned frames;        // Messages received
+        unsigned repeats;       // Frames identical to the one before
+        unsigned dropped;       // Frames missing. Exact for datagrams; for TCP a gap estimate,
+                                //   only meaningful if the sender's frame rate is fixed
+        unsigned stale;         // Datagrams discarded for arriving after newer frames
+        double seconds;         // First to last frame
+        double frameRate;
+        double bytesPerSecond;
+        double meanInterval;    // Seconds between frames
+        double jitter;          // Standard deviation of the interval
+        double minInterval;
+        double maxInterval;
+        double p99Interval;
+    };
+
+    // Everything received since the last clear()
+    const std::vector<Message>& getMessages() const;
+    Stats getStats() const;
+    void clear();
+
+    // One-line summary, and a tab-separated log with one message per line
+    void printStats(FILE *f) const;
+    void writeLog(FILE *f) const;
+
+private:
+    int listenFd;
+    int clientFd;
+    volatile bool running;
+    bool datagram;
+    OPCDatagram::Receiver receiver;
+    struct timeval startTime;
+    std::vector<uint8_t> buffer;
+    std::vector<Message> messages;
+
+    double now() const;
+    void closeClient();
+    bool readClient();
+    bool readDatagram();
+    void parseMessages(double time);
+    static uint32_t checksum(const uint8_t *data, unsigned length);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline OPCSink::OPCSink()
+    : listenFd(-1), clientFd(-1), running(false), datagram(false)
+{
+    gettimeofday(&startTime, 0);
+}
+
+inline OPCSink::~OPCSink()
+{
+    closeClient();
+    if (listenFd >= 0) {
+        close(listenFd);
+    }
+}
+
+inline double OPCSink::now() const
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (tv.tv_sec - startTime.tv_sec) + 1e-6 * (tv.tv_usec - startTime.tv_usec);
+}
+
+inline bool OPCSink::listen(const char *hostport, int defaultPort)
+{
+    // Same HOST:PORT syntax as OPCClient::resolve
+
+    datagram = !strncmp(hostport, "udp:", 4);
+    if (datagram) {
+        hostport += 4;
+    }
+
+    char *host = strdup(hostport);
+    char *colon = strchr(host, ':');
+    int port = defaultPort;
+    if (colon) {
+        *colon = '\0';
+        port = strtol(colon + 1, 0, 10);
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    bool resolved = false;
+
+    struct addrinfo *addr;
+    if (getaddrinfo(*host ? host : "localhost", 0, 0, &addr) == 0) {
+        for (struct addrinfo *i = addr; i; i = i->ai_next) {
+            if (i->ai_family == PF_INET) {
+                memcpy(&address, i->ai_addr, sizeof address);
+                address.sin_port = htons(port);
+                resolved = true;
+                break;
+            }
+        }
+        freeaddrinfo(addr);
+    }
+    free(host);
+
+    if (!resolved) {
+        return false;
+    }
+
+    listenFd = datagram ? socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP) : socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenFd < 0) {
+        return false;
+    }
+
+    int flag = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, (char*) &flag, sizeof flag);
+
+    if (bind(listenFd, (struct sockaddr*) &address, sizeof address) < 0 ||
+        (!datagram && ::listen(listenFd, 1) < 0)) {
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+inline int OPCSink::getPort() const
+{
+    struct sockaddr_in address;
+    socklen_t len = sizeof address;
+    if (listenFd < 0 || getsockname(listenFd, (struct sockaddr*) &address, &len) < 0) {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+inline void OPCSink::stop()
+{
+    running = false;
+}
+
+inline bool OPCSink::run(float seconds)
+{
+    if (listenFd < 0) {
+        return false;
+    }
+
+    double deadline = now() + seconds;
+
+    while (running && (seconds < 0 || now() < deadline)) {
+
+        // Wake up periodically to check the deadline and stop flag
+        struct pollfd pfd;
+        pfd.fd = clientFd >= 0 ? clientFd : listenFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int result = poll(&pfd, 1, 100);
+        if (result < 0) {
+            perror("opc-sink: poll");
+            return false;
+        }
+        if (result == 0) {
+            continue;
+        }
+
+        if (datagram) {
+            readDatagram();
+        } else if (clientFd < 0) {
+            // One client at a time, like a Fadecandy board's single stream
+            clientFd = accept(listenFd, 0, 0);
+            buffer.clear();
+        } else if (!readClient()) {
+            closeClient();
+        }
+    }
+
+    return true;
+}
+
+inline void OPCSink::closeClient()
+{
+    if (clientFd >= 0) {
+        close(clientFd);
+        clientFd = -1;
+    }
+}
+
+inline bool OPCSink::readClient()
+{
+    uint8_t chunk[64 * 1024];
+    ssize_t result = recv(clientFd, chunk, sizeof chunk, 0);
+    if (result <= 0) {
+        return false;
+    }
+    double t = now();
+
+    buffer.insert(buffer.end(), chunk, chunk + result);
+    parseMessages(t);
+    return true;
+}
+
+inline bool OPCSink::readDatagram()
+{
+    uint8_t chunk[OPCDatagram::kMaxDatagram];
+    ssize_t result = recv(listenFd, chunk, sizeof chunk, 0);
+    if (result <= 0) {
+        return false;
+    }
+    double t = now();
+
+    // Complete frames only, so the buffer holds whole messages
+    if (receiver.receive(chunk, result, buffer)) {
+        parseMessages(t);
+    }
+    return true;
+}
+
+inline void OPCSink::parseMessages(double time)
+{
+    // Pull complete messages off the front of the buffer. They all finished
+    // arriving in the same recv(), so they share its timestamp.
+
+    size_t offset = 0;
+
+    while (buffer.size() - offset >= sizeof(OPCClient::Header)) {
+        const OPCClient::Header &h = *(const OPCClient::Header*) &buffer[offset];
+        unsigned length = (h.length[0] << 8) | h.length[1];
+        size_t total = sizeof h + length;
+
+        if (buffer.size() - offset < total) {
+            break;
+        }
+
+        Message m;
+        m.time = time;
+        m.channel = h.channel;
+        m.command = h.command;
+        m.length = length;
+        m.checksum = checksum(h.data(), length);
+        messages.push_back(m);
+
+        offset += total;
+    }
+
+    buffer.erase(buffer.begin(), buffer.begin() + offset);
+}
+
+inline uint32_t OPCSink::checksum(const uint8_t *data, unsigned length)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+inline const std::vector<OPCSink::Message>& OPCSink::getMessages() const
+{
+    return messages;
+}
+
+inline void OPCSink::clear()
+{
+    messages.clear();
+    receiver.resetCounters();
+}
+
+inline OPCSink::Stats OPCSink::getStats() const
+{
+    Stats s;
+    memset(&s, 0, sizeof s);
+    s.frames = messages.size();
+    s.stale = receiver.stale;
+    if (messages.empty()) {
+        return s;
+    }
+
+    double bytes = 0;
+    std::vector<double> intervals;
+    for (unsigned i = 0; i < messages.size(); i++) {
+        bytes += sizeof(OPCClient::Header) + messages[i].length;
+        if (i) {
+            intervals.push_back(messages[i].time - messages[i-1].time);
+            if (messages[i].checksum == messages[i-1].checksum && messages[i].length == messages[i-1].length) {
+                s.repeats++;
+            }
+        }
+    }
+
+    s.seconds = messages.back().time - messages.front().time;
+    if (intervals.empty() || s.seconds <= 0) {
+        return s;
+    }
+
+    s.frameRate = intervals.size() / s.seconds;
+    s.bytesPerSecond = bytes / s.seconds;
+    s.meanInterval = s.seconds / intervals.size();
+
+    double variance = 0;
+    for (unsigned i = 0; i < intervals.size(); i++) {
+        double d = intervals[i] - s.meanInterval;
+        variance += d * d;
+    }
+    s.jitter = sqrt(variance / intervals.size());
+
+    std::vector<double> sorted = intervals;
+    std::sort(sorted.begin(), sorted.end());
+
+    s.minInterval = sorted.front();
+    s.maxInterval = sorted.back();
+    s.p99Interval = sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * 99 / 100)];
+
+    // Plain OPC has no sequence numbers, so over TCP dropped frames are an
+    // estimate: a gap that spans several typical (median) intervals is missing
+    // frames. Messages that arrived in the same recv() have zero intervals
+    // between them; those are left out of the median, or a burst of them
+    // would make every real interval look like a gap.
+
+    std::vector<double>::iterator firstNonzero = std::upper_bound(sorted.begin(), sorted.end(), 0.0);
+    double median = firstNonzero == sorted.end() ? 0 :
+        firstNonzero[(sorted.end() - firstNonzero) / 2];
+
+    if (datagram) {
+        s.dropped = receiver.lost;
+    } else if (median > 0) {
+        for (unsigned i = 0; i < intervals.size(); i++) {
+            int missing = int(intervals[i] / median + 0.5) - 1;
+            s.dropped += std::max(0, missing);
+        }
+    }
+
+    return s;
+}
+
+inline void OPCSink::printStats(FILE *f) const
+{
+    Stats s = getStats();
+    fprintf(f, "%u frames, %.2f fps, %.1f kB/s, interval %.2f ms (min %.2f, p99 %.2f, max %.2f), "
+        "jitter %.3f ms, %u %s, %u stale, %u repeated\n",
+        s.frames, s.frameRate, s.bytesPerSecond * 1e-3, s.meanInterval * 1e3,
+        s.minInterval * 1e3, s.p99Interval * 1e3, s.maxInterval * 1e3,
+        s.jitter * 1e3, s.dropped, datagram ? "dropped" : "dropped (gap estimate, assumes fixed fps)",
+        s.stale, s.repeats);
+}
+
+inline void OPCSink::writeLog(FILE *f) const
+{
+    for (unsigned i = 0; i < messages.size(); i++) {
+        const Message &m = messages[i];
+        fprintf(f, "%.6f\t%d\t%d\t%u\t%08x\n", m.time, m.channel, m.command, m.length, m.checksum);
+    }
+}
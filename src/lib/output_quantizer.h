@@ -0,0 +1,252 @@
+/*
+ * Output quantization: floating point colors to 8-bit framebuffer bytes
+ *
+ * Effects shade into a flat buffer of floats, and this converts the whole
+ * buffer in one pass: clamp, scale, round, and pack. The work is done in 8.8
+ * fixed point. Each value is scaled to 0-65280 and gets an offset before the
+ * final shift: 128 rounds to nearest, the same as scalar rounding. With
+ * dithering, the offset comes from a low-discrepancy sequence that shifts every
+ * frame instead, so the average over time keeps more than 8 bits.
+ *
+ * Optionally, a gamma curve is applied with a lookup table. The table
+ * lookup is scalar, but the clamping and scaling before it are not.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+
+class OutputQuantizer {
+public:
+    OutputQuantizer();
+
+    // Gamma 1.0 (the default) leaves values linear, and skips the lookup table.
+    // Leave this at 1.0 if the LED server does its own color correction.
+    void setGamma(float gamma);
+
+    // Dithering is off by default, in which case we round to nearest
+    void setDither(bool enable);
+
+    // Start a new frame; moves the dither pattern along
+    void nextFrame();
+
+    // Convert 'count' floats to bytes
+    void quantize(const float *input, uint8_t *output, unsigned count) const;
+
+    // Convert one value, without dithering. For filling with a single color,
+    // where every pixel should come out the same.
+    uint8_t quantizeUniform(float value) const;
+
+private:
+    static const unsigned kDitherSize = 256;
+    static const unsigned kGammaSize = 4096;
+    static const unsigned kBlock = 16;
+
+    float gamma;
+    bool dither;
+    unsigned ditherPhase;
+
+    // Fixed point offsets; extra entries at the end so a block never wraps
+    float ditherTable[kDitherSize + kBlock];
+
+    // 8.8 fixed point output for 12-bit input, when gamma != 1
+    std::vector<uint16_t> gammaTable;
+
+    const float *offsets(unsigned index) const;
+    void quantizeLinear(const float *input, uint8_t *output, unsigned count, const float *offset) const;
+    void quantizeGamma(const float *input, uint8_t *output, unsigned count, const float *offset) const;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline OutputQuantizer::OutputQuantizer()
+    : gamma(1.0f), dither(false), ditherPhase(0)
+{
+    setDither(false);
+}
+
+inline void OutputQuantizer::setGamma(float gamma)
+{
+    this->gamma = gamma;
+    gammaTable.clear();
+
+    if (gamma != 1.0f) {
+        gammaTable.resize(kGammaSize);
+        for (unsigned i = 0; i < kGammaSize; i++) {
+            gammaTable[i] = powf(i / float(kGammaSize - 1), gamma) * 65280.0f;
+        }
+    }
+}
+
+inline void OutputQuantizer::setDither(bool enable)
+{
+    dither = enable;
+
+    for (unsigned i = 0; i < kDitherSize + kBlock; i++) {
+        // Golden ratio sequence: evenly spread over [0, 256) for any run of entries
+        float f = (i % kDitherSize) * 0.618033988749895f;
+        ditherTable[i] = enable ? (f - floorf(f)) * 256.0f : 128.0f;
+    }
+}
+
+inline void OutputQuantizer::nextFrame()
+{
+    // Odd step, so every phase gets visited
+    ditherPhase = (ditherPhase + 97) % kDitherSize;
+}
+
+inline const float *OutputQuantizer::offsets(unsigned index) const
+{
+    return ditherTable + (index + ditherPhase) % kDitherSize;
+}
+
+inline uint8_t OutputQuantizer::quantizeUniform(float value) const
+{
+    float v = std::min(1.0f, std::max(0.0f, value));
+    unsigned fixed = gammaTable.empty() ? unsigned(v * 65280.0f) : gammaTable[unsigned(v * (kGammaSize - 1) + 0.5f)];
+    return std::min(65535u, fixed + 128) >> 8;
+}
+
+inline void OutputQuantizer::quantize(const float *input, uint8_t *output, unsigned count) const
+{
+    for (unsigned i = 0; i < count; i += kBlock) {
+        unsigned n = std::min(kBlock, count - i);
+        if (gammaTable.empty()) {
+            quantizeLinear(input + i, output + i, n, offsets(i));
+        } else {
+            quantizeGamma(input + i, output + i, n, offsets(i));
+        }
+    }
+}
+
+inline void OutputQuantizer::quantizeLinear(const float *input, uint8_t *output,
+    unsigned count, const float *offset) const
+{
+    // One block of up to kBlock values. NaN comes out as zero.
+
+#if defined(__SSE2__)
+    if (count == kBlock) {
+        const __m128 scale = _mm_set1_ps(65280.0f);
+        const __m128 lo = _mm_setzero_ps();
+        const __m128 hi = _mm_set1_ps(65535.0f);
+        __m128i v[4];
+
+        for (unsigned j = 0; j < 4; j++) {
+            __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(input + 4*j), scale), _mm_loadu_ps(offset + 4*j));
+            x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+            v[j] = _mm_srli_epi32(_mm_cvttps_epi32(x), 8);
+        }
+
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i*) output, packed);
+        return;
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    if (count == kBlock) {
+        const float32x4_t scale = vdupq_n_f32(65280.0f);
+        const float32x4_t lo = vdupq_n_f32(0.0f);
+        const float32x4_t hi = vdupq_n_f32(65535.0f);
+        uint16x4_t v[4];
+
+        for (unsigned j = 0; j < 4; j++) {
+            float32x4_t x = vmlaq_f32(vld1q_f32(offset + 4*j), vld1q_f32(input + 4*j), scale);
+            x = vminq_f32(vmaxq_f32(x, lo), hi);
+            v[j] = vmovn_u32(vshrq_n_u32(vcvtq_u32_f32(x), 8));
+        }
+
+        vst1q_u8(output, vcombine_u8(vmovn_u16(vcombine_u16(v[0], v[1])),
+                                     vmovn_u16(vcombine_u16(v[2], v[3]))));
+        return;
+    }
+#endif
+
+    for (unsigned i = 0; i < count; i++) {
+        float x = input[i] * 65280.0f + offset[i];
+        x = x > 0.0f ? std::min(x, 65535.0f) : 0.0f;
+        output[i] = unsigned(x) >> 8;
+    }
+}
+
+inline void OutputQuantizer::quantizeGamma(const float *input, uint8_t *output,
+    unsigned count, const float *offset) const
+{
+    // Table index from clamped input, then add the offset in output space
+
+    unsigned index[kBlock];
+    const float scale = kGammaSize - 1;
+
+#if defined(__SSE2__)
+    if (count == kBlock) {
+        const __m128 s = _mm_set1_ps(scale);
+        const __m128 lo = _mm_setzero_ps();
+        const __m128 hi = _mm_set1_ps(scale);
+        const __m128 half = _mm_set1_ps(0.5f);
+
+        for (unsigned j = 0; j < 4; j++) {
+            __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(input + 4*j), s), half);
+            x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+            _mm_storeu_si128((__m128i*) (index + 4*j), _mm_cvttps_epi32(x));
+        }
+    } else
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    if (count == kBlock) {
+        const float32x4_t s = vdupq_n_f32(scale);
+        const float32x4_t lo = vdupq_n_f32(0.0f);
+        const float32x4_t half = vdupq_n_f32(0.5f);
+
+        for (unsigned j = 0; j < 4; j++) {
+            float32x4_t x = vmlaq_f32(half, vld1q_f32(input + 4*j), s);
+            x = vminq_f32(vmaxq_f32(x, lo), s);
+            vst1q_u32(index + 4*j, vcvtq_u32_f32(x));
+        }
+    } else
+#endif
+    {
+        for (unsigned i = 0; i < count; i++) {
+            float x = input[i] * scale + 0.5f;
+            index[i] = x > 0.0f ? unsigned(std::min(x, scale)) : 0;
+        }
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        unsigned fixed = gammaTable[index[i]] + unsigned(offset[i]);
+        output[i] = std::min(65535u, fixed) >> 8;
+    }
+}
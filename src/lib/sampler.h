@@ -60,6 +60,35 @@ struct Sampler
         }
     };
 
+    /**
+     * A random variable compiled ahead of time (see ConfigCompiler),
+     * so that sampling it doesn't involve any JSON lookups.
+     */
+
+    struct Variable {
+        double a;
+        double b;
+        bool isUniform;
+
+        static Variable constant(double v) {
+            Variable r = { v, v, false };
+            return r;
+        }
+
+        static Variable uniform(double a, double b) {
+            Variable r = { a, b, true };
+            return r;
+        }
+    };
+
+    struct Variable2D {
+        Variable x, y;
+    };
+
+    struct Variable3D {
+        Variable x, y, z;
+    };
+
     Sampler(uint32_t seed) {
         mRandom.seed(seed);
     }
@@ -102,6 +131,26 @@ struct Sampler
         return 0;
     }
 
+    /**
+     * Sample a compiled random variable. Equivalent to value() on
+     * the JSON it was compiled from.
+     */
+
+    double value(const Variable &v)
+    {
+        return v.isUniform ? uniform(v.a, v.b) : v.a;
+    }
+
+    Vec2 value2D(const Variable2D &v)
+    {
+        return Vec2(value(v.x), value(v.y));
+    }
+
+    Vec3 value3D(const Variable3D &v)
+    {
+        return Vec3(value(v.x), value(v.y), value(v.z));
+    }
+
     /**
      * Sample values for every component in a vector
      */
@@ -11,16 +11,10 @@
  * http://creativecommons.org/licenses/by/3.0/
  */
 
-#include "lib/camera.h"
 #include "narrator.h"
 
 static Narrator narrator;
 
-static void videoCallback(const Camera::VideoChunk &video, void *)
-{
-    narrator.flow.process(video);
-}
-
 int main(int argc, char **argv)
 {
     narrator.runner.setLayout("layouts/window6x12.json");
@@ -28,8 +22,10 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    narrator.setup();
-    Camera::start(videoCallback);
+    if (!narrator.setup()) {
+        return 1;
+    }
+    narrator.startCameras();
     narrator.run();
 
     return 0;
@@ -5,43 +5,273 @@
  * http://creativecommons.org/licenses/by/3.0/
  */
 
+#include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 #include "narrator.h"
 
 
 Narrator::Narrator()
-    : brightness(mixer)
+    : brightness(mixer), scriptThread(0), scriptTurn(false), motionCapture(0),
+      prewarmThread(0), prewarmState(-1),
+      prewarmBusy(false), preparedState(-1), preparedEffect(0)
 {
     runner.setEffect(&brightness);
 }
 
-void Narrator::setup()
+bool Narrator::setup()
 {
-    flow.setConfig(runner.config["flow"]);
+    params.compile(runner.config["narrator"]);
+
+    setupCameras();
+    motionCapture = new CameraFlowCapture(flow);
     brightness.set(0.0f, runner.config["brightnessLimit"].GetDouble());
     mixer.setConcurrency(runner.config["concurrency"].GetUint());
+
+    const rapidjson::Value& degrade = runner.config["crossfadeDegrade"];
+    if (degrade.IsObject()) {
+        ConfigCompiler c(degrade, "crossfadeDegrade");
+        double holdFader = c.number("holdFader");
+        double holdRate = c.number("holdRate");
+        double freezeFader = c.number("freezeFader");
+        if (c.finish()) {
+            mixer.setDegrade(holdFader, holdRate, freezeFader);
+        }
+    }
     runner.setMaxFrameRate(runner.config["fps"].GetDouble());
+    const rapidjson::Value& idleFps = runner.config["idleFps"];
+    runner.setIdleFrameRate(idleFps.IsNumber() ? idleFps.GetDouble() : 10);
+    maxFrameRate = frameRate = runner.config["fps"].GetDouble();
+    frameRateHold = 0;
+    cameraTime = 0;
     currentState = runner.initialState;
 
-    logFile = fopen(runner.config["narrator"]["logFile"].GetString(), "a");
+    // Private copy of the frame geometry, for running effects off the render thread
+    prewarmFrames = params.prewarmFrames;
+    prewarmFrame.init(runner.getLayout(), runner.getTopology(), runner.getZOrder());
+    prewarmFrame.timeDelta = 1.0 / runner.config["fps"].GetDouble();
+
+    logFile = fopen(params.logFile.c_str(), "a");
     if (!logFile) {
         perror("Failed to open narrator log file");
     }
+
+    // Construct every effect now, so their configuration is checked at startup too
+    effects();
+
+    if (ConfigCompiler::totalErrors()) {
+        fprintf(stderr, "Configuration has %d error(s)\n", ConfigCompiler::totalErrors());
+        return false;
+    }
+    return true;
+}
+
+void Narrator::AttentionParams::compile(ConfigCompiler c)
+{
+    bootstrap = c.variable("bootstrap");
+    initial = c.variable("initial");
+    brightnessDeltaMin = c.variable("brightnessDeltaMin");
+    brightnessAverageMin = c.variable("brightnessAverageMin");
+    rateBaseline = c.variable("rateBaseline");
+    rateDark = c.variable("rateDark");
+    rateStill = c.variable("rateStill");
+    c.finish();
+}
+
+void Narrator::FrameRateParams::compile(ConfigCompiler c)
+{
+    enabled = c.boolean("enabled");
+    minFps = c.number("minFps");
+    brightnessDelta = c.number("brightnessDelta");
+    motion = c.number("motion");
+    holdTime = c.number("holdTime");
+    fallTime = c.number("fallTime");
+    c.finish();
+}
+
+void Narrator::Params::compile(const rapidjson::Value &config)
+{
+    ConfigCompiler c(config, "narrator");
+
+    logFile = c.string("logFile");
+    prewarmFrames = c.uint("prewarmFrames", 1);
+    adaptiveFps.compile(c.object("adaptiveFps"));
+
+    ConfigCompiler opening = c.object("opening");
+    openingDate = opening.string("date");
+    openingNextState = opening.integer("nextState");
+    opening.finish();
+
+    precursorBootstrap = c.variable("precursorBootstrap");
+    precursorCrossfade = c.variable("precursorCrossfade");
+
+    bangCount = c.variable("bangCount");
+    bangCrossfadeDuration = c.variable("bangCrossfadeDuration");
+    bangDelayBasis = c.variable("bangDelayBasis");
+    bangSeedRadius = c.variable("bangSeedRadius");
+    bangAttention.compile(c.object("bangAttention"));
+
+    ringsACrossfade = c.variable("ringsA-Crossfade");
+    ringsAAttention.compile(c.object("ringsA-Attention"));
+    ringsBCrossfade = c.variable("ringsB-Crossfade");
+    ringsBAttention.compile(c.object("ringsB-Attention"));
+    ringsCCrossfade = c.variable("ringsC-Crossfade");
+    ringsCAttention.compile(c.object("ringsC-Attention"));
+
+    orderCrossfade = c.variable("orderCrossfade");
+    orderStepAttention.compile(c.object("orderStepAttention"));
+    partnerCrossfade = c.variable("partnerCrossfade");
+    partnerAttention.compile(c.object("partnerAttention"));
+    forestCrossfade = c.variable("forestCrossfade");
+    forestAttention.compile(c.object("forestAttention"));
+
+    c.finish();
 }    
 
-void Narrator::run()
+void Narrator::setupCameras()
 {
-    PRNG prng;
+    // Camera names from the command line take priority over the config file.
+    // Either way, the Nth entry in "cameras" may override the flow transform
+    // for the Nth camera, so that each viewpoint maps into model coordinates.
+    // Simulations can't use real-time cameras, so they default to synthetic video.
+
+    const rapidjson::Value& cameraConfig = runner.config["cameras"];
+    std::vector<std::string> names = runner.cameraDevices;
+
+    if (names.empty() && runner.simulate) {
+        names.push_back("synthetic");
+    }
+    if (names.empty() && cameraConfig.IsArray()) {
+        for (unsigned i = 0; i < cameraConfig.Size(); i++) {
+            names.push_back(cameraConfig[i]["device"].GetString());
+        }
+    }
+    if (names.empty()) {
+        names.push_back("usb");
+    }
+
+    for (unsigned i = 0; i < names.size(); i++) {
+        Camera::Device *device = Camera::open(names[i].c_str());
+        if (!device) {
+            fprintf(stderr, "Unknown camera device \"%s\"\n", names[i].c_str());
+            continue;
+        }
+
+        CameraFlowAnalyzer *analyzer = new CameraFlowAnalyzer();
+        analyzer->setConfig(runner.config["flow"]);
+        if (cameraConfig.IsArray() && i < cameraConfig.Size()) {
+            analyzer->setTransform(cameraConfig[i]["transform"]);
+        }
+
+        cameras.push_back(device);
+        flows.push_back(analyzer);
+    }
+
+    // Default fusion is an equally weighted average of all cameras
+    for (unsigned i = 0; i < flows.size(); i++) {
+        flow.add(*flows[i], 1.0f / flows.size());
+    }
+}
 
+void Narrator::startCameras()
+{
+    if (runner.simulate) {
+        // Cameras are stepped from renderFrame() instead. Try one field now, to find
+        // any cameras that can only run in real time.
+        for (unsigned i = 0; i < cameras.size(); i++) {
+            if (!cameras[i]->step(videoCallback, flows[i])) {
+                fprintf(stderr, "Camera %d can't run on simulated time, it will see nothing\n", i);
+            }
+        }
+        return;
+    }
+
+    // Each camera has its own thread, which runs that camera's flow analyzer
+    for (unsigned i = 0; i < cameras.size(); i++) {
+        cameras[i]->start(videoCallback, flows[i]);
+    }
+}
+
+void Narrator::stepCameras(float timeDelta)
+{
+    // Deliver video fields in step with simulated time, at the NTSC field rate
+    const double fieldPeriod = 1.001 / 60.0;
+
+    cameraTime += timeDelta;
+    while (cameraTime >= fieldPeriod) {
+        cameraTime -= fieldPeriod;
+        for (unsigned i = 0; i < cameras.size(); i++) {
+            cameras[i]->step(videoCallback, flows[i]);
+        }
+    }
+}
+
+void Narrator::videoCallback(const Camera::VideoChunk &video, void *context)
+{
+    static_cast<CameraFlowAnalyzer*>(context)->process(video);
+}
+
+CameraFlowFusion Narrator::flowFor(const rapidjson::Value& config)
+{
+    // Effects may bind to one camera by index, otherwise they see all cameras fused
+
+    const rapidjson::Value& camera = config["camera"];
+    if (camera.IsUint() && camera.GetUint() < flows.size()) {
+        return CameraFlowFusion(*flows[camera.GetUint()]);
+    }
+    return flow;
+}
+
+void Narrator::run()
+{
     totalTime = 0;
+    totalCost = 0;
     totalLoops = 0;
+    wallStartTime = time(0);
+
+    scriptThread = new tthread::thread(scriptThreadFunc, this);
+
+    // Central scheduler: one script step, then one frame
+    while (true) {
+        resumeScript();
+        lastFrame = renderFrame();
+    }
+}
+
+void Narrator::scriptThreadFunc(void *context)
+{
+    static_cast<Narrator*>(context)->scriptMain();
+}
+
+void Narrator::scriptMain()
+{
+    PRNG prng;
     prng.seed(time(0));
 
+    // Wait to be resumed the first time
+    scriptLock.lock();
+    while (!scriptTurn) {
+        scriptCond.wait(scriptLock);
+    }
+    scriptLock.unlock();
+
     while (true) {
         currentState = script(currentState, prng);
     }
 }
 
+void Narrator::resumeScript()
+{
+    // Hand control to the script, and wait for it to yield
+    scriptLock.lock();
+    scriptTurn = true;
+    scriptCond.notify_all();
+    while (scriptTurn) {
+        scriptCond.wait(scriptLock);
+    }
+    scriptLock.unlock();
+}
+
 void Narrator::endCycle()
 {
     totalLoops++;
@@ -56,36 +286,119 @@ void Narrator::endCycle()
         formatTime(logFile, totalTime); 
         fprintf(logFile, "  average ");
         formatTime(logFile, totalTime / totalLoops);
-        fprintf(logFile, "\n");
+        fprintf(logFile, "  cost %10.2f s\n", totalCost);
+        if (runner.simulate) {
+            fprintf(logFile, "      simulated, wall time ");
+            formatTime(logFile, difftime(time(0), wallStartTime));
+            fprintf(logFile, "\n");
+        }
 
         for (std::map<int, double>::iterator it = singleStateTime.begin(); it != singleStateTime.end(); it++) {
+            double cost = singleStateCost[it->first];
+            unsigned frames = singleStateFrames[it->first];
+
             fprintf(logFile, "state %-3d  total ", it->first);
             formatTime(logFile, it->second);
             fprintf(logFile, "  average ");
             formatTime(logFile, it->second / totalLoops);
-            fprintf(logFile, "\n");
+            fprintf(logFile, "  cost %10.2f s  %7.3f ms/frame\n", cost, frames ? 1e3 * cost / frames : 0.0);
         } 
 
         fprintf(logFile, "Total loops: %d\n", totalLoops);
         fprintf(logFile, "----\n");
         fflush(logFile);
     }
+
+    if (runner.simulateCycles && totalLoops >= runner.simulateCycles) {
+        fprintf(stderr, "Simulation finished after %d cycles\n", totalLoops);
+
+        // We're on the script thread, with the scheduler, prewarm and mixer threads
+        // still waiting on their condition variables. exit() would run static
+        // destructors that block destroying those, so flush and leave immediately.
+        fflush(NULL);
+        _exit(0);
+    }
 }
 
 EffectRunner::FrameStatus Narrator::doFrame()
 {
-    EffectRunner::FrameStatus st = runner.doFrame();
+    // Called by the script. Yield to the scheduler, which renders one frame
+    // before resuming us.
+
+    scriptLock.lock();
+    scriptTurn = false;
+    scriptCond.notify_all();
+    while (!scriptTurn) {
+        scriptCond.wait(scriptLock);
+    }
+    scriptLock.unlock();
+
+    return lastFrame;
+}
+
+EffectRunner::FrameStatus Narrator::renderFrame()
+{
+    EffectRunner::FrameStatus st;
+
+    if (runner.simulate) {
+        // Simulated time advances at whatever rate we'd be rendering at
+        stepCameras(1.0f / frameRate);
+        st = runner.doFrame(1.0f / frameRate);
+    } else {
+        st = runner.doFrame();
+    }
+
+    adaptFrameRate(st.timeDelta);
 
     totalTime += st.timeDelta;
+    totalCost += st.busyTime;
     singleStateTime[currentState] += st.timeDelta;
+    singleStateCost[currentState] += st.busyTime;
+    singleStateFrames[currentState]++;
 
     if (st.debugOutput && runner.isVerbose()) {
         fprintf(stderr, "\t[narrator] state = %d\n", currentState);
+        fprintf(stderr, "\t[narrator] target fps = %.1f, motion = %f\n", frameRate, audienceMotion());
     }
 
     return st;
 }
 
+void Narrator::adaptFrameRate(float timeDelta)
+{
+    // Back to full rate on the next frame when anything is moving. Once things
+    // have been still for a while, ease down toward the minimum rate.
+
+    const FrameRateParams &p = params.adaptiveFps;
+    if (!p.enabled) {
+        return;
+    }
+
+    if (brightnessDelta() > p.brightnessDelta || audienceMotion() > p.motion) {
+        frameRateHold = p.holdTime;
+        frameRate = maxFrameRate;
+    } else if ((frameRateHold -= timeDelta) <= 0) {
+        frameRateHold = 0;
+        frameRate += (p.minFps - frameRate) * std::min(1.0f, timeDelta / p.fallTime);
+    }
+
+    runner.setTargetFrameRate(frameRate);
+}
+
+float Narrator::brightnessDelta() const
+{
+    // The brightness change between frames grows with the square of the frame
+    // period. Scale it to what we'd see at full rate, so thresholds mean the
+    // same thing no matter how fast we're rendering.
+    return brightness.getTotalBrightnessDelta() * sq(frameRate / maxFrameRate);
+}
+
+float Narrator::audienceMotion() const
+{
+    // Strongest motion seen by any camera
+    return motionCapture ? motionCapture->instantaneousMotion() : 0;
+}
+
 void Narrator::crossfade(Effect *to, float duration)
 {
     int n = mixer.numChannels();
@@ -102,7 +415,89 @@ void Narrator::crossfade(Effect *to, float duration)
     mixer.set(to);
 }
 
-void Narrator::delayUntilDate(const rapidjson::Value& target)
+void Narrator::prewarm(int st, PRNG &prng)
+{
+    // Start preparing the effect for state 'st' in the background.
+    // Only one state is prepared at a time; a newer request replaces an older one.
+
+    if (!prewarmThread) {
+        prewarmThread = new tthread::thread(prewarmThreadFunc, this);
+    }
+
+    prewarmLock.lock();
+    prewarmState = st;
+    prewarmSeed = prng.uniform32();
+    prewarmCond.notify_all();
+    prewarmLock.unlock();
+}
+
+Effect* Narrator::prepare(int st, PRNG &prng)
+{
+    // Get the effect for state 'st' ready to crossfade in. If it was
+    // prewarmed, wait for that to finish. Otherwise, prepare it here.
+
+    prewarmLock.lock();
+    while (prewarmBusy || (prewarmState == st && preparedState != st)) {
+        prewarmCond.wait(prewarmLock);
+    }
+
+    Effect *effect = 0;
+    if (preparedState == st) {
+        effect = preparedEffect;
+    }
+    preparedState = -1;
+    preparedEffect = 0;
+    prewarmLock.unlock();
+
+    return effect ? effect : prepareState(st, prng.uniform32());
+}
+
+void Narrator::prewarmThreadFunc(void *context)
+{
+    static_cast<Narrator*>(context)->prewarmWorker();
+}
+
+void Narrator::prewarmWorker()
+{
+    while (true) {
+        prewarmLock.lock();
+        while (prewarmState < 0) {
+            prewarmCond.wait(prewarmLock);
+        }
+        int st = prewarmState;
+        unsigned seed = prewarmSeed;
+        prewarmState = -1;
+        preparedState = -1;
+        prewarmBusy = true;
+        prewarmLock.unlock();
+
+        // Reseed, then run a few frames so buffers are allocated, indices built,
+        // and textures touched before the render thread ever sees this effect.
+
+        Effect *effect = prepareState(st, seed);
+        if (effect) {
+            for (unsigned i = 0; i < prewarmFrames; i++) {
+                effect->beginFrame(prewarmFrame);
+                for (Effect::PixelInfoIter p = prewarmFrame.pixels.begin(), e = prewarmFrame.pixels.end(); p != e; ++p) {
+                    if (p->isMapped()) {
+                        Vec3 rgb(0, 0, 0);
+                        effect->shader(rgb, *p);
+                    }
+                }
+                effect->endFrame(prewarmFrame);
+            }
+        }
+
+        prewarmLock.lock();
+        preparedState = st;
+        preparedEffect = effect;
+        prewarmBusy = false;
+        prewarmCond.notify_all();
+        prewarmLock.unlock();
+    }
+}
+
+void Narrator::delayUntilDate(const std::string& target)
 {
     while (true) {
         double t = secondsAfterDate(target);
@@ -113,7 +508,7 @@ void Narrator::delayUntilDate(const rapidjson::Value& target)
         EffectRunner::FrameStatus st = doFrame();
         if (st.debugOutput && runner.isVerbose()) {
             fprintf(stderr, "\t[delay] %f seconds left until date %s\n",
-                -t, target.GetString());
+                -t, target.c_str());
         }
     }
 }
@@ -144,20 +539,15 @@ void Narrator::formatTime(FILE *f, double s)
     fprintf(f, "%4d:%02d:%05.2f", (int)s / (60*60), ((int)s / 60) % 60, fmod(s, 60));
 } 
 
-double Narrator::secondsAfterDate(const rapidjson::Value& target)
+double Narrator::secondsAfterDate(const std::string& target)
 {
-    if (!target.IsString()) {
-        fprintf(stderr, "Configured date is not a JSON String object\n");
-        return 0;
-    }
-
     time_t tNow = time(NULL);
     struct tm tmTarget;
     localtime_r(&tNow, &tmTarget);
 
-    char *result = strptime(target.GetString(), "%Y-%m-%dT%H:%M:%S", &tmTarget);
+    char *result = strptime(target.c_str(), "%Y-%m-%dT%H:%M:%S", &tmTarget);
     if (!result || *result) {
-        fprintf(stderr, "Cannot parse \"%s\" as a date\n", target.GetString());
+        fprintf(stderr, "Cannot parse \"%s\" as a date\n", target.c_str());
         return 0;
     }        
 
@@ -166,7 +556,7 @@ double Narrator::secondsAfterDate(const rapidjson::Value& target)
 }
 
 Narrator::NEffectRunner::NEffectRunner()
-    : initialState(0)
+    : initialState(0), simulate(false), simulateCycles(0)
 {
     if (!setConfig("data/config.json")) {
         fprintf(stderr, "Can't load default configuration file\n");
@@ -180,6 +570,22 @@ bool Narrator::NEffectRunner::parseArgument(int &i, int &argc, char **argv)
         return true;
     }
 
+    if (!strcmp(argv[i], "-camera") && (i+1 < argc)) {
+        cameraDevices.push_back(argv[++i]);
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-simulate")) {
+        simulate = true;
+        setHeadless();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-cycles") && (i+1 < argc)) {
+        simulateCycles = atoi(argv[++i]);
+        return true;
+    }
+
     if (!strcmp(argv[i], "-config") && (i+1 < argc)) {
         if (!setConfig(argv[++i])) {
             fprintf(stderr, "Can't load config from %s\n", argv[i]);
@@ -194,7 +600,7 @@ bool Narrator::NEffectRunner::parseArgument(int &i, int &argc, char **argv)
 void Narrator::NEffectRunner::argumentUsage()
 {
     EffectRunner::argumentUsage();
-    fprintf(stderr, " [-state ST] [-config FILE.json]");
+    fprintf(stderr, " [-state ST] [-config FILE.json] [-camera DEVICE ...] [-simulate [-cycles N]]");
 }
 
 bool Narrator::NEffectRunner::validateArguments()
@@ -225,26 +631,26 @@ bool Narrator::NEffectRunner::setConfig(const char *filename)
     return true;
 }
 
-void Narrator::attention(Sampler &s, const rapidjson::Value& config)
+void Narrator::attention(Sampler &s, const AttentionParams& config)
 {
     // Keep running until we run out of attention for the current scene.
     // Attention amounts and retention parameters come from JSON, and we show
     // our state during debug debug output.
 
-    float bootstrap = s.value(config["bootstrap"]);
-    float attention = s.value(config["initial"]);
-    float brightnessDeltaMin = s.value(config["brightnessDeltaMin"]);
-    float brightnessAverageMin = s.value(config["brightnessAverageMin"]);
-    float rateBaseline = s.value(config["rateBaseline"]);
-    float rateDark = s.value(config["rateDark"]);
-    float rateStill = s.value(config["rateStill"]);
+    float bootstrap = s.value(config.bootstrap);
+    float attention = s.value(config.initial);
+    float brightnessDeltaMin = s.value(config.brightnessDeltaMin);
+    float brightnessAverageMin = s.value(config.brightnessAverageMin);
+    float rateBaseline = s.value(config.rateBaseline);
+    float rateDark = s.value(config.rateDark);
+    float rateStill = s.value(config.rateStill);
 
     delay(bootstrap);
 
     while (attention > 0) {
         EffectRunner::FrameStatus st = doFrame();
 
-        float brightnessDelta = brightness.getTotalBrightnessDelta();
+        float brightnessDelta = this->brightnessDelta();
         float brightnessAverage = brightness.getAverageBrightness();
 
         float rate = rateBaseline
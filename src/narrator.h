@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
 #include "lib/rapidjson/rapidjson.h"
 #include "lib/rapidjson/document.h"
 #include "lib/effect.h"
@@ -15,8 +17,11 @@
 #include "lib/effect_tap.h"
 #include "lib/prng.h"
 #include "lib/sampler.h"
+#include "lib/config_compiler.h"
+#include "lib/camera.h"
 #include "lib/camera_flow.h"
 #include "lib/brightness.h"
+#include "lib/tinythread.h"
 
 
 class Narrator
@@ -32,6 +37,13 @@ public:
         int initialState;
         rapidjson::Document config;
 
+        // Camera device names from the command line, overriding the config file
+        std::vector<std::string> cameraDevices;
+
+        // Fast-forward on simulated time, optionally stopping after some number of cycles
+        bool simulate;
+        unsigned simulateCycles;
+
     protected:
         virtual bool parseArgument(int &i, int &argc, char **argv);
         virtual void argumentUsage();
@@ -40,31 +52,157 @@ public:
 
     Narrator();
 
-    void setup();
+    bool setup();
+    void startCameras();
     void run();
 
-    CameraFlowAnalyzer flow;
+    // One camera device and flow analyzer per viewpoint
+    std::vector<Camera::Device*> cameras;
+    std::vector<CameraFlowAnalyzer*> flows;
+
+    // Motion from all cameras, fused together
+    CameraFlowFusion flow;
     NEffectRunner runner;
     EffectMixer mixer;
     Brightness brightness;
 
 private:
+    struct ScriptEffects;
+
+    // Parameters for one attention() loop
+    struct AttentionParams {
+        void compile(ConfigCompiler c);
+
+        Sampler::Variable bootstrap;
+        Sampler::Variable initial;
+        Sampler::Variable brightnessDeltaMin;
+        Sampler::Variable brightnessAverageMin;
+        Sampler::Variable rateBaseline;
+        Sampler::Variable rateDark;
+        Sampler::Variable rateStill;
+    };
+
+    // Parameters for lowering the frame rate while nothing is changing
+    struct FrameRateParams {
+        void compile(ConfigCompiler c);
+
+        bool enabled;
+        float minFps;
+        float brightnessDelta;  // Normalized like brightnessDelta(), below this is still
+        float motion;           // Instantaneous camera motion, below this is still
+        float holdTime;         // Seconds of stillness before slowing down
+        float fallTime;         // Time constant for easing down to minFps
+    };
+
+    // Script parameters, compiled from the "narrator" config at setup time
+    struct Params {
+        void compile(const rapidjson::Value &config);
+
+        std::string logFile;
+        unsigned prewarmFrames;
+        FrameRateParams adaptiveFps;
+        std::string openingDate;
+        int openingNextState;
+
+        Sampler::Variable precursorBootstrap;
+        Sampler::Variable precursorCrossfade;
+
+        Sampler::Variable bangCount;
+        Sampler::Variable bangCrossfadeDuration;
+        Sampler::Variable bangDelayBasis;
+        Sampler::Variable bangSeedRadius;
+        AttentionParams bangAttention;
+
+        Sampler::Variable ringsACrossfade;
+        AttentionParams ringsAAttention;
+        Sampler::Variable ringsBCrossfade;
+        AttentionParams ringsBAttention;
+        Sampler::Variable ringsCCrossfade;
+        AttentionParams ringsCAttention;
+
+        Sampler::Variable orderCrossfade;
+        AttentionParams orderStepAttention;
+        Sampler::Variable partnerCrossfade;
+        AttentionParams partnerAttention;
+        Sampler::Variable forestCrossfade;
+        AttentionParams forestAttention;
+    };
+
+    Params params;
+
     int script(int st, PRNG &prng);
+    ScriptEffects& effects();
+    Effect* prepareState(int st, unsigned seed);
+    void setupCameras();
+    CameraFlowFusion flowFor(const rapidjson::Value& config);
+    static void videoCallback(const Camera::VideoChunk &video, void *context);
+
+    // The script is a coroutine. It runs on its own thread, but never at the
+    // same time as rendering: run() is the one central scheduler, and each frame
+    // it resumes the script until the script yields in doFrame(), then renders.
     EffectRunner::FrameStatus doFrame();
+    void resumeScript();
+    void scriptMain();
+    static void scriptThreadFunc(void *context);
+    EffectRunner::FrameStatus renderFrame();
+    void stepCameras(float timeDelta);
+
+    // Scene change and audience motion, for deciding how fast to render
+    void adaptFrameRate(float timeDelta);
+    float brightnessDelta() const;
+    float audienceMotion() const;
     void endCycle();
 
     void crossfade(Effect *to, float duration);
     void delay(float seconds);
     void delayForever();
-    void attention(Sampler &s, const rapidjson::Value& config);
-    void delayUntilDate(const rapidjson::Value& target);
+    void attention(Sampler &s, const AttentionParams& config);
+    void delayUntilDate(const std::string& target);
+
+    // Getting the next state's effect ready on a worker thread, so its
+    // reseed and first frames don't hitch the render loop. The effect
+    // being prewarmed must not be one that's currently in the mixer.
+    void prewarm(int st, PRNG &prng);
+    Effect* prepare(int st, PRNG &prng);
+    static void prewarmThreadFunc(void *context);
+    void prewarmWorker();
 
-    static double secondsAfterDate(const rapidjson::Value& target);
+    static double secondsAfterDate(const std::string& target);
     static void formatTime(FILE *f, double s);
 
     FILE *logFile;
     unsigned totalLoops;
     double totalTime;
+    double totalCost;
     std::map<int, double> singleStateTime;
+    std::map<int, double> singleStateCost;
+    std::map<int, unsigned> singleStateFrames;
     int currentState;
+
+    tthread::thread *scriptThread;
+    tthread::mutex scriptLock;
+    tthread::condition_variable scriptCond;
+    bool scriptTurn;        // Script is running, scheduler is waiting
+    EffectRunner::FrameStatus lastFrame;
+
+    // Adaptive frame rate
+    float maxFrameRate;
+    float frameRate;
+    float frameRateHold;
+    CameraFlowCapture *motionCapture;
+
+    // Simulation
+    double cameraTime;
+    time_t wallStartTime;
+
+    tthread::thread *prewarmThread;
+    tthread::mutex prewarmLock;
+    tthread::condition_variable prewarmCond;
+    Effect::FrameInfo prewarmFrame;
+    unsigned prewarmFrames;
+    int prewarmState;       // Requested state, or -1 if idle
+    unsigned prewarmSeed;
+    bool prewarmBusy;
+    int preparedState;      // State whose effect is ready, or -1
+    Effect *preparedEffect;
 };
@@ -16,21 +16,104 @@
 #include "darkness.h"
 
 
+struct Narrator::ScriptEffects
+{
+    ScriptEffects(Narrator &n)
+        : chaosA(n.flowFor(n.runner.config["chaosParticles"]), n.runner.config["chaosParticles"]),
+          chaosB(n.flowFor(n.runner.config["chaosParticles"]), n.runner.config["chaosParticles"]),
+          orderParticles(n.flowFor(n.runner.config["orderParticles"]), n.runner.config["orderParticles"]),
+          precursor(n.flowFor(n.runner.config["precursor"]), n.runner.config["precursor"]),
+          ringsA(n.flowFor(n.runner.config["ringsA"]), n.runner.config["ringsA"]),
+          ringsB(n.flowFor(n.runner.config["ringsB"]), n.runner.config["ringsB"]),
+          ringsC(n.flowFor(n.runner.config["ringsC"]), n.runner.config["ringsC"]),
+          partnerDance(n.flowFor(n.runner.config["partnerDance"]), n.runner.config["partnerDance"]),
+          flowDebugEffect(n.flowFor(n.runner.config["flowDebugEffect"]), n.runner.config["flowDebugEffect"]),
+          forest(n.flowFor(n.runner.config["forest"]), n.runner.config["forest"])
+    {}
+
+    ChaosParticles chaosA;
+    ChaosParticles chaosB;
+    OrderParticles orderParticles;
+    Precursor precursor;
+    RingsEffect ringsA;
+    RingsEffect ringsB;
+    RingsEffect ringsC;
+    PartnerDance partnerDance;
+    CameraFlowDebugEffect flowDebugEffect;
+    Forest forest;
+    DarknessEffect darkness;
+};
+
+
+Narrator::ScriptEffects& Narrator::effects()
+{
+    static ScriptEffects e(*this);
+    return e;
+}
+
+Effect* Narrator::prepareState(int st, unsigned seed)
+{
+    // Reseed the effect that state 'st' fades in first, and return it.
+    // This may run on the prewarm thread, so it only touches that one effect.
+
+    ScriptEffects &e = effects();
+    const Params& config = params;
+    PRNG prng;
+    prng.seed(seed);
+    Sampler s(prng.uniform32());
+
+    switch (st) {
+
+        case 2:
+        case 10:
+            e.precursor.reseed(prng.uniform32());
+            return &e.precursor;
+
+        case 20:
+            e.chaosA.reseed(prng.circularVector() * s.value(config.bangSeedRadius), prng.uniform32());
+            return &e.chaosA;
+
+        case 30:
+            e.ringsA.reseed(prng.uniform32());
+            return &e.ringsA;
+
+        case 40:
+            e.ringsB.reseed(prng.uniform32());
+            return &e.ringsB;
+
+        case 50:
+            e.orderParticles.reseed(prng.uniform32());
+            e.orderParticles.symmetry = 10;
+            return &e.orderParticles;
+
+        case 60:
+            e.partnerDance.reseed(prng.uniform32());
+            return &e.partnerDance;
+
+        case 70:
+            e.ringsC.reseed(prng.uniform32());
+            return &e.ringsC;
+
+        case 80:
+            e.forest.reseed(prng.uniform32());
+            return &e.forest;
+
+        default:
+            return 0;
+    }
+}
+
 int Narrator::script(int st, PRNG &prng)
 {
-    static ChaosParticles chaosA(flow, runner.config["chaosParticles"]);
-    static ChaosParticles chaosB(flow, runner.config["chaosParticles"]);
-    static OrderParticles orderParticles(flow, runner.config["orderParticles"]);
-    static Precursor precursor(flow, runner.config["precursor"]);
-    static RingsEffect ringsA(flow, runner.config["ringsA"]);
-    static RingsEffect ringsB(flow, runner.config["ringsB"]);
-    static RingsEffect ringsC(flow, runner.config["ringsC"]);
-    static PartnerDance partnerDance(flow, runner.config["partnerDance"]);
-    static CameraFlowDebugEffect flowDebugEffect(flow, runner.config["flowDebugEffect"]);
-    static Forest forest(flow, runner.config["forest"]);
-    static DarknessEffect darkness;
-
-    rapidjson::Value& config = runner.config["narrator"];
+    ScriptEffects &e = effects();
+    ChaosParticles &chaosA = e.chaosA;
+    ChaosParticles &chaosB = e.chaosB;
+    OrderParticles &orderParticles = e.orderParticles;
+    Precursor &precursor = e.precursor;
+    CameraFlowDebugEffect &flowDebugEffect = e.flowDebugEffect;
+    DarknessEffect &darkness = e.darkness;
+
+    const Params& config = params;
     Sampler s(prng.uniform32());
 
     switch (st) {
@@ -46,8 +129,7 @@ int Narrator::script(int st, PRNG &prng)
 
         case 2: {
             // Precursor only (sleep mode)            
-            precursor.reseed(prng.uniform32());
-            crossfade(&precursor, 1);
+            crossfade(prepare(st, prng), 1);
             delayForever();
         }
 
@@ -64,8 +146,9 @@ int Narrator::script(int st, PRNG &prng)
             // Darkness until opening
 
             crossfade(&darkness, 1);
-            delayUntilDate(config["opening"]["date"]);
-            return config["opening"]["nextState"].GetInt();
+            prewarm(config.openingNextState, prng);
+            delayUntilDate(config.openingDate);
+            return config.openingNextState;
         }
 
         //////////////////////////////////////////////////////////////////////////////////////////////
@@ -78,11 +161,11 @@ int Narrator::script(int st, PRNG &prng)
 
         case 10: {
             // Order trying to form out of the tiniest sparks; runs for an unpredictable time, fails.
-            precursor.reseed(prng.uniform32());
-            crossfade(&precursor, s.value(config["precursorCrossfade"]));
+            crossfade(prepare(st, prng), s.value(config.precursorCrossfade));
+            prewarm(20, prng);
 
             // Bootstrap
-            delay(s.value(config["precursorBootstrap"]));
+            delay(s.value(config.precursorBootstrap));
 
             // Wait for darkness
             while (!precursor.isDone) {
@@ -97,46 +180,51 @@ int Narrator::script(int st, PRNG &prng)
             ChaosParticles *pChaosA = &chaosA;
             ChaosParticles *pChaosB = &chaosB;
             
-            int bangCount = s.value(config["bangCount"]);
+            int bangCount = s.value(config.bangCount);
             for (int i = 0; i < bangCount; i++) {
-                pChaosA->reseed(prng.circularVector() * s.value(config["bangSeedRadius"]), prng.uniform32());
-                crossfade(pChaosA, s.value(config["bangCrossfadeDuration"]));
-                delay((1 << i) * s.value(config["bangDelayBasis"]));
+                if (i == 0) {
+                    // First bang is chaosA, prewarmed
+                    crossfade(prepare(st, prng), s.value(config.bangCrossfadeDuration));
+                } else {
+                    pChaosA->reseed(prng.circularVector() * s.value(config.bangSeedRadius), prng.uniform32());
+                    crossfade(pChaosA, s.value(config.bangCrossfadeDuration));
+                }
+                delay((1 << i) * s.value(config.bangDelayBasis));
                 std::swap(pChaosA, pChaosB);
             }
 
-            attention(s, config["bangAttention"]);
+            prewarm(30, prng);
+            attention(s, config.bangAttention);
 
             return 30;
         }
 
         case 30: {
             // Textures of light, exploring something formless. Slow crossfade in
-            ringsA.reseed(prng.uniform32());
-            crossfade(&ringsA, s.value(config["ringsA-Crossfade"]));
-            attention(s, config["ringsA-Attention"]);
+            crossfade(prepare(st, prng), s.value(config.ringsACrossfade));
+            prewarm(40, prng);
+            attention(s, config.ringsAAttention);
             return 40;
         }
 
         case 40: {
             // Add energy, explore another layer.
-            ringsB.reseed(prng.uniform32());
-            crossfade(&ringsB, s.value(config["ringsB-Crossfade"]));
-            attention(s, config["ringsB-Attention"]);
+            crossfade(prepare(st, prng), s.value(config.ringsBCrossfade));
+            prewarm(50, prng);
+            attention(s, config.ringsBAttention);
             return 50;
         }
 
         case 50: {
             // Biology happens, order emerges. Cellular look, emergent order.
 
-            orderParticles.reseed(prng.uniform32());
-            orderParticles.symmetry = 10;
-            crossfade(&orderParticles, s.value(config["orderCrossfade"]));
+            crossfade(prepare(st, prng), s.value(config.orderCrossfade));
+            prewarm(60, prng);
             while (orderParticles.symmetry > 4) {
-                attention(s, config["orderStepAttention"]);
+                attention(s, config.orderStepAttention);
                 orderParticles.symmetry--;
             }
-            attention(s, config["orderStepAttention"]);
+            attention(s, config.orderStepAttention);
             return 60;
         }
 
@@ -145,18 +233,18 @@ int Narrator::script(int st, PRNG &prng)
             // Spiralling inwards. Depression. Beauty on the edge of destruction,
             // pressing forward until nothing remains.
 
-            partnerDance.reseed(prng.uniform32());
-            crossfade(&partnerDance, s.value(config["partnerCrossfade"]));
-            attention(s, config["partnerAttention"]);
+            crossfade(prepare(st, prng), s.value(config.partnerCrossfade));
+            prewarm(70, prng);
+            attention(s, config.partnerAttention);
             return 70;
         }
 
         case 70: {
             // Sinking deeper. Interlude before a change.
 
-            ringsC.reseed(prng.uniform32());
-            crossfade(&ringsC, s.value(config["ringsC-Crossfade"]));
-            attention(s, config["ringsC-Attention"]);
+            crossfade(prepare(st, prng), s.value(config.ringsCCrossfade));
+            prewarm(80, prng);
+            attention(s, config.ringsCAttention);
             return 80;
         }
 
@@ -164,9 +252,11 @@ int Narrator::script(int st, PRNG &prng)
             // Continuous renewal and regrowth. Destruction happens unintentionally,
             // regrowth is quick and generative. The only way to lose is to stagnate.
 
-            forest.reseed(prng.uniform32());
-            crossfade(&forest, s.value(config["forestCrossfade"]));
-            attention(s, config["forestAttention"]);
+            crossfade(prepare(st, prng), s.value(config.forestCrossfade));
+
+            // State 90 ends the cycle and goes straight back to 10
+            prewarm(10, prng);
+            attention(s, config.forestAttention);
             return 90;
         }
     }
@@ -0,0 +1,230 @@
+/*
+ * Shared memory to OPC bridge.
+ *
+ * The other end of OPCClient's "shm:" transport. Waits for a renderer to
+ * connect on a Unix domain socket, maps the frame ring it hands over, and
+ * forwards the newest frame to an ordinary OPC server whenever the doorbell
+ * rings. So fcserver needs no changes, while the renderer itself never
+ * blocks on a socket.
+ *
+ * Or, with a "udp:" listen address, the far end of the datagram transport:
+ * it runs next to fcserver, reassembles sequenced frames from the network,
+ * drops stale ones, and forwards the rest over local TCP.
+ *
+ *    opc-bridge [-listen PATH | udp:HOST[:PORT]] [-server HOST[:PORT]] [-v]
+ *    ei -server shm:PATH
+ *    ei -server udp:HOST[:PORT]
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "lib/opc_client.h"
+
+
+static int listenOn(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left over from an earlier run
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof addr) < 0 || listen(fd, 1) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static void forward(int client, OPCClient &server, bool verbose)
+{
+    int memFd, eventFd;
+    OPCSharedRing ring;
+
+    if (!OPCSharedRing::receiveDescriptors(client, memFd, eventFd) || !ring.attach(memFd, eventFd)) {
+        fprintf(stderr, "opc-bridge: Client didn't send a usable frame ring\n");
+        return;
+    }
+
+    std::vector<uint8_t> frame;
+    unsigned frames = 0;
+    struct timeval lastReport;
+    gettimeofday(&lastReport, 0);
+
+    while (true) {
+        struct pollfd pfd[2];
+        pfd[0].fd = ring.getEventFd();
+        pfd[0].events = POLLIN;
+        pfd[1].fd = client;
+        pfd[1].events = POLLIN;
+
+        if (poll(pfd, 2, 1000) < 0) {
+            perror("opc-bridge: poll");
+            return;
+        }
+        if (pfd[1].revents) {
+            // Client hung up; nothing else ever arrives on this socket
+            return;
+        }
+
+        if (ring.readLatest(frame)) {
+            // If the server is down, drop frames and keep trying
+            server.write(frame);
+            frames++;
+        }
+
+        if (verbose) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            if (now.tv_sec != lastReport.tv_sec) {
+                fprintf(stderr, "opc-bridge: %d frames forwarded, %d skipped\n", frames, ring.skipped);
+                lastReport = now;
+                frames = 0;
+                ring.skipped = 0;
+            }
+        }
+    }
+}
+
+static int bindDatagram(const char *hostport)
+{
+    // HOST[:PORT], after the "udp:" prefix
+
+    char *host = strdup(hostport);
+    char *colon = strchr(host, ':');
+    int port = 7890;
+    if (colon) {
+        *colon = '\0';
+        port = strtol(colon + 1, 0, 10);
+    }
+
+    struct addrinfo hints, *addr;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = PF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int fd = -1;
+    if (getaddrinfo(*host ? host : "0.0.0.0", 0, &hints, &addr) == 0) {
+        struct sockaddr_in address;
+        memcpy(&address, addr->ai_addr, sizeof address);
+        address.sin_port = htons(port);
+        freeaddrinfo(addr);
+
+        fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd >= 0 && bind(fd, (struct sockaddr*) &address, sizeof address) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    free(host);
+    return fd;
+}
+
+static void forwardDatagrams(const char *address, OPCClient &server, bool verbose)
+{
+    int fd = bindDatagram(address + 4);
+    if (fd < 0) {
+        perror("Can't listen for datagrams");
+        return;
+    }
+
+    OPCDatagram::Receiver receiver;
+    std::vector<uint8_t> frame;
+    struct timeval lastReport;
+    gettimeofday(&lastReport, 0);
+
+    while (true) {
+        uint8_t datagram[OPCDatagram::kMaxDatagram];
+        ssize_t result = recv(fd, datagram, sizeof datagram, 0);
+        if (result < 0) {
+            perror("opc-bridge: recv");
+            return;
+        }
+
+        if (receiver.receive(datagram, result, frame)) {
+            server.write(frame);
+        }
+
+        if (verbose) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            if (now.tv_sec != lastReport.tv_sec) {
+                fprintf(stderr, "opc-bridge: %d frames forwarded, %d lost, %d stale datagrams\n",
+                    receiver.frames, receiver.lost, receiver.stale);
+                lastReport = now;
+                receiver.resetCounters();
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/tmp/ei-opc.sock";
+    const char *serverAddress = "localhost";
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-listen") && i + 1 < argc) {
+            path = argv[++i];
+        } else if (!strcmp(argv[i], "-server") && i + 1 < argc) {
+            serverAddress = argv[++i];
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "usage: %s [-listen PATH | udp:HOST[:PORT]] [-server HOST[:PORT]] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    OPCClient server;
+    if (!server.resolve(serverAddress)) {
+        fprintf(stderr, "Can't resolve server name %s\n", serverAddress);
+        return 1;
+    }
+
+    if (!strncmp(path, "udp:", 4)) {
+        forwardDatagrams(path, server, verbose);
+        return 1;
+    }
+
+    int listenFd = listenOn(path);
+    if (listenFd < 0) {
+        perror("Can't listen on Unix domain socket");
+        return 1;
+    }
+
+    while (true) {
+        int client = accept(listenFd, 0, 0);
+        if (client < 0) {
+            perror("opc-bridge: accept");
+            return 1;
+        }
+        if (verbose) {
+            fprintf(stderr, "opc-bridge: Renderer connected\n");
+        }
+
+        forward(client, server, verbose);
+        close(client);
+
+        if (verbose) {
+            fprintf(stderr, "opc-bridge: Renderer disconnected\n");
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Stand-in OPC server.
+ *
+ * Listens where fcserver would, and prints frame rate, jitter, throughput
+ * and dropped frames for whatever it receives, once per interval. Handy for
+ * running the show without any LED hardware, and for seeing how evenly
+ * frames actually leave the renderer.
+ *
+ *    opc-sink [-listen HOST[:PORT]] [-interval SECONDS] [-time SECONDS] [-log FILE]
+ *
+ * The log has one tab-separated line per message: arrival time, channel,
+ * command, payload length, and payload checksum.
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib/opc_sink.h"
+
+
+int main(int argc, char **argv)
+{
+    const char *listenAddress = "127.0.0.1";
+    const char *logFile = 0;
+    float interval = 1.0;
+    float duration = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-listen") && i + 1 < argc) {
+            listenAddress = argv[++i];
+        } else if (!strcmp(argv[i], "-interval") && i + 1 < argc) {
+            interval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-time") && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-log") && i + 1 < argc) {
+            logFile = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-listen HOST[:PORT]] [-interval SECONDS] "
+                "[-time SECONDS] [-log FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *log = 0;
+    if (logFile && !(log = fopen(logFile, "w"))) {
+        perror("Can't open log file");
+        return 1;
+    }
+
+    OPCSink sink;
+    if (!sink.listen(listenAddress)) {
+        perror("Can't listen for OPC connections");
+        return 1;
+    }
+    fprintf(stderr, "opc-sink: listening on port %d\n", sink.getPort());
+
+    float remaining = duration;
+    while (duration < 0 || remaining > 0) {
+        float t = duration < 0 ? interval : std::min(interval, remaining);
+        if (!sink.run(t)) {
+            return 1;
+        }
+        remaining -= t;
+
+        sink.printStats(stdout);
+        fflush(stdout);
+        if (log) {
+            sink.writeLog(log);
+            fflush(log);
+        }
+        sink.clear();
+    }
+
+    if (log) {
+        fclose(log);
+    }
+    return 0;
+}
@@ -20,7 +20,7 @@
 class OrderParticles : public ParticleEffect
 {
 public:
-    OrderParticles(CameraFlowAnalyzer& flow, const rapidjson::Value &config);
+    OrderParticles(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(unsigned seed);
 
     virtual void beginFrame(const FrameInfo &f);
@@ -70,7 +70,7 @@ private:
  *****************************************************************************************/
 
 
-inline OrderParticles::OrderParticles(CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+inline OrderParticles::OrderParticles(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : palette(config["palette"].GetString()),
       numParticles(config["numParticles"].GetUint()),
       centeringGain(config["centeringGain"].GetDouble()),
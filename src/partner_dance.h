@@ -18,7 +18,7 @@
 class PartnerDance : public ParticleEffect
 {
 public:
-    PartnerDance(CameraFlowAnalyzer& flow, const rapidjson::Value &config);
+    PartnerDance(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(uint32_t seed);
 
     virtual void beginFrame(const FrameInfo &f);
@@ -77,7 +77,7 @@ private:
  *****************************************************************************************/
 
 
-inline PartnerDance::PartnerDance(CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+inline PartnerDance::PartnerDance(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : palette(config["palette"].GetString()),
       particlesPerDancer(config["particlesPerDancer"].GetUint()),
       numParticles(particlesPerDancer * numDancers),
@@ -22,7 +22,7 @@
 class Precursor : public Effect
 {
 public:
-    Precursor(const CameraFlowAnalyzer &flow, const rapidjson::Value &config);
+    Precursor(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(unsigned seed);
 
     virtual void beginFrame(const FrameInfo &f);
@@ -48,6 +48,9 @@ private:
     CameraFlowCapture flow;
     Texture palette;
 
+    // This frame's topology, for grid positions without a trip through the layout JSON
+    const LayoutTopology *topology;
+
     float noiseCycle;
     float colorSeed;
     float darknessDurationLimit;
@@ -61,7 +64,7 @@ private:
  *****************************************************************************************/
 
 
-inline Precursor::Precursor(const CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+inline Precursor::Precursor(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : treeGrowth(flow, config["treeGrowth"]),
       flowScale(config["flowScale"].GetDouble()),
       flowFilterRate(config["flowFilterRate"].GetDouble()),
@@ -73,7 +76,8 @@ inline Precursor::Precursor(const CameraFlowAnalyzer& flow, const rapidjson::Val
       darknessDurationMax(config["darknessDurationMax"].GetDouble()),
       darknessThreshold(config["darknessThreshold"].GetDouble()),
       flow(flow),
-      palette(config["palette"].GetString())
+      palette(config["palette"].GetString()),
+      topology(0)
 {
     reseed(42);
 }
@@ -99,6 +103,7 @@ inline void Precursor::reseed(unsigned seed)
 inline void Precursor::beginFrame(const FrameInfo &f)
 {
     flow.capture(flowFilterRate);
+    topology = &f.topology;
     treeGrowth.beginFrame(f);
     noiseCycle += f.timeDelta * noiseRate;
     maxActualBrightness = 0;
@@ -133,8 +138,13 @@ inline void Precursor::debug(const DebugInfo &di)
 
 inline void Precursor::shader(Vec3& rgb, const PixelInfo &p) const
 {
+    // Same as "gridXY", read from a dense array in shading order
+    unsigned block = topology->pixelBlock[p.index];
+    Vec2 gridXY = block == LayoutTopology::kNone ? p.getVec2("gridXY")
+        : Vec2(block % topology->gridWidth, block / topology->gridWidth);
+
     float n = 1.5 + noiseDepth * fbm_noise3(
-        XZ(p.getVec2("gridXY") * noiseScale)
+        XZ(gridXY * noiseScale)
         + flow.model * flowScale
         + Vec3(0, noiseCycle, 0), 4);
 
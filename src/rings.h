@@ -26,7 +26,7 @@
 class RingsEffect : public Effect
 {
 public:
-    RingsEffect(CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+    RingsEffect(const CameraFlowFusion &flow, const rapidjson::Value &config)
         : xyzSpeed(config["xyzSpeed"].GetDouble()),
           xyzScale(config["xyzScale"].GetDouble()),
           flowScale(config["flowScale"].GetDouble()),
@@ -120,13 +120,7 @@ public:
         pixelTotalDenominator = 0;
 
         // Is this 2D or 3D?
-        is3D = false;
-        for (Effect::PixelInfoIter i = f.pixels.begin(), e = f.pixels.end(); i != e; ++i) {
-            const Effect::PixelInfo &p = *i;
-            if (p.point[1] != 0.0f) {
-                is3D = true;
-            }
-        }
+        is3D = f.topology.is3D;
     }
 
     virtual void shader(Vec3& rgb, const PixelInfo &p) const
@@ -21,7 +21,7 @@
 class Explore : public Effect
 {
 public:
-    Explore(CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+    Explore(const CameraFlowFusion &flow, const rapidjson::Value &config)
         : flowScale(config["flowScale"].GetDouble()),
           modelScale(config["modelScale"].GetDouble()),
           startRadius(config["startRadius"].GetDouble()),
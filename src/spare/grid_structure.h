@@ -3,6 +3,10 @@
  * A sense of proprioception.
  * This one, rooted in math rather than observation.
  *
+ * Indices are flat arrays: sorted keys, plus pixel lists in compressed sparse
+ * row form (see LayoutTopology::Lists). Everything is built once, and walking
+ * a row, column, or grid cell touches one contiguous run of memory.
+ *
  * (c) 2014 Micah Elizabeth Scott
  * http://creativecommons.org/licenses/by/3.0/
  */
@@ -10,8 +14,7 @@
 #pragma once
 
 #include <vector>
-#include <map>
-#include <set>
+#include <algorithm>
 #include "lib/effect.h"
 
 
@@ -19,15 +22,48 @@ struct GridStructure
 {
     void init(const Effect::PixelInfoVec &pixels);
 
-    typedef std::set<unsigned> PixelIndexSet;
+    typedef LayoutTopology::Lists PixelLists;
     typedef std::pair<int, int> IntVec;
-    typedef std::map<float, PixelIndexSet> CoordinateIndex;
-    typedef std::map<IntVec, PixelIndexSet> GridIndex;
+
+    static const unsigned kNone = LayoutTopology::kNone;
+
+    // Mapped pixels grouped by their exact coordinate along one axis
+    struct CoordinateIndex {
+        std::vector<float> values;      // Distinct coordinates, ascending
+        PixelLists pixels;              // Pixels at each value, by pixel index
+
+        // Position of a coordinate in 'values', or kNone. Binary search.
+        unsigned find(float value) const;
+    };
 
     CoordinateIndex coordIndex[3];
-    GridIndex gridIndex;
+
+    // Mapped pixels grouped by integer grid cell. Cells are row-major, covering
+    // the bounding box of every "gridXY" in the layout, so lookups are O(1)
+    // and each row of cells is one contiguous run of pixel indices.
+    int gridMinX, gridMinY;
+    unsigned gridWidth, gridHeight;
+    PixelLists gridIndex;
+
+    // Cell number for a grid location, or kNone if it's outside the grid
+    unsigned cell(IntVec xy) const;
+
+    // Pixels in one cell, or in a whole row of cells
+    const unsigned* cellBegin(IntVec xy) const;
+    const unsigned* cellEnd(IntVec xy) const;
+    const unsigned* rowBegin(int y) const;
+    const unsigned* rowEnd(int y) const;
 
     static IntVec intGridXY(const Effect::PixelInfo &pix);
+
+private:
+    struct KeyOrder {
+        const std::vector<float> &keys;
+        KeyOrder(const std::vector<float> &keys) : keys(keys) {}
+        bool operator() (unsigned a, unsigned b) const {
+            return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+        }
+    };
 };
 
 
@@ -38,21 +74,124 @@ struct GridStructure
 
 inline void GridStructure::init(const Effect::PixelInfoVec &pixels)
 {
-    for (unsigned j = 0; j < 3; j++) {
-        coordIndex[j].clear();
-    }
-    gridIndex.clear();
-
+    std::vector<unsigned> mapped;
     for (unsigned i = 0; i < pixels.size(); i++) {
         if (pixels[i].isMapped()) {
-            // Componentwise index
-            for (unsigned j = 0; j < 3; j++) {
-                coordIndex[j][pixels[i].point[j]].insert(i);
+            mapped.push_back(i);
+        }
+    }
+
+    // Componentwise index: sort pixels by coordinate, then split into runs of equal values
+
+    std::vector<float> keys(pixels.size());
+
+    for (unsigned j = 0; j < 3; j++) {
+        CoordinateIndex &c = coordIndex[j];
+
+        for (unsigned i = 0; i < mapped.size(); i++) {
+            keys[mapped[i]] = pixels[mapped[i]].point[j];
+        }
+
+        c.pixels.indices = mapped;
+        std::sort(c.pixels.indices.begin(), c.pixels.indices.end(), KeyOrder(keys));
+
+        c.values.clear();
+        c.pixels.offsets.assign(1, 0);
+        for (unsigned i = 0; i < c.pixels.indices.size(); i++) {
+            float v = keys[c.pixels.indices[i]];
+            if (c.values.empty() || v != c.values.back()) {
+                if (!c.values.empty()) {
+                    c.pixels.offsets.push_back(i);
+                }
+                c.values.push_back(v);
             }
+        }
+        if (!c.values.empty()) {
+            c.pixels.offsets.push_back(c.pixels.indices.size());
+        }
+    }
 
-            gridIndex[intGridXY(pixels[i])].insert(i);
+    // Grid bounds
+
+    std::vector<IntVec> xy(pixels.size());
+    gridMinX = gridMinY = 0;
+    gridWidth = gridHeight = 0;
+
+    for (unsigned i = 0; i < mapped.size(); i++) {
+        IntVec v = xy[mapped[i]] = intGridXY(pixels[mapped[i]]);
+        if (i == 0) {
+            gridMinX = v.first;
+            gridMinY = v.second;
         }
+        gridMinX = std::min(gridMinX, v.first);
+        gridMinY = std::min(gridMinY, v.second);
+    }
+    for (unsigned i = 0; i < mapped.size(); i++) {
+        IntVec v = xy[mapped[i]];
+        gridWidth = std::max<unsigned>(gridWidth, v.first - gridMinX + 1);
+        gridHeight = std::max<unsigned>(gridHeight, v.second - gridMinY + 1);
     }
+
+    // Grid index, by counting sort. Pixels stay in index order within a cell.
+
+    unsigned numCells = gridWidth * gridHeight;
+    gridIndex.offsets.assign(numCells + 1, 0);
+    gridIndex.indices.resize(mapped.size());
+
+    for (unsigned i = 0; i < mapped.size(); i++) {
+        gridIndex.offsets[cell(xy[mapped[i]]) + 1]++;
+    }
+    for (unsigned c = 0; c < numCells; c++) {
+        gridIndex.offsets[c + 1] += gridIndex.offsets[c];
+    }
+
+    std::vector<unsigned> cursor(gridIndex.offsets.begin(), gridIndex.offsets.end() - 1);
+    for (unsigned i = 0; i < mapped.size(); i++) {
+        gridIndex.indices[cursor[cell(xy[mapped[i]])]++] = mapped[i];
+    }
+}
+
+inline unsigned GridStructure::CoordinateIndex::find(float value) const
+{
+    std::vector<float>::const_iterator i = std::lower_bound(values.begin(), values.end(), value);
+    if (i == values.end() || *i != value) {
+        return kNone;
+    }
+    return i - values.begin();
+}
+
+inline unsigned GridStructure::cell(IntVec xy) const
+{
+    int x = xy.first - gridMinX;
+    int y = xy.second - gridMinY;
+    if (x < 0 || x >= int(gridWidth) || y < 0 || y >= int(gridHeight)) {
+        return kNone;
+    }
+    return x + y * gridWidth;
+}
+
+inline const unsigned* GridStructure::cellBegin(IntVec xy) const
+{
+    unsigned c = cell(xy);
+    return c == kNone ? 0 : gridIndex.begin(c);
+}
+
+inline const unsigned* GridStructure::cellEnd(IntVec xy) const
+{
+    unsigned c = cell(xy);
+    return c == kNone ? 0 : gridIndex.end(c);
+}
+
+inline const unsigned* GridStructure::rowBegin(int y) const
+{
+    unsigned c = cell(IntVec(gridMinX, y));
+    return c == kNone ? 0 : gridIndex.begin(c);
+}
+
+inline const unsigned* GridStructure::rowEnd(int y) const
+{
+    unsigned c = cell(IntVec(gridMinX, y));
+    return c == kNone ? 0 : gridIndex.end(c + gridWidth - 1);
 }
 
 inline GridStructure::IntVec GridStructure::intGridXY(const Effect::PixelInfo &pix)
@@ -61,4 +200,3 @@ inline GridStructure::IntVec GridStructure::intGridXY(const Effect::PixelInfo &p
     IntVec r(gridXY[0], gridXY[1]);
     return r;
 }
-
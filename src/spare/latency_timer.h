@@ -11,6 +11,7 @@
 
 #include <math.h>
 #include "lib/camera.h"
+#include "lib/camera_field_store.h"
 #include "lib/effect.h"
 #include "lib/effect_tap.h"
 
@@ -37,8 +38,8 @@ public:
     // symmetric rise and fall times. This turns out to be one NTSC video frame.
     static const float kExpectedDelay = 1.0 / 29.97;
 
-    // Uses EffectTap to test the calibrated delay
-    LatencyTimer(const EffectTap &tap);
+    // Uses EffectTap to test the calibrated delay, and the field store for previous video
+    LatencyTimer(const EffectTap &tap, const CameraFieldStore &store);
 
     // Historgram for calculating camera transfer function and dumping out a CSV.
     void process(const Camera::VideoChunk &chunk);
@@ -51,8 +52,10 @@ private:
     // Data type for brightness accumulators
     typedef int64_t total_t;
 
-    // Fast total brightness estimator
-    uint8_t frame[Camera::kPixels * 2];
+    // Fast total brightness estimator, updated with deltas from the previous same-parity field
+    const CameraFieldStore &store;
+    CameraFieldStore::Ref previous;
+    unsigned previousField;
     total_t frameTotal;
 
     // Filtered brightness average, binned by phase.
@@ -99,27 +102,29 @@ inline float LatencyTimerEffect::brightnessAtPhase(float p)
     return p < 0.5 ? 0.8 : 0;
 }
 
-inline LatencyTimer::LatencyTimer(const EffectTap &tap)
-    : tap(tap)
+inline LatencyTimer::LatencyTimer(const EffectTap &tap, const CameraFieldStore &store)
+    : store(store), previousField(-1), tap(tap)
 {
     frameTotal = 0;
-    memset(frame, 0, sizeof frame);
     memset(phaseBinNumerators, 0, sizeof phaseBinNumerators);
     memset(phaseBinDenominators, 0, sizeof phaseBinDenominators);
 }
 
 inline void LatencyTimer::process(const Camera::VideoChunk &chunk)
 {
-    unsigned offset = chunk.framebufferOffset();
     total_t total = frameTotal;
     unsigned bin = phaseToBin(effect.phase);
 
+    if (chunk.field != previousField) {
+        previous = store.latest(chunk.field);
+        previousField = chunk.field;
+    }
+    const uint8_t *prevData = previous.isValid() ? previous.line(chunk.line) + chunk.byteOffset : 0;
+
     // New total for this frame
     for (unsigned i = 0; i != chunk.byteCount; i++) {
-        uint8_t prev = frame[offset];
+        uint8_t prev = prevData ? prevData[i] : 0;
         uint8_t next = chunk.data[i];
-        frame[offset] = next;
-        offset++;
 
         // Accumulate the square
         total += total_t(next) * total_t(next) - total_t(prev) * total_t(prev);
@@ -128,12 +133,12 @@ inline void LatencyTimer::process(const Camera::VideoChunk &chunk)
 
     // Accumulate into the current phase bin
     phaseBinNumerators[bin] += total;
-    phaseBinDenominators[bin] += sizeof(frame) * 256 * 256;
+    phaseBinDenominators[bin] += total_t(Camera::kPixels * Camera::kBytesPerPixel) * 256 * 256;
 
     // Test the tap delay
     const EffectTap::Frame *tf = tap.get(kExpectedDelay);
     if (tf) {
-        ledTapBins[bin] = tf->colors[0][0];
+        ledTapBins[bin] = tf->color(0)[0];
     }
 }
 
@@ -106,15 +106,8 @@ inline void Pixelator::beginFrame(const FrameInfo& f)
 
     // Resize buffer if necessary
 
-    int newWidth = 0, newHeight = 0;
-
-    for (unsigned i = 0; i < f.pixels.size(); i++) {
-        if (f.pixels[i].isMapped()) {
-            Vec2 gridXY = f.pixels[i].getVec2("gridXY");
-            newWidth = std::max<int>(newWidth, gridXY[0] + 1);
-            newHeight = std::max<int>(newHeight, gridXY[1] + 1);
-        }
-    }
+    int newWidth = f.topology.gridWidth;
+    int newHeight = f.topology.gridHeight;
 
     if (newWidth != bufferWidth || newHeight != bufferHeight) {
         bufferWidth = newWidth;
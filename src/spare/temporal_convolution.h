@@ -1,16 +1,30 @@
 /*
  * Convolution kernel in the time dimension, using data from an EffectTap.
  *
+ * Arbitrary kernels are evaluated directly, reading one tap frame per kernel
+ * sample. Exponential and Gaussian kernels can instead be realized as a cascade
+ * of first-order recursive filters over per-pixel state. That costs the same
+ * no matter how long the kernel is, and only needs the most recent tap frame.
+ *
  * (c) 2014 Micah Elizabeth Scott
  * http://creativecommons.org/licenses/by/3.0/
  */
 
 #pragma once
 
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <vector>
 #include "lib/effect.h"
 #include "lib/effect_tap.h"
 
+#if defined(__SSE__)
+    #include <xmmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 
 class TemporalConvolution : public Effect {
 public:
@@ -22,14 +36,34 @@ public:
     void setKernel(const kernel_t& newKernel, float gain = 1.0f);
     void setGaussian(unsigned numSamples, float stdDeviation, float mean = 0.0f, float gain = 1.0f);
 
+    // Recursive filters. These need a tap with room for at least two frames.
+    void setExponential(float timeConstant, float gain = 1.0f);
+    void setRecursiveGaussian(float stdDeviation, float mean = 0.0f, float gain = 1.0f);
+
     virtual void beginFrame(const FrameInfo& f);
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
     virtual void debug(const DebugInfo &di);
 
 private:
+    static const unsigned kMaxStages = 16;
+
     const EffectTap *tap;
     kernel_t kernel;
     std::vector<const EffectTap::Frame*> frames;
+
+    // Recursive mode, used when 'stages' is nonzero
+    unsigned stages;
+    float timeConstant;
+    float recursiveGain;
+    double lastTime;
+    unsigned numPixels;
+    std::vector<float> state;   // 'stages' blocks of RGB for every pixel, padded
+    unsigned stride;            // Floats per stage
+    unsigned stateOffset;       // First 16-byte aligned float in 'state'
+
+    void setRecursive(unsigned stages, float timeConstant, float gain);
+    void updateRecursive(const FrameInfo& f);
+    static void updateStage(float *output, const float *input, float alpha, unsigned count);
 };
 
 
@@ -39,7 +73,8 @@ private:
 
 
 inline TemporalConvolution::TemporalConvolution()
-    : tap(0)
+    : tap(0), stages(0), timeConstant(0), recursiveGain(0),
+      lastTime(-1), numPixels(0), stride(0), stateOffset(0)
 {}
 
 inline void TemporalConvolution::setTap(const EffectTap *tap)
@@ -55,6 +90,7 @@ inline void TemporalConvolution::setKernel(const kernel_t& newKernel, float gain
     }
 
     float scale = gain / total;
+    stages = 0;
     kernel.resize(newKernel.size());
     for (unsigned i = 0; i < newKernel.size(); ++i) {
         kernel[i] = newKernel[i];
@@ -82,10 +118,114 @@ inline void TemporalConvolution::setGaussian(unsigned numSamples, float stdDevia
     setKernel(k, gain);
 }
 
+inline void TemporalConvolution::setExponential(float timeConstant, float gain)
+{
+    setRecursive(1, timeConstant, gain);
+}
+
+inline void TemporalConvolution::setRecursiveGaussian(float stdDeviation, float mean, float gain)
+{
+    // A cascade of N identical exponential stages with time constant 'tau' has
+    // an impulse response approaching a Gaussian with mean N*tau and variance
+    // N*tau^2. Pick the number of stages that best matches the requested mean,
+    // since that's the one parameter we can't adjust continuously. With no
+    // delay requested, use a few stages for a reasonably Gaussian shape anyway.
+
+    unsigned n = 4;
+    if (mean > 0 && stdDeviation > 0) {
+        n = std::max(1.0f, std::min(float(kMaxStages), sq(mean / stdDeviation) + 0.5f));
+    }
+
+    setRecursive(n, stdDeviation / sqrtf(n), gain);
+}
+
+inline void TemporalConvolution::setRecursive(unsigned stages, float timeConstant, float gain)
+{
+    this->stages = stages;
+    this->timeConstant = timeConstant;
+    this->recursiveGain = gain;
+
+    kernel.clear();
+    frames.clear();
+
+    // Start over from black
+    numPixels = 0;
+    lastTime = -1;
+}
+
+inline void TemporalConvolution::updateStage(float *output, const float *input, float alpha, unsigned count)
+{
+    // One first-order low-pass step: output += alpha * (input - output).
+    // Count is a multiple of four.
+
+#if defined(__SSE__)
+    __m128 a = _mm_set1_ps(alpha);
+    for (unsigned i = 0; i < count; i += 4) {
+        __m128 o = _mm_load_ps(output + i);
+        __m128 d = _mm_sub_ps(_mm_load_ps(input + i), o);
+        _mm_store_ps(output + i, _mm_add_ps(o, _mm_mul_ps(a, d)));
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t a = vdupq_n_f32(alpha);
+    for (unsigned i = 0; i < count; i += 4) {
+        float32x4_t o = vld1q_f32(output + i);
+        float32x4_t d = vsubq_f32(vld1q_f32(input + i), o);
+        vst1q_f32(output + i, vmlaq_f32(o, a, d));
+    }
+#else
+    for (unsigned i = 0; i < count; i++) {
+        output[i] += alpha * (input[i] - output[i]);
+    }
+#endif
+}
+
+inline void TemporalConvolution::updateRecursive(const FrameInfo& f)
+{
+    if (f.pixels.size() != numPixels) {
+        // New layout, reset the filter state. Round each block up to a whole
+        // number of 16-byte vectors, and leave an extra block for the input.
+
+        numPixels = f.pixels.size();
+        stride = (numPixels * 3 + 3) & ~3;
+        state.assign(size_t(stride) * (stages + 1) + 4, 0.0f);
+        stateOffset = (4 - (uintptr_t(&state[0]) / sizeof(float)) % 4) % 4;
+        lastTime = -1;
+    }
+
+    // Feed the filter one new input frame at a time
+    const EffectTap::Frame *input = tap ? tap->latest() : 0;
+    if (!input || input->time == lastTime) {
+        return;
+    }
+
+    double dt = (lastTime < 0 || input->time < lastTime) ? input->timeDelta : input->time - lastTime;
+    lastTime = input->time;
+    float alpha = timeConstant > 0 ? 1.0f - expf(-dt / timeConstant) : 1.0f;
+
+    float *base = &state[stateOffset];
+
+    float *in = base + size_t(stride) * stages;
+    for (unsigned i = 0; i < numPixels; i++) {
+        Vec3 c = input->color(i);
+        in[i*3 + 0] = c[0];
+        in[i*3 + 1] = c[1];
+        in[i*3 + 2] = c[2];
+    }
+
+    for (unsigned s = 0; s < stages; s++) {
+        updateStage(base + size_t(stride) * s, s ? base + size_t(stride) * (s - 1) : in, alpha, stride);
+    }
+}
+
 inline void TemporalConvolution::beginFrame(const FrameInfo& f)
 {
+    if (stages) {
+        updateRecursive(f);
+        return;
+    }
+
     // Begin frame cache
-    
+
     frames.resize(kernel.size());
     for (unsigned i = 0; i < kernel.size(); i++) {
         frames[i] = tap ? tap->get(kernel[i].first) : 0;
@@ -94,13 +234,23 @@ inline void TemporalConvolution::beginFrame(const FrameInfo& f)
 
 inline void TemporalConvolution::shader(Vec3& rgb, const PixelInfo& p) const
 {
+    if (stages) {
+        if (p.index < numPixels) {
+            const float *out = &state[stateOffset + size_t(stride) * (stages - 1) + p.index * 3];
+            rgb = Vec3(out[0], out[1], out[2]) * recursiveGain;
+        } else {
+            rgb = Vec3(0,0,0);
+        }
+        return;
+    }
+
     Vec3 accumulator = Vec3(0,0,0);
 
     for (unsigned i = 0; i < kernel.size(); i++) {
         const EffectTap::Frame *f = frames[i];
         float v = kernel[i].second;
         if (f && v) {
-            accumulator += v * f->colors[p.index];
+            accumulator += v * f->color(p.index);
         }
     }
 
@@ -109,6 +259,12 @@ inline void TemporalConvolution::shader(Vec3& rgb, const PixelInfo& p) const
 
 inline void TemporalConvolution::debug(const DebugInfo &di)
 {
+    if (stages) {
+        fprintf(stderr, "\t[temporal-convolution] recursive, %d stages, tau = %.03f, gain = %.03f\n",
+            stages, timeConstant, recursiveGain);
+        return;
+    }
+
     fprintf(stderr, "\t[temporal-convolution] kernel =");
 
     for (unsigned i = 0; i < kernel.size(); i++) {
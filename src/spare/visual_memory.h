@@ -4,6 +4,20 @@
  * Estimates covariance, as a way to sense the environment.
  * Learns a relationship, LEDs to Camera and back.
  *
+ * The covariance matrix is huge, so it's stored compactly (float, or
+ * 16-bit fixed point) and in tiles of LEDs. Each learning cycle sweeps
+ * one tile at a time across all the camera samples chosen for that
+ * cycle, so the per-LED working set stays in cache, and the inner loop
+ * is vectorized. The chosen rows are split across several learning
+ * threads, which each keep their own recall partials; a barrier at the
+ * end of each cycle lets the main learning thread merge them.
+ *
+ * Most LED / camera sample pairs carry no signal, though. The sparse
+ * format keeps only the strongest kSparseEntries samples for each LED.
+ * A small window of other samples is learned densely for a while, then
+ * anything stronger than an LED's weakest entry replaces it, and the
+ * window moves on. Over time these sweeps rediscover the whole image.
+ *
  * (c) 2014 Micah Elizabeth Scott
  * http://creativecommons.org/licenses/by/3.0/
  */
@@ -17,6 +31,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "lib/camera_sampler.h"
 #include "lib/effect_runner.h"
 #include "lib/jpge.h"
@@ -24,14 +39,32 @@
 #include "lib/prng.h"
 #include "latency_timer.h"
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 
 class VisualMemory
 {
 public:
-    // Starts a dedicated processing thread
-    void start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap);
-
-    // Handle incoming video
+    // Storage for each covariance cell
+    enum Format {
+        kFloat,     // 32-bit float
+        kInt16,     // 16-bit fixed point, with dithered rounding
+        kSparse,    // Only the strongest few camera samples per LED
+    };
+
+    // Camera features are read from a shared field store
+    VisualMemory(const CameraFieldStore &store);
+
+    // Starts dedicated processing threads; by default, one per CPU core. If the
+    // memory file was saved in a different format or size, learning starts over.
+    void start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap,
+        Format format = kFloat, unsigned numThreads = 0);
+
+    // Handle incoming video, after the field store has seen it
     void process(const Camera::VideoChunk &chunk);
 
     // Snapshot memory state as a PNG file
@@ -50,17 +83,68 @@ public:
 private:
     typedef double memory_t;
     typedef std::vector<memory_t> memoryVector_t;
+    typedef std::vector<float> floatVector_t;
+
+    // Covariance tiles hold this many LEDs for every camera sample
+    static const unsigned kTileWidth = 1024;
+
+    // Fixed point scale for kInt16 storage; one unit is 1/32
+    static constexpr float kInt16Scale = 32.0f;
+
+    // Sparse storage: entries per LED, and the rediscovery window
+    static const unsigned kSparseEntries = 64;
+    static const unsigned kProbeSamples = 256;
+    static const unsigned kProbeCycles = 16;
+    static const uint32_t kNoSample = 0xFFFFFFFF;
+
+    struct SparseEntry {
+        uint32_t sample;
+        float value;
+    };
+
+    // First page of the memory file describes its layout
+    struct Header {
+        uint32_t magic;
+        uint32_t format;
+        uint32_t samples;
+        uint32_t leds;
+        uint32_t tileWidth;
+        uint32_t sparseEntries;
+    };
+    static const uint32_t kMagic = 0x6d656d76;
 
     // Persistent mapped memory buffers updated on the learning thread
-    memory_t *covariance;
+    Format format;
+    void *covariance;
     memory_t *sampleExpectedValue;
     memory_t *pixelExpectedValue;
 
+    // LEDs, padded to a whole number of tiles
+    unsigned paddedSize;
+    unsigned numTiles;
+
+    // Sparse storage, kSparseEntries per dense LED, in the same mapping. The probe
+    // learns every sample in a window densely; probeRows are the window's learning
+    // rows this cycle, as (window index, row) pairs.
+    SparseEntry *sparse;
+    floatVector_t probe;
+    std::vector<int> learnRowOf;
+    std::vector< std::pair<unsigned, unsigned> > probeRows;
+    unsigned probeFirst, probeCount, probeCycle;
+    bool probeMerge;
+
     // Recall buffers, updated during learning
     memoryVector_t recallBuffer;
-    memoryVector_t recallAccumulator;
+    floatVector_t recallAccumulator;
     memoryVector_t recallTolerance;
 
+    // Per-cycle learning state
+    floatVector_t ledDelta;             // LED sample minus its expected value, per dense LED
+    floatVector_t dither;               // Rounding noise for fixed point storage
+    std::vector<unsigned> learnRows;    // Camera samples we're learning from this cycle
+    floatVector_t learnSample;          // Camera sample minus its expected value
+    floatVector_t learnRecall;          // Recall weight for each row, zero if not recalling
+
     const EffectTap *tap;
     std::vector<unsigned> denseToSparsePixelIndex;
 
@@ -68,6 +152,31 @@ private:
     tthread::thread *learnThread;
     static void learnThreadFunc(void *context);
 
+    // Each shard learns from a slice of this cycle's rows, on its own thread.
+    // Shard 0 runs on the learning thread itself.
+    struct Shard {
+        VisualMemory *mem;
+        tthread::thread *thread;
+        floatVector_t recallAccumulator;
+        double recallTotal;
+        unsigned firstRow, lastRow;
+        unsigned firstLed, lastLed;
+    };
+    std::vector<Shard*> shards;
+
+    // Cycle barrier. Workers run when shardCycle changes, and the learning
+    // thread waits for shardsPending to reach zero.
+    tthread::mutex shardLock;
+    tthread::condition_variable shardCond;
+    unsigned shardCycle;
+    unsigned shardsPending;
+    static void shardThreadFunc(void *context);
+    void shardWorker(Shard &shard);
+    void learnShard(Shard &shard);
+    void learnSparseShard(Shard &shard);
+    void mergeProbe(unsigned denseIndex);
+    void runShards();
+
     // Learning parameters
     static constexpr memory_t kMotionLearningThreshold = 3e-2;
     static constexpr memory_t kPermeability = 1e-5;
@@ -88,6 +197,17 @@ private:
     // Scalar sample utilities
     memory_t cameraSample(int sample);
     memory_t ledSample(int sparseIndex, const EffectTap::Frame *frame);
+
+    // Covariance access, for debugging
+    size_t cellOffset(unsigned sample, unsigned denseIndex) const;
+    float cell(unsigned sample, unsigned denseIndex) const;
+    void debugPixel(std::vector<uint8_t> &image, unsigned sample, unsigned led, memory_t s) const;
+
+    // Learn one row of one tile. Returns this row's contribution to the recall total.
+    static float learnFloat(float *cells, const float *ledDelta, float *acc,
+        float cSample, float recallWeight);
+    static float learnInt16(int16_t *cells, const float *ledDelta, const float *dither, float *acc,
+        float cSample, float recallWeight);
 };
 
 
@@ -110,37 +230,71 @@ public:
  *****************************************************************************************/
 
 
-inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap)
+inline VisualMemory::VisualMemory(const CameraFieldStore &store)
+    : luminance(store), sobel(store)
+{}
+
+inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap,
+    Format format, unsigned numThreads)
 {
     this->tap = tap;
     const Effect::PixelInfoVec &pixelInfo = runner->getPixelInfo();
 
-    // Make a densely packed pixel index, skipping any unmapped pixels
+    // Make a densely packed pixel index, skipping any unmapped pixels.
+    // Dense order follows the wire, so saved memories don't depend on shading order.
 
-    denseToSparsePixelIndex.clear();
+    std::vector<unsigned> byWire(pixelInfo.size());
     for (unsigned i = 0; i < pixelInfo.size(); ++i) {
-        const Effect::PixelInfo &pixel = pixelInfo[i];
+        byWire[pixelInfo[i].wireIndex] = i;
+    }
+
+    denseToSparsePixelIndex.clear();
+    for (unsigned w = 0; w < byWire.size(); ++w) {
+        const Effect::PixelInfo &pixel = pixelInfo[byWire[w]];
         if (pixel.isMapped()) {
-            denseToSparsePixelIndex.push_back(i);
+            denseToSparsePixelIndex.push_back(pixel.index);
         }
     }
 
     // Calculate size of full visual memory
 
     unsigned denseSize = denseToSparsePixelIndex.size();
-    unsigned cells = CameraSampler8Q::kSamples * denseSize;
-    unsigned mappingSize = sizeof(memory_t) * (cells + denseSize + CameraSampler8Q::kSamples);
+    this->format = format;
+    numTiles = (denseSize + kTileWidth - 1) / kTileWidth;
+    paddedSize = numTiles * kTileWidth;
+
+    size_t cellSize = format == kInt16 ? sizeof(int16_t) : sizeof(float);
+    size_t cells = size_t(CameraSampler8Q::kSamples) * paddedSize;
+    if (format == kSparse) {
+        cellSize = sizeof(SparseEntry);
+        cells = size_t(denseSize) * kSparseEntries;
+    }
     int pagesize = getpagesize();
+    size_t mappingSize = pagesize + cellSize * cells + sizeof(memory_t) * (denseSize + CameraSampler8Q::kSamples);
     mappingSize += pagesize - 1;
     mappingSize -= mappingSize % pagesize;
 
     // Recall and camera buffers
 
     recallBuffer.resize(pixelInfo.size());
-    recallAccumulator.resize(denseSize);
+    recallAccumulator.resize(paddedSize);
     recallTolerance.resize(denseSize);
+    ledDelta.resize(paddedSize);
+    dither.resize(kTileWidth * 2);
 
     std::fill(recallTolerance.begin(), recallTolerance.end(), 0);
+    std::fill(ledDelta.begin(), ledDelta.end(), 0);
+    std::fill(dither.begin(), dither.end(), 0);
+
+    if (format == kSparse) {
+        probe.resize(size_t(denseSize) * kProbeSamples);
+        std::fill(probe.begin(), probe.end(), 0);
+        learnRowOf.resize(CameraSampler8Q::kSamples);
+        std::fill(learnRowOf.begin(), learnRowOf.end(), -1);
+        probeFirst = 0;
+        probeCount = std::min<unsigned>(kProbeSamples, CameraSampler8Q::kSamples);
+        probeCycle = 0;
+    }
 
     // Memory mapped file
 
@@ -150,24 +304,68 @@ inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runn
         return;
     }
 
+    Header expected = { kMagic, format, CameraSampler8Q::kSamples, denseSize, kTileWidth, kSparseEntries };
+    Header existing;
+    bool fresh = false;
+    if (pread(fd, &existing, sizeof existing, 0) != sizeof existing ||
+        memcmp(&existing, &expected, sizeof expected)) {
+        fresh = true;
+
+        // Different layout, or a new file. Zero it and start over.
+        fprintf(stderr, "vismem: Starting new memory in %s\n", memoryPath);
+        if (ftruncate(fd, 0) || pwrite(fd, &expected, sizeof expected, 0) != sizeof expected) {
+            perror("vismem: Error initializing mapping file");
+            close(fd);
+            return;
+        }
+    }
+
     if (ftruncate(fd, mappingSize)) {
         perror("vismem: Error setting length of mapping file");
         close(fd);
         return;
     }
 
-    memory_t *mappedMemory = (memory_t*) mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fd, 0);
+    uint8_t *mappedMemory = (uint8_t*) mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fd, 0);
 
-    if (!mappedMemory) {
+    if (mappedMemory == MAP_FAILED) {
         perror("vismem: Error mapping memory file");
         close(fd);
         return;
     }
 
-    covariance = mappedMemory;
-    sampleExpectedValue = covariance + cells;
+    covariance = mappedMemory + pagesize;
+    sparse = (SparseEntry*) covariance;
+    sampleExpectedValue = (memory_t*) (mappedMemory + pagesize + cellSize * cells);
     pixelExpectedValue = sampleExpectedValue + CameraSampler8Q::kSamples;
 
+    if (fresh && format == kSparse) {
+        // Empty entries, waiting to be discovered
+        for (size_t i = 0; i < cells; i++) {
+            sparse[i].sample = kNoSample;
+            sparse[i].value = 0;
+        }
+    }
+
+    // Shards, and their threads. They wait for the first cycle.
+
+    if (!numThreads) {
+        numThreads = std::max(1u, tthread::thread::hardware_concurrency());
+    }
+    shardCycle = 0;
+    shardsPending = 0;
+
+    for (unsigned i = 0; i < numThreads; i++) {
+        Shard *shard = new Shard;
+        shard->mem = this;
+        shard->thread = 0;
+        shard->recallAccumulator.resize(paddedSize);
+        shards.push_back(shard);
+        if (i) {
+            shard->thread = new tthread::thread(shardThreadFunc, shard);
+        }
+    }
+
     // Let the thread loose. This starts learning right away- no other thread should be
     // writing to the memory buffer from now on.
 
@@ -185,7 +383,6 @@ inline float VisualMemory::recall(unsigned ledIndex) const
 
 inline void VisualMemory::process(const Camera::VideoChunk &chunk)
 {
-    luminance.process(chunk);
     sobel.process(chunk);
 }
 
@@ -197,13 +394,13 @@ inline void VisualMemory::learnThreadFunc(void *context)
 
 inline VisualMemory::memory_t VisualMemory::cameraSample(int sample)
 {
-    int l = luminance.buffer[sample];
+    int l = luminance.sample(sample);
     return (l * l) / memory_t(255 * 255);
 }
 
 inline VisualMemory::memory_t VisualMemory::ledSample(int sparseIndex, const EffectTap::Frame *frame)
 {
-    const Vec3 &led = frame->colors[sparseIndex];
+    Vec3 led = frame->color(sparseIndex);
 
     Real r = std::min(1.0f, led[0]);
     Real g = std::min(1.0f, led[1]);
@@ -212,6 +409,329 @@ inline VisualMemory::memory_t VisualMemory::ledSample(int sparseIndex, const Eff
     return (r*r + g*g + b*b) / 3.0f;
 }
 
+inline size_t VisualMemory::cellOffset(unsigned sample, unsigned denseIndex) const
+{
+    unsigned tile = denseIndex / kTileWidth;
+    unsigned column = denseIndex % kTileWidth;
+    return (size_t(tile) * CameraSampler8Q::kSamples + sample) * kTileWidth + column;
+}
+
+inline float VisualMemory::cell(unsigned sample, unsigned denseIndex) const
+{
+    if (format == kSparse) {
+        const SparseEntry *e = &sparse[size_t(denseIndex) * kSparseEntries];
+        for (unsigned k = 0; k < kSparseEntries; k++) {
+            if (e[k].sample == sample) {
+                return e[k].value;
+            }
+        }
+        return 0;
+    }
+
+    size_t offset = cellOffset(sample, denseIndex);
+    if (format == kInt16) {
+        return static_cast<const int16_t*>(covariance)[offset] * (1.0f / kInt16Scale);
+    }
+    return static_cast<const float*>(covariance)[offset];
+}
+
+inline float VisualMemory::learnFloat(float *cells, const float *ledDelta, float *acc,
+    float cSample, float recallWeight)
+{
+    // For each LED: decay, reinforce with the covariance sample, and accumulate recall
+
+    const float keep = 1.0f - kPermeability;
+
+#if defined(__SSE2__)
+    __m128 vKeep = _mm_set1_ps(keep);
+    __m128 vSample = _mm_set1_ps(cSample);
+    __m128 vWeight = _mm_set1_ps(recallWeight);
+    __m128 vTotal = _mm_setzero_ps();
+
+    for (unsigned i = 0; i < kTileWidth; i += 4) {
+        __m128 state = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(cells + i), vKeep),
+                                  _mm_mul_ps(_mm_loadu_ps(ledDelta + i), vSample));
+        _mm_storeu_ps(cells + i, state);
+        __m128 r = _mm_mul_ps(state, vWeight);
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), r));
+        vTotal = _mm_add_ps(vTotal, r);
+    }
+
+    float t[4];
+    _mm_storeu_ps(t, vTotal);
+    return t[0] + t[1] + t[2] + t[3];
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t vTotal = vdupq_n_f32(0);
+
+    for (unsigned i = 0; i < kTileWidth; i += 4) {
+        float32x4_t state = vmlaq_n_f32(vmulq_n_f32(vld1q_f32(cells + i), keep),
+                                        vld1q_f32(ledDelta + i), cSample);
+        vst1q_f32(cells + i, state);
+        float32x4_t r = vmulq_n_f32(state, recallWeight);
+        vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i), r));
+        vTotal = vaddq_f32(vTotal, r);
+    }
+
+    return vgetq_lane_f32(vTotal, 0) + vgetq_lane_f32(vTotal, 1) +
+           vgetq_lane_f32(vTotal, 2) + vgetq_lane_f32(vTotal, 3);
+
+#else
+    float total = 0;
+    for (unsigned i = 0; i < kTileWidth; i++) {
+        float state = cells[i] * keep + ledDelta[i] * cSample;
+        cells[i] = state;
+        float r = state * recallWeight;
+        acc[i] += r;
+        total += r;
+    }
+    return total;
+#endif
+}
+
+inline float VisualMemory::learnInt16(int16_t *cells, const float *ledDelta, const float *dither, float *acc,
+    float cSample, float recallWeight)
+{
+    // Same as learnFloat, but cells are fixed point. The decay per update is much
+    // smaller than one unit, so rounding is dithered to keep it unbiased on average.
+
+    const float keep = 1.0f - kPermeability;
+
+#if defined(__SSE2__)
+    __m128 vKeep = _mm_set1_ps(keep);
+    __m128 vSample = _mm_set1_ps(cSample);
+    __m128 vWeight = _mm_set1_ps(recallWeight);
+    __m128 vToFloat = _mm_set1_ps(1.0f / kInt16Scale);
+    __m128 vToFixed = _mm_set1_ps(kInt16Scale);
+    __m128 vMax = _mm_set1_ps(32767.0f);
+    __m128 vMin = _mm_set1_ps(-32768.0f);
+    __m128 vTotal = _mm_setzero_ps();
+
+    for (unsigned i = 0; i < kTileWidth; i += 8) {
+        __m128i raw = _mm_loadu_si128((const __m128i*) (cells + i));
+        __m128 state[2] = {
+            _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16)),
+            _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16)),
+        };
+        __m128i fixed[2];
+
+        for (unsigned j = 0; j < 2; j++) {
+            unsigned k = i + j * 4;
+            __m128 s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(state[j], vToFloat), vKeep),
+                                  _mm_mul_ps(_mm_loadu_ps(ledDelta + k), vSample));
+            __m128 r = _mm_mul_ps(s, vWeight);
+            _mm_storeu_ps(acc + k, _mm_add_ps(_mm_loadu_ps(acc + k), r));
+            vTotal = _mm_add_ps(vTotal, r);
+
+            __m128 q = _mm_add_ps(_mm_mul_ps(s, vToFixed), _mm_loadu_ps(dither + k));
+            fixed[j] = _mm_cvtps_epi32(_mm_max_ps(vMin, _mm_min_ps(vMax, q)));
+        }
+
+        _mm_storeu_si128((__m128i*) (cells + i), _mm_packs_epi32(fixed[0], fixed[1]));
+    }
+
+    float t[4];
+    _mm_storeu_ps(t, vTotal);
+    return t[0] + t[1] + t[2] + t[3];
+
+#else
+    float total = 0;
+    for (unsigned i = 0; i < kTileWidth; i++) {
+        float state = cells[i] * (1.0f / kInt16Scale) * keep + ledDelta[i] * cSample;
+        float r = state * recallWeight;
+        acc[i] += r;
+        total += r;
+
+        float q = state * kInt16Scale + dither[i];
+        cells[i] = lrintf(std::max(-32768.0f, std::min(32767.0f, q)));
+    }
+    return total;
+#endif
+}
+
+inline void VisualMemory::shardThreadFunc(void *context)
+{
+    Shard *shard = static_cast<Shard*>(context);
+    shard->mem->shardWorker(*shard);
+}
+
+inline void VisualMemory::shardWorker(Shard &shard)
+{
+    unsigned cycle = 0;
+
+    while (true) {
+        shardLock.lock();
+        while (shardCycle == cycle) {
+            shardCond.wait(shardLock);
+        }
+        cycle = shardCycle;
+        shardLock.unlock();
+
+        learnShard(shard);
+
+        shardLock.lock();
+        shardsPending--;
+        shardCond.notify_all();
+        shardLock.unlock();
+    }
+}
+
+inline void VisualMemory::learnShard(Shard &shard)
+{
+    // One tile at a time, over this shard's rows only. Rows are disjoint between
+    // shards, so the covariance needs no locking; only recall is kept separately.
+
+    shard.recallTotal = 0;
+    std::fill(shard.recallAccumulator.begin(), shard.recallAccumulator.end(), 0);
+
+    if (format == kSparse) {
+        learnSparseShard(shard);
+        return;
+    }
+
+    for (unsigned tile = 0; tile < numTiles; tile++) {
+        const unsigned column = tile * kTileWidth;
+        const float *tileDelta = &ledDelta[column];
+        float *tileAcc = &shard.recallAccumulator[column];
+
+        for (unsigned i = shard.firstRow; i < shard.lastRow; i++) {
+            size_t offset = cellOffset(learnRows[i], column);
+
+            if (format == kInt16) {
+                const float *rowDither = &dither[(i * 97) % kTileWidth];
+                shard.recallTotal += learnInt16(static_cast<int16_t*>(covariance) + offset,
+                    tileDelta, rowDither, tileAcc, learnSample[i], learnRecall[i]);
+            } else {
+                shard.recallTotal += learnFloat(static_cast<float*>(covariance) + offset,
+                    tileDelta, tileAcc, learnSample[i], learnRecall[i]);
+            }
+        }
+    }
+}
+
+inline void VisualMemory::learnSparseShard(Shard &shard)
+{
+    // Sparse shards split up LEDs instead of rows. For each LED, update only the
+    // entries whose samples are learning this cycle, plus the rediscovery probe.
+
+    const float keep = 1.0f - kPermeability;
+
+    for (unsigned denseIndex = shard.firstLed; denseIndex < shard.lastLed; denseIndex++) {
+        SparseEntry *e = &sparse[size_t(denseIndex) * kSparseEntries];
+        float delta = ledDelta[denseIndex];
+        float acc = 0;
+
+        for (unsigned k = 0; k < kSparseEntries; k++) {
+            if (e[k].sample == kNoSample) {
+                continue;
+            }
+            int row = learnRowOf[e[k].sample];
+            if (row < 0) {
+                continue;
+            }
+
+            float state = e[k].value * keep + learnSample[row] * delta;
+            e[k].value = state;
+            acc += state * learnRecall[row];
+        }
+
+        float *p = &probe[size_t(denseIndex) * kProbeSamples];
+        for (unsigned i = 0; i < probeRows.size(); i++) {
+            float &state = p[probeRows[i].first];
+            state = state * keep + learnSample[probeRows[i].second] * delta;
+        }
+
+        if (probeMerge) {
+            mergeProbe(denseIndex);
+        }
+
+        shard.recallAccumulator[denseIndex] = acc;
+        shard.recallTotal += acc;
+    }
+}
+
+inline void VisualMemory::mergeProbe(unsigned denseIndex)
+{
+    // End of a rediscovery sweep. Probe samples stronger than this LED's weakest
+    // entry replace it. Reset the probe for the next window.
+
+    SparseEntry *e = &sparse[size_t(denseIndex) * kSparseEntries];
+    float *p = &probe[size_t(denseIndex) * kProbeSamples];
+
+    unsigned weakest = 0;
+    for (unsigned k = 1; k < kSparseEntries; k++) {
+        if (fabsf(e[k].value) < fabsf(e[weakest].value) || e[k].sample == kNoSample) {
+            weakest = k;
+            if (e[k].sample == kNoSample) {
+                break;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < probeCount; i++) {
+        float v = p[i];
+        p[i] = 0;
+
+        if (e[weakest].sample != kNoSample && fabsf(v) <= fabsf(e[weakest].value)) {
+            continue;
+        }
+
+        // Already have this sample?
+        uint32_t sample = probeFirst + i;
+        bool found = false;
+        for (unsigned k = 0; k < kSparseEntries; k++) {
+            if (e[k].sample == sample) {
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            continue;
+        }
+
+        e[weakest].sample = sample;
+        e[weakest].value = v;
+
+        for (unsigned k = 0; k < kSparseEntries; k++) {
+            if (fabsf(e[k].value) < fabsf(e[weakest].value) || e[k].sample == kNoSample) {
+                weakest = k;
+                if (e[k].sample == kNoSample) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+inline void VisualMemory::runShards()
+{
+    // Split this cycle's rows evenly, release the workers, and do shard 0 ourselves
+
+    unsigned rows = learnRows.size();
+    unsigned n = shards.size();
+    unsigned leds = denseToSparsePixelIndex.size();
+    for (unsigned i = 0; i < n; i++) {
+        shards[i]->firstRow = rows * i / n;
+        shards[i]->lastRow = rows * (i + 1) / n;
+        shards[i]->firstLed = leds * i / n;
+        shards[i]->lastLed = leds * (i + 1) / n;
+    }
+
+    shardLock.lock();
+    shardsPending = n - 1;
+    shardCycle++;
+    shardCond.notify_all();
+    shardLock.unlock();
+
+    learnShard(*shards[0]);
+
+    shardLock.lock();
+    while (shardsPending) {
+        shardCond.wait(shardLock);
+    }
+    shardLock.unlock();
+}
+
 inline void VisualMemory::learnWorker()
 {
     unsigned denseSize = denseToSparsePixelIndex.size();
@@ -227,20 +747,27 @@ inline void VisualMemory::learnWorker()
 
     // Performance counters
     unsigned loopCount = 0;
+    double cellCount = 0;
     struct timeval timeA, timeB;
 
     gettimeofday(&timeA, 0);
     gettimeofday(&timeB, 0);
 
-    // Keep iterating over the memory buffer in the order it's stored
     while (true) {
 
-        // For each cycle, keep an accumulator for the next recall buffer
-        double recallTotal = 0;
-        std::fill(recallAccumulator.begin(), recallAccumulator.end(), 0);
+        // Hold the latest video fields for this cycle
+        luminance.capture();
+
+        // Look up a delayed version of what the LEDs were doing then, to adjust for the system latency
+        const EffectTap::Frame *effectFrame = tap->get(LatencyTimer::kExpectedDelay);
+        if (!effectFrame) {
+            // This frame isn't in our buffer yet
+            usleep(10 * 1000);
+            continue;
+        }
 
         /*
-         * Update expected value filters
+         * Update expected value filters, and the LED deltas we'll learn from this cycle
          */
 
         for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
@@ -250,16 +777,18 @@ inline void VisualMemory::learnWorker()
             sampleExpectedValue[sampleIndex] = ev;
         }
 
-        {
-            const EffectTap::Frame *effectFrame = tap->get(LatencyTimer::kExpectedDelay);
-            if (effectFrame) {
-                for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
-                    unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
-                    memory_t v = ledSample(sparseIndex, effectFrame);
-                    memory_t ev = pixelExpectedValue[denseIndex];
-                    ev += (v * v - ev) * kExpectedValueGain;
-                    pixelExpectedValue[denseIndex] = ev;
-                }
+        for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
+            unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
+            memory_t v = ledSample(sparseIndex, effectFrame);
+            memory_t ev = pixelExpectedValue[denseIndex];
+            ev += (v * v - ev) * kExpectedValueGain;
+            pixelExpectedValue[denseIndex] = ev;
+            ledDelta[denseIndex] = v - ev;
+        }
+
+        if (format == kInt16) {
+            for (unsigned i = 0; i < dither.size(); i++) {
+                dither[i] = prng.uniform(-0.5, 0.5);
             }
         }
 
@@ -298,11 +827,15 @@ inline void VisualMemory::learnWorker()
         }
 
         /*
-         * Big loop, iterate over the huge covariance matrix. We update this matrix
+         * Choose which camera samples to learn from. We update the huge covariance matrix
          * sparsely, using a motion heuristic to avoid learning from areas of the image
          * that aren't moving.
          */
 
+        learnRows.clear();
+        learnSample.clear();
+        learnRecall.clear();
+
         for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
             float motion = sobel.motion[sampleIndex];
 
@@ -319,39 +852,61 @@ inline void VisualMemory::learnWorker()
                 continue;
             }
 
-            // Look up a delayed version of what the LEDs were doing then, to adjust for the system latency
-            const EffectTap::Frame *effectFrame = tap->get(LatencyTimer::kExpectedDelay);
-            if (!effectFrame) {
-                // This frame isn't in our buffer yet
-                usleep(10 * 1000);
-                continue;
-            }
-
-            memory_t* cell = &covariance[sampleIndex * denseSize];
-            memory_t cSample = cameraSample(sampleIndex) - sampleExpectedValue[sampleIndex];
-
             // Recall occurs when we exceed the coordinated motion threshold
             unsigned blockIndex = CameraSampler8Q::blockIndex(sampleIndex);
             bool isRecalling = recallFlags[blockIndex];
 
-            // Learning and occurs on all LEDs for this sample
-            for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++, cell++) {
-                unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
-                memory_t state = *cell;
+            learnRows.push_back(sampleIndex);
+            learnSample.push_back(cameraSample(sampleIndex) - sampleExpectedValue[sampleIndex]);
+            learnRecall.push_back(isRecalling ? motion * motion : 0.0f);
+        }
+
+        /*
+         * Big loop, split across shards. Learning occurs on all LEDs for each chosen sample,
+         * and recall integrates over all of them. Afterwards, merge the shards' recall partials.
+         */
 
-                // Compute covariance incrementally
-                memory_t lSample = ledSample(sparseIndex, effectFrame);
-                memory_t reinforcement = cSample * (lSample - pixelExpectedValue[denseIndex]);
-                state = (state - state * kPermeability) + reinforcement;
-                *cell = state;
+        if (format == kSparse) {
+            // Index rows by sample, and find the rows that fall in the probe window
+            for (unsigned i = 0; i < learnRows.size(); i++) {
+                learnRowOf[learnRows[i]] = i;
+            }
+            probeRows.clear();
+            for (unsigned i = 0; i < probeCount; i++) {
+                int row = learnRowOf[probeFirst + i];
+                if (row >= 0) {
+                    probeRows.push_back(std::make_pair(i, unsigned(row)));
+                }
+            }
+            probeMerge = ++probeCycle >= kProbeCycles;
+        }
 
-                if (isRecalling) {
-                    double acc = motion * motion * state;
+        runShards();
 
-                    // Integrate over all camera samples
-                    recallAccumulator[sparseIndex] += acc;
-                    recallTotal += acc;
+        if (format == kSparse) {
+            for (unsigned i = 0; i < learnRows.size(); i++) {
+                learnRowOf[learnRows[i]] = -1;
+            }
+            if (probeMerge) {
+                // Next window, wrapping around the image
+                probeCycle = 0;
+                probeFirst += probeCount;
+                if (probeFirst >= CameraSampler8Q::kSamples) {
+                    probeFirst = 0;
                 }
+                probeCount = std::min<unsigned>(kProbeSamples, CameraSampler8Q::kSamples - probeFirst);
+            }
+        }
+
+        double recallTotal = shards[0]->recallTotal;
+        std::copy(shards[0]->recallAccumulator.begin(), shards[0]->recallAccumulator.end(),
+            recallAccumulator.begin());
+
+        for (unsigned i = 1; i < shards.size(); i++) {
+            const Shard &shard = *shards[i];
+            recallTotal += shard.recallTotal;
+            for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
+                recallAccumulator[denseIndex] += shard.recallAccumulator[denseIndex];
             }
         }
 
@@ -383,18 +938,45 @@ inline void VisualMemory::learnWorker()
         /*
          * Periodic performance stats
          */
-        
+
         loopCount++;
+        cellCount += format == kSparse
+            ? double(denseSize) * (kSparseEntries + probeRows.size())
+            : double(learnRows.size()) * paddedSize;
         gettimeofday(&timeB, 0);
         double timeDelta = (timeB.tv_sec - timeA.tv_sec) + 1e-6 * (timeB.tv_usec - timeA.tv_usec);
         if (timeDelta > 2.0f) {
-            fprintf(stderr, "vismem: %.02f cycles / second\n", loopCount / timeDelta);
+            fprintf(stderr, "vismem: %.02f cycles / second, %.02f Mcells / second, %d threads\n",
+                loopCount / timeDelta, cellCount * 1e-6 / timeDelta, (int)shards.size());
             loopCount = 0;
+            cellCount = 0;
             timeA = timeB;
         }
     }
 }
 
+inline void VisualMemory::debugPixel(std::vector<uint8_t> &image, unsigned sample, unsigned led, memory_t s) const
+{
+    // Tiled array of camera samples, one per LED. Artificial square grid of LEDs.
+    const int ledsWide = int(ceilf(sqrt(denseToSparsePixelIndex.size())));
+    const int width = ledsWide * CameraSampler8Q::kBlocksWide;
+
+    int sx = CameraSampler8Q::blockX(sample);
+    int sy = CameraSampler8Q::blockY(sample);
+
+    int x = sx + (led % ledsWide) * CameraSampler8Q::kBlocksWide;
+    int y = sy + (led / ledsWide) * CameraSampler8Q::kBlocksHigh;
+
+    uint8_t *pixel = &image[ 3 * (y * width + x) ];
+
+    // Some cheesy HDR, so we can see more detail
+    pixel[0] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
+    s *= 10;
+    pixel[1] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
+    s *= 10;
+    pixel[2] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
+}
+
 inline void VisualMemory::debug(const char *filename) const
 {
     unsigned denseSize = denseToSparsePixelIndex.size();
@@ -407,34 +989,40 @@ inline void VisualMemory::debug(const char *filename) const
     std::vector<uint8_t> image;
     image.resize(width * height * 3);
 
-    // Maximum covariance
-    memory_t cellMax = covariance[0];
-    for (unsigned c = 1; c < (CameraSampler8Q::kSamples * denseSize); c++) {
-        memory_t l = covariance[c];
-        cellMax = std::max(cellMax, l);
-    }
+    if (format == kSparse) {
+        // Only the entries we have; everything else stays black
 
-    fprintf(stderr, "vismem: range %f\n", cellMax);
+        memory_t cellMax = 0;
+        for (size_t i = 0; i < size_t(denseSize) * kSparseEntries; i++) {
+            cellMax = std::max<memory_t>(cellMax, sparse[i].value);
+        }
 
-    for (unsigned sample = 0; sample < CameraSampler8Q::kSamples; sample++) {
-        for (unsigned led = 0; led < denseSize; led++) {
+        fprintf(stderr, "vismem: range %f\n", cellMax);
 
-            int sx = CameraSampler8Q::blockX(sample);
-            int sy = CameraSampler8Q::blockY(sample);
+        for (unsigned led = 0; led < denseSize; led++) {
+            for (unsigned k = 0; k < kSparseEntries; k++) {
+                const SparseEntry &e = sparse[size_t(led) * kSparseEntries + k];
+                if (e.sample != kNoSample) {
+                    debugPixel(image, e.sample, led, e.value / cellMax);
+                }
+            }
+        }
 
-            int x = sx + (led % ledsWide) * CameraSampler8Q::kBlocksWide;
-            int y = sy + (led / ledsWide) * CameraSampler8Q::kBlocksHigh;
+    } else {
+        // Maximum covariance
+        memory_t cellMax = cell(0, 0);
+        for (unsigned sample = 0; sample < CameraSampler8Q::kSamples; sample++) {
+            for (unsigned led = 0; led < denseSize; led++) {
+                cellMax = std::max<memory_t>(cellMax, cell(sample, led));
+            }
+        }
 
-            memory_t cell = covariance[ sample * denseSize + led ];
-            uint8_t *pixel = &image[ 3 * (y * width + x) ];
+        fprintf(stderr, "vismem: range %f\n", cellMax);
 
-            // Some cheesy HDR, so we can see more detail
-            memory_t s = cell / cellMax;
-            pixel[0] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
-            s *= 10;
-            pixel[1] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
-            s *= 10;
-            pixel[2] = std::min<memory_t>(255.5f, s*s*s*s * 255.0f + 0.5f);
+        for (unsigned sample = 0; sample < CameraSampler8Q::kSamples; sample++) {
+            for (unsigned led = 0; led < denseSize; led++) {
+                debugPixel(image, sample, led, cell(sample, led) / cellMax);
+            }
         }
     }
 
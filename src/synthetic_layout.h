@@ -0,0 +1,145 @@
+/*
+ * Synthetic layouts, for trying out installations much bigger than the ones
+ * we've built.
+ *
+ * The model fills roughly the same space as the real 6x12 window, so effect
+ * parameters tuned for the window still look sensible. Pixels are grouped into
+ * blocks with "gridXY" and "blockAngle", like the window's glass blocks.
+ *
+ *   grid:   A flat grid of LEDs in the XZ plane, snaking row by row like
+ *           a zig-zag LED matrix.
+ *   volume: A 3D lattice, also in snake order, with depth along Y.
+ *   cloud:  Randomly placed LEDs in the same box as the volume.
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include "lib/prng.h"
+#include "lib/svl/SVL.h"
+
+
+class SyntheticLayout {
+public:
+    enum Shape { kGrid, kVolume, kCloud };
+
+    // Parse a shape name; returns false if it's unknown
+    static bool parseShape(const char *name, Shape &shape);
+    static const char *shapeName(Shape shape);
+
+    // Write a JSON layout with roughly 'pixels' LEDs. Grids round to whole rows.
+    static bool write(const char *filename, Shape shape, unsigned pixels, unsigned seed = 42);
+
+private:
+    static constexpr float kWidth = 1.8;
+    static constexpr float kHeight = 3.6;
+    static constexpr float kDepth = 0.9;
+    static constexpr float kBlockSize = 0.3;
+
+    static void writePixel(FILE *f, bool first, Vec3 point);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline bool SyntheticLayout::parseShape(const char *name, Shape &shape)
+{
+    for (int s = kGrid; s <= kCloud; s++) {
+        if (!strcmp(name, shapeName(Shape(s)))) {
+            shape = Shape(s);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline const char *SyntheticLayout::shapeName(Shape shape)
+{
+    switch (shape) {
+        case kGrid: return "grid";
+        case kVolume: return "volume";
+        case kCloud: return "cloud";
+    }
+    return "unknown";
+}
+
+inline void SyntheticLayout::writePixel(FILE *f, bool first, Vec3 point)
+{
+    // Block membership from the XZ position, as in the window layout
+
+    float bx = (point[0] + kWidth/2) / kBlockSize;
+    float by = (point[2] + kHeight/2) / kBlockSize;
+    int gridX = std::max(0, int(bx));
+    int gridY = std::max(0, int(by));
+    float angle = atan2f(bx - gridX - 0.5f, by - gridY - 0.5f);
+
+    fprintf(f, "%s\n{\"point\":[%.6f,%.6f,%.6f],\"gridXY\":[%d,%d],\"blockAngle\":%.6f}",
+        first ? "" : ",", point[0], point[1], point[2], gridX, gridY, angle);
+}
+
+inline bool SyntheticLayout::write(const char *filename, Shape shape, unsigned pixels, unsigned seed)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "[");
+    bool first = true;
+
+    if (shape == kGrid) {
+        // Same aspect ratio as the model
+        unsigned cols = std::max(1.0f, roundf(sqrtf(pixels * kWidth / kHeight)));
+        unsigned rows = std::max(1u, (pixels + cols/2) / cols);
+        float spacing = kWidth / cols;
+
+        for (unsigned v = 0; v < rows; v++) {
+            for (unsigned u = 0; u < cols; u++) {
+                unsigned x = (v & 1) ? (cols - 1 - u) : u;
+                writePixel(f, first, Vec3((x + 0.5f) * spacing - kWidth/2, 0,
+                    (v + 0.5f) * kHeight / rows - kHeight/2));
+                first = false;
+            }
+        }
+
+    } else if (shape == kVolume) {
+        float spacing = cbrtf(kWidth * kHeight * kDepth / pixels);
+        unsigned nx = std::max(1.0f, roundf(kWidth / spacing));
+        unsigned ny = std::max(1.0f, roundf(kDepth / spacing));
+        unsigned nz = std::max(1.0f, roundf(kHeight / spacing));
+
+        for (unsigned z = 0; z < nz; z++) {
+            for (unsigned y = 0; y < ny; y++) {
+                for (unsigned u = 0; u < nx; u++) {
+                    unsigned x = ((y + z * ny) & 1) ? (nx - 1 - u) : u;
+                    writePixel(f, first, Vec3((x + 0.5f) * kWidth / nx - kWidth/2,
+                        (y + 0.5f) * kDepth / ny - kDepth/2,
+                        (z + 0.5f) * kHeight / nz - kHeight/2));
+                    first = false;
+                }
+            }
+        }
+
+    } else {
+        PRNG prng;
+        prng.seed(seed);
+
+        for (unsigned i = 0; i < pixels; i++) {
+            writePixel(f, first, Vec3(prng.uniform(-kWidth/2, kWidth/2),
+                prng.uniform(-kDepth/2, kDepth/2), prng.uniform(-kHeight/2, kHeight/2)));
+            first = false;
+        }
+    }
+
+    fprintf(f, "\n]\n");
+    return fclose(f) == 0;
+}
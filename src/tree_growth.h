@@ -18,7 +18,7 @@
 class TreeGrowth : public ParticleEffect
 {
 public:
-    TreeGrowth(const CameraFlowAnalyzer &flow, const rapidjson::Value &config);
+    TreeGrowth(const CameraFlowFusion &flow, const rapidjson::Value &config);
     void reseed(unsigned seed);
 
     virtual void beginFrame(const FrameInfo &f);
@@ -77,7 +77,7 @@ private:
  *****************************************************************************************/
 
 
-inline TreeGrowth::TreeGrowth(const CameraFlowAnalyzer& flow, const rapidjson::Value &config)
+inline TreeGrowth::TreeGrowth(const CameraFlowFusion &flow, const rapidjson::Value &config)
     : maxParticles(config["maxParticles"].GetUint()),
       flowLaunchScale(config["flowLaunchScale"].GetDouble()),
       flowLaunchSpeed(config["flowLaunchSpeed"].GetDouble()),